@@ -0,0 +1,487 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <signal.h>
+
+// Benchmark harness for smallsh.
+// Feeds the shell canned workloads as scripts and reports, for each one,
+// commands per second, p50/p99 latency of one phase of the shell's
+// SMALLSH_TRACE trace (usually "launch", prompt-to-exec) and the shell's peak RSS.
+//
+// Then compares CLIENTS workers that each start a shell per command with
+// the same workers sending their commands to one shell in server mode.
+//
+// Usage: bench/bench [path/to/smallsh] [commands per workload]
+
+#define CLIENTS 16   // concurrent workers in the server comparison
+
+// One timed phase, as written by smallsh (see smallsh-trace.c)
+struct traceRecord
+{
+    uint64_t start;
+    uint32_t duration;
+    uint16_t phase;
+    uint16_t unused;
+};
+
+// A canned workload: writes n command lines to the script
+struct workload
+{
+    const char* name;
+    const char* phase;  // the trace phase whose latency is reported
+    void (*write)(FILE* script, int n, const char* dir);
+    const char* env;    // NAME=value set for the shell, or null
+};
+
+// n trivial programs (by path, so the shell's own true is not used)
+void writeTrue(FILE* script, int n, const char* dir)
+{
+    for (int i = 0; i < n; i++)
+        fprintf(script, "/bin/true\n");
+}
+
+// n commands with many $$ to expand (per-pid temp paths)
+void writeExpansion(FILE* script, int n, const char* dir)
+{
+    for (int i = 0; i < n; i++)
+    {
+        fprintf(script, "/bin/true");
+        for (int j = 0; j < 32; j++)
+            fprintf(script, " %s/tmp.$$.%d.$$", dir, j);
+        fprintf(script, "\n");
+    }
+}
+
+// The same $$ words given to a builtin, so no process is started and the
+// parse phase is the cost of expanding them
+void writeBuiltinExpansion(FILE* script, int n, const char* dir)
+{
+    for (int i = 0; i < n; i++)
+    {
+        fprintf(script, "status");
+        for (int j = 0; j < 32; j++)
+            fprintf(script, " %s/tmp.$$.%d.$$", dir, j);
+        fprintf(script, "\n");
+    }
+}
+
+// n commands that redirect both stdin and stdout
+void writeRedirection(FILE* script, int n, const char* dir)
+{
+    for (int i = 0; i < n; i++)
+        fprintf(script, "cat < %s/input > %s/output\n", dir, dir);
+}
+
+// The same commands with the cache prefix: all but the first are served
+// from the shell's result cache
+void writeCached(FILE* script, int n, const char* dir)
+{
+    for (int i = 0; i < n; i++)
+        fprintf(script, "cache cat < %s/input > %s/output\n", dir, dir);
+}
+
+#define DEPTH 16    // levels of the directory tree the directories workload moves around
+
+// n directory changes around a deep tree (made by main): down and up
+// relative paths, absolute paths, and pushd/popd pairs
+void writeDirectories(FILE* script, int n, const char* dir)
+{
+    for (int i = 0; i < n; i++)
+    {
+        switch (i % 4)
+        {
+            case 0: fprintf(script, "cd %s/deep\n", dir); break;
+            case 1: fprintf(script, "cd d0/d1/d2/d3/d4/d5/d6/d7/d8/d9/d10/d11/d12/d13/d14/d15\n"); break;
+            case 2: fprintf(script, "pushd ../../../..\n"); break;
+            case 3: fprintf(script, "popd\n"); break;
+        }
+    }
+}
+
+// n background jobs, started in bursts of 100
+void writeBackground(FILE* script, int n, const char* dir)
+{
+    for (int i = 0; i < n; i++)
+    {
+        fprintf(script, "true &\n");
+        if (i % 100 == 99)
+            fprintf(script, "sleep 0.01\n");
+    }
+    fprintf(script, "sleep 0.2\n");
+}
+
+// n long lines of quoted, escaped and $$ words given to a builtin, so the
+// shell does nothing but read and parse them
+void writeParse(FILE* script, int n, const char* dir)
+{
+    for (int i = 0; i < n; i++)
+    {
+        fprintf(script, "status");
+        for (int j = 0; j < 16; j++)
+            fprintf(script, " plain%d 'single quoted %d' \"double \\\"%d\\\" $$\" esc\\ aped\t%s/f.$$", j, j, j, dir);
+        fprintf(script, "\n");
+    }
+}
+
+// n lines of words made of variables and $? given to a builtin, so only
+// reading, parsing and expansion are measured
+void writeVariables(FILE* script, int n, const char* dir)
+{
+    for (int i = 0; i < n; i++)
+    {
+        fprintf(script, "status");
+        for (int j = 0; j < 16; j++)
+            fprintf(script, " $HOME/${BENCH_VAR}.%d \"$BENCH_VAR $?\" $BENCH_UNSET", j);
+        fprintf(script, "\n");
+    }
+}
+
+// n commands of the kind generated scripts are full of: echo, test, [, pwd
+// and true, named as given in names
+void writeUtilityCommands(FILE* script, int n, const char* dir, const char* names[])
+{
+    for (int i = 0; i < n; i++)
+    {
+        switch (i % 5)
+        {
+            case 0: fprintf(script, "%s line %d of the script\n", names[0], i); break;
+            case 1: fprintf(script, "%s -d %s\n", names[1], dir); break;
+            case 2: fprintf(script, "%s %d -lt 100 ]\n", names[2], i); break;
+            case 3: fprintf(script, "%s > %s/output\n", names[3], dir); break;
+            case 4: fprintf(script, "%s\n", names[4]); break;
+        }
+    }
+}
+
+// The utilities, run by the shell itself
+void writeUtilities(FILE* script, int n, const char* dir)
+{
+    const char* names[] = {"echo", "test", "[", "pwd", "true"};
+    writeUtilityCommands(script, n, dir, names);
+}
+
+// The same commands run as programs
+void writeUtilityPrograms(FILE* script, int n, const char* dir)
+{
+    const char* names[] = {"/bin/echo", "/usr/bin/test", "/usr/bin/[", "/bin/pwd", "/bin/true"};
+    writeUtilityCommands(script, n, dir, names);
+}
+
+struct workload workloads[] =
+{
+    {"true", "launch", writeTrue},
+    {"expansion", "launch", writeExpansion},
+    {"expand-only", "parse", writeBuiltinExpansion},
+    {"redirection", "launch", writeRedirection},
+    {"background", "launch", writeBackground},
+    {"parse", "parse", writeParse},
+    {"variables", "parse", writeVariables, "BENCH_VAR=a-value-of-some-length"},
+    {"zygote", "launch", writeTrue, "SMALLSH_ZYGOTE=4"},
+    {"utilities", "builtin", writeUtilities},
+    {"utility-prog", "launch", writeUtilityPrograms},
+    {"cached", "parse", writeCached},
+    {"directories", "builtin", writeDirectories},
+};
+
+// For qsort()
+int compareDurations(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*) a;
+    uint32_t y = *(const uint32_t*) b;
+    return (x > y) - (x < y);
+}
+
+// Reads the durations of one phase out of a trace file.
+// Returns the number of durations stored in *durations (malloc'd).
+size_t readPhase(const char* tracePath, const char* phaseName, uint32_t** durations)
+{
+    FILE* file = fopen(tracePath, "rb");
+    char header[16];
+    char name[16];
+    uint32_t numPhases;
+    int phase = -1;
+    size_t count = 0, capacity = 1024;
+    struct traceRecord r;
+
+    *durations = malloc(capacity * sizeof(uint32_t));
+    if (file == NULL || fread(header, 1, 16, file) != 16 || memcmp(header, "SMSHTRC1", 8) != 0)
+    {
+        if (file != NULL)
+            fclose(file);
+        return 0;
+    }
+    memcpy(&numPhases, header + 8, sizeof(numPhases));
+    for (uint32_t i = 0; i < numPhases && fread(name, 1, 16, file) == 16; i++)
+    {
+        if (strncmp(name, phaseName, 16) == 0)
+            phase = i;
+    }
+
+    while (fread(&r, sizeof(r), 1, file) == 1)
+    {
+        if (r.phase != phase)
+            continue;
+        if (count == capacity)
+        {
+            capacity *= 2;
+            *durations = realloc(*durations, capacity * sizeof(uint32_t));
+        }
+        (*durations)[count++] = r.duration;
+    }
+    fclose(file);
+    return count;
+}
+
+// Runs one workload and prints its row of results
+void runWorkload(const char* shell, struct workload* w, int n, const char* dir)
+{
+    char scriptPath[4096], tracePath[4096];
+    snprintf(scriptPath, sizeof(scriptPath), "%s/%s.sh", dir, w->name);
+    snprintf(tracePath, sizeof(tracePath), "%s/%s.trace", dir, w->name);
+
+    FILE* script = fopen(scriptPath, "w");
+    w->write(script, n, dir);
+    fclose(script);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(devNull, STDOUT_FILENO);
+        setenv("SMALLSH_TRACE", tracePath, 1);
+        if (w->env != NULL)
+            putenv((char*) w->env);
+        execl(shell, shell, scriptPath, (char*) NULL);
+        perror(shell);
+        _exit(127);
+    }
+
+    int status;
+    struct rusage ru;
+    wait4(pid, &status, 0, &ru);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double seconds = (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+
+    uint32_t* latencies;
+    size_t count = readPhase(tracePath, w->phase, &latencies);
+    double p50 = 0, p99 = 0;
+    if (count > 0)
+    {
+        qsort(latencies, count, sizeof(uint32_t), compareDurations);
+        p50 = latencies[(size_t) (0.50 * (count - 1) + 0.5)] / 1000.0;
+        p99 = latencies[(size_t) (0.99 * (count - 1) + 0.5)] / 1000.0;
+    }
+    free(latencies);
+
+    printf("%-12s %8d %10.0f %-8s %8.1f %10.1f %10ld%s\n", w->name, n, n / seconds, w->phase, p50, p99, ru.ru_maxrss,
+           WIFEXITED(status) && WEXITSTATUS(status) != 127 ? "" : "  (shell failed)");
+    fflush(stdout);
+    unlink(scriptPath);
+    unlink(tracePath);
+}
+
+// Seconds since start
+double secondsSince(const struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// CLIENTS workers, each running its share of n commands with a shell of its
+// own per command (smallsh -c /bin/true)
+void runWorkers(const char* shell, int n)
+{
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t workers[CLIENTS];
+    for (int c = 0; c < CLIENTS; c++)
+    {
+        if ((workers[c] = fork()) != 0)
+            continue;
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(devNull, STDOUT_FILENO);
+        for (int i = 0; i < n / CLIENTS; i++)
+        {
+            pid_t pid = fork();
+            if (pid == 0)
+            {
+                execl(shell, shell, "-c", "/bin/true", (char*) NULL);
+                _exit(127);
+            }
+            waitpid(pid, NULL, 0);
+        }
+        _exit(0);
+    }
+    long peak = 0;
+    for (int c = 0; c < CLIENTS; c++)
+    {
+        struct rusage ru;   // (covers the worker's shells too)
+        wait4(workers[c], NULL, 0, &ru);
+        if (ru.ru_maxrss > peak)
+            peak = ru.ru_maxrss;
+    }
+    double seconds = secondsSince(&start);
+
+    printf("%-12s %8d %10.0f %-8s %8s %10s %10ld  (%d shells at a time)\n", "workers", n / CLIENTS * CLIENTS,
+           n / CLIENTS * CLIENTS / seconds, "-", "-", "-", peak, CLIENTS);
+    fflush(stdout);
+}
+
+// The same commands sent by CLIENTS workers at once to one shell running
+// as a server (smallsh --listen). Each worker sends all of its lines, then
+// reads the replies until the server closes the connection (the replies
+// are small enough to wait in the socket's buffer meanwhile).
+void runServer(const char* shell, int n, const char* dir)
+{
+    char socketPath[4096], tracePath[4096];
+    snprintf(socketPath, sizeof(socketPath), "%s/sock", dir);
+    snprintf(tracePath, sizeof(tracePath), "%s/server.trace", dir);
+
+    pid_t server = fork();
+    if (server == 0)
+    {
+        int devNull = open("/dev/null", O_WRONLY);
+        dup2(devNull, STDOUT_FILENO);
+        setenv("SMALLSH_TRACE", tracePath, 1);
+        execl(shell, shell, "--listen", socketPath, (char*) NULL);
+        perror(shell);
+        _exit(127);
+    }
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    memcpy(addr.sun_path, socketPath, strlen(socketPath) < sizeof(addr.sun_path) ? strlen(socketPath) : sizeof(addr.sun_path) - 1);
+    for (int tries = 0; tries < 100 && access(socketPath, F_OK) == -1; tries++)
+        usleep(10000);
+
+    int perClient = n / CLIENTS;
+    char* lines = malloc(perClient * 10 + 1);
+    for (int i = 0; i < perClient; i++)
+        memcpy(lines + i * 10, "/bin/true\n", 10);
+
+    struct timespec start;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pid_t clients[CLIENTS];
+    for (int c = 0; c < CLIENTS; c++)
+    {
+        if ((clients[c] = fork()) != 0)
+            continue;
+        int sock = socket(AF_UNIX, SOCK_STREAM, 0);
+        if (connect(sock, (struct sockaddr*) &addr, sizeof(addr)) == -1)
+        {
+            perror(socketPath);
+            _exit(1);
+        }
+
+        // The commands' stdin, stdout and stderr go with the first line
+        int devNull = open("/dev/null", O_RDWR);
+        int fds[3] = {devNull, devNull, devNull};
+        char control[CMSG_SPACE(sizeof(fds))] = {0};
+        struct iovec iov = {lines, perClient * 10};
+        struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(sizeof(fds));
+        memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+        ssize_t sent = sendmsg(sock, &msg, 0);
+        while (sent > 0 && sent < perClient * 10)
+        {
+            ssize_t more = write(sock, lines + sent, perClient * 10 - sent);
+            sent = more > 0 ? sent + more : -1;
+        }
+        shutdown(sock, SHUT_WR);
+
+        char reply[4096];
+        while (read(sock, reply, sizeof(reply)) > 0)
+            ;
+        _exit(0);
+    }
+    for (int c = 0; c < CLIENTS; c++)
+        waitpid(clients[c], NULL, 0);
+    double seconds = secondsSince(&start);
+    free(lines);
+
+    int status;
+    struct rusage ru;
+    kill(server, SIGTERM);
+    wait4(server, &status, 0, &ru);
+
+    uint32_t* latencies;
+    size_t count = readPhase(tracePath, "launch", &latencies);
+    double p50 = 0, p99 = 0;
+    if (count > 0)
+    {
+        qsort(latencies, count, sizeof(uint32_t), compareDurations);
+        p50 = latencies[(size_t) (0.50 * (count - 1) + 0.5)] / 1000.0;
+        p99 = latencies[(size_t) (0.99 * (count - 1) + 0.5)] / 1000.0;
+    }
+    free(latencies);
+
+    printf("%-12s %8d %10.0f %-8s %8.1f %10.1f %10ld  (%d clients of one shell)\n", "server", perClient * CLIENTS,
+           perClient * CLIENTS / seconds, "launch", p50, p99, ru.ru_maxrss, CLIENTS);
+    fflush(stdout);
+    unlink(tracePath);
+}
+
+int main(int argc, char *argv[])
+{
+    const char* shell = argc > 1 ? argv[1] : "./smallsh";
+    int n = argc > 2 ? atoi(argv[2]) : 2000;
+    char dir[] = "/tmp/smallsh-bench-XXXXXX";
+    char path[4096];
+
+    if (mkdtemp(dir) == NULL)
+    {
+        perror("mkdtemp()");
+        return 1;
+    }
+
+    // Input for the redirection workload
+    snprintf(path, sizeof(path), "%s/input", dir);
+    FILE* input = fopen(path, "w");
+    for (int i = 0; i < 100; i++)
+        fprintf(input, "line %d of the redirection input\n", i);
+    fclose(input);
+
+    // The tree for the directories workload
+    size_t len = snprintf(path, sizeof(path), "%s/deep", dir);
+    mkdir(path, 0700);
+    for (int i = 0; i < DEPTH; i++)
+    {
+        len += snprintf(path + len, sizeof(path) - len, "/d%d", i);
+        mkdir(path, 0700);
+    }
+
+    printf("%-12s %8s %10s %-8s %8s %10s %10s\n", "workload", "commands", "cmds/s", "phase", "p50 us", "p99 us", "peak KB");
+    for (size_t i = 0; i < sizeof(workloads) / sizeof(workloads[0]); i++)
+        runWorkload(shell, &workloads[i], n, dir);
+    runWorkers(shell, n);
+    runServer(shell, n, dir);
+
+    for (int i = DEPTH; i >= 0; i--)
+    {
+        rmdir(path);
+        *strrchr(path, '/') = '\0';
+    }
+    snprintf(path, sizeof(path), "%s/input", dir);
+    unlink(path);
+    snprintf(path, sizeof(path), "%s/output", dir);
+    unlink(path);
+    rmdir(dir);
+    return 0;
+}
@@ -0,0 +1,204 @@
+// Fuzz target for smallsh's command line parser: feeds arbitrary bytes
+// through parseCommand() (the quote-aware in-place lexer and $ expansion)
+// over an arena, as the shell does with each line it reads, and resets the
+// arena after each input. Every string of a parsed command is read back, so
+// the sanitizers see any word that points outside its line or the arena.
+//
+// Built with clang, it is a libFuzzer target (make fuzz). With
+// -DFUZZ_STANDALONE it gets a main() of its own that takes the same
+// arguments (files and corpus directories, -runs=N to mutate them N times
+// at random and -seed=N to repeat a run), or reads one input from stdin,
+// as AFL runs it.
+#define main smallshMain
+#include "../smallsh.c"
+#undef main
+
+struct arena fuzzArena;
+
+// Reads every string the parser stored in a command, so a bad pointer is
+// caught where it is made rather than when a command is run
+size_t touchCommand(struct userCommand* com)
+{
+    size_t total = 0;
+    for (; com != NULL; com = com->next)
+    {
+        for (int i = 0; com->complete[i] != NULL; i++)
+            total += strlen(com->complete[i]);
+        if (com->inputFile != NULL) total += strlen(com->inputFile);
+        if (com->outputFile != NULL) total += strlen(com->outputFile);
+        if (com->errorFile != NULL) total += strlen(com->errorFile);
+        if (com->hereDelimiter != NULL) total += strlen(com->hereDelimiter);
+        for (size_t i = 0; com->hereText != NULL && i < com->hereLength; i++)
+            total += (unsigned char) com->hereText[i];
+        total += com->command != NULL ? strlen(com->command) : 0;
+    }
+    return total;
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
+{
+    static bool ready = false;
+    if (!ready)
+    {
+        // What a shell has before it reads its first line ($$ and the
+        // variables). Its complaints about syntax go nowhere; the
+        // sanitizers' reports still reach descriptor 2.
+        cacheShellPid();
+        initVariables();
+        arenaInit(&fuzzArena, ARENA_SIZE);
+        stderr = fopen("/dev/null", "w");
+        ready = true;
+    }
+
+    // The shell hands the parser one line at a time, without its newline. It
+    // gets a buffer of its own, so reading past the line is caught.
+    char* line = malloc(size + 1);
+    memcpy(line, data, size);
+    line[size] = '\0';
+    char* newline = memchr(line, '\n', size);
+    if (newline != NULL)
+        *newline = '\0';
+
+    struct userCommand* com = parseCommand(&fuzzArena, line);
+    volatile size_t sink = touchCommand(com);
+    (void) sink;
+    arenaReset(&fuzzArena);
+    free(line);
+    return 0;
+}
+
+#ifdef FUZZ_STANDALONE
+#include <dirent.h>
+
+// The inputs given on the command line (the corpus)
+struct corpus
+{
+    uint8_t** data;
+    size_t* size;
+    size_t count;
+};
+
+// Adds the file at path to the corpus and runs it once
+void addInput(struct corpus* c, const char* path)
+{
+    FILE* file = fopen(path, "rb");
+    if (file == NULL)
+    {
+        perror(path);
+        exit(2);
+    }
+    uint8_t* data = malloc(65536);
+    size_t size = fread(data, 1, 65536, file);
+    fclose(file);
+
+    c->data = realloc(c->data, (c->count + 1) * sizeof(uint8_t*));
+    c->size = realloc(c->size, (c->count + 1) * sizeof(size_t));
+    c->data[c->count] = data;
+    c->size[c->count] = size;
+    c->count++;
+    LLVMFuzzerTestOneInput(data, size);
+}
+
+// Copies a random corpus input into out with a few random changes
+// (overwritten, inserted and removed bytes, biased towards the characters
+// the lexer cares about). Returns the new size.
+size_t mutate(const struct corpus* c, uint8_t* out, size_t capacity)
+{
+    static const char interesting[] = " \t'\"\\$<>|&#2\n";
+    size_t pick = random() % c->count;
+    size_t size = c->size[pick] < capacity ? c->size[pick] : capacity;
+    memcpy(out, c->data[pick], size);
+
+    for (int changes = 1 + random() % 4; changes > 0; changes--)
+    {
+        uint8_t byte = random() % 2 ? interesting[random() % (sizeof(interesting) - 1)] : random() % 256;
+        size_t at = size > 0 ? random() % (size + 1) : 0;
+        switch (random() % 3)
+        {
+            case 0:     // overwrite
+                if (at < size)
+                {
+                    out[at] = byte;
+                    break;
+                }
+                // fall through
+            case 1:     // insert
+                if (size < capacity)
+                {
+                    memmove(out + at + 1, out + at, size - at);
+                    out[at] = byte;
+                    size++;
+                }
+                break;
+            default:    // remove
+                if (at < size)
+                {
+                    memmove(out + at, out + at + 1, size - at - 1);
+                    size--;
+                }
+                break;
+        }
+    }
+    return size;
+}
+
+int main(int argc, char* argv[])
+{
+    struct corpus c = {0};
+    long runs = 0;
+    unsigned seed = time(NULL) ^ getpid();
+
+    for (int i = 1; i < argc; i++)
+    {
+        if (strncmp(argv[i], "-runs=", 6) == 0)
+        {
+            runs = atol(argv[i] + 6);
+            continue;
+        }
+        if (strncmp(argv[i], "-seed=", 6) == 0)
+        {
+            seed = strtoul(argv[i] + 6, NULL, 10);
+            continue;
+        }
+        DIR* d = opendir(argv[i]);
+        if (d == NULL)
+        {
+            addInput(&c, argv[i]);
+            continue;
+        }
+        struct dirent* e;
+        while ((e = readdir(d)) != NULL)
+        {
+            char path[PATH_MAX];
+            snprintf(path, sizeof(path), "%s/%s", argv[i], e->d_name);
+            struct stat st;
+            if (stat(path, &st) == 0 && S_ISREG(st.st_mode))
+                addInput(&c, path);
+        }
+        closedir(d);
+    }
+
+    // No inputs: one from stdin (as AFL runs it)
+    if (c.count == 0)
+    {
+        static uint8_t data[65536];
+        size_t size = fread(data, 1, sizeof(data), stdin);
+        LLVMFuzzerTestOneInput(data, size);
+        return 0;
+    }
+
+    static uint8_t input[4096];
+    printf("seed %u\n", seed);     // (to repeat a run that found something)
+    fflush(stdout);
+    srandom(seed);
+    for (long run = 0; run < runs; run++)
+        LLVMFuzzerTestOneInput(input, mutate(&c, input, sizeof(input)));
+    printf("%zu inputs, %ld mutations: no errors\n", c.count, runs);
+
+    for (size_t i = 0; i < c.count; i++)
+        free(c.data[i]);
+    free(c.data);
+    free(c.size);
+    return 0;
+}
+#endif
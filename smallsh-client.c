@@ -0,0 +1,178 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+
+// Runs commands in a smallsh server (smallsh --listen socket) instead of a
+// shell of its own.
+//
+// Usage: smallsh-client socket command...   run one command line, with this
+//                                          program's stdin, stdout and stderr
+//        smallsh-client socket             run the lines read from stdin
+//                                          (their stdin is /dev/null)
+//
+// Background jobs are reported as the shell reports them, and the client
+// waits for them before exiting. The exit status is that of the last line.
+
+// Sends len bytes to the server, with the descriptors fds[0..2] attached
+// to them if fds is not null. Returns false if the server has gone.
+bool sendToServer(int sock, const char* bytes, size_t len, const int* fds)
+{
+    char control[CMSG_SPACE(3 * sizeof(int))] = {0};
+    struct iovec iov = {(char*) bytes, len};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1};
+
+    if (fds != NULL)
+    {
+        msg.msg_control = control;
+        msg.msg_controllen = sizeof(control);
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(3 * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, 3 * sizeof(int));
+    }
+
+    while (len > 0)
+    {
+        ssize_t n = sendmsg(sock, &msg, MSG_NOSIGNAL);
+        if (n == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("send()");
+            return false;
+        }
+        iov.iov_base = (char*) iov.iov_base + n;
+        iov.iov_len -= n;
+        len -= n;
+        msg.msg_control = NULL;     // the descriptors went with the first bytes
+        msg.msg_controllen = 0;
+    }
+    return true;
+}
+
+// Acts on one reply line from the server. Returns the status it gives, or
+// -1 if it is not a status line.
+int handleReply(const char* line)
+{
+    int pid, status;
+
+    if (sscanf(line, "status %d", &status) == 1)
+        return status;
+    if (sscanf(line, "background %d", &pid) == 1)
+        printf("background pid is %d\n", pid);
+    else if (sscanf(line, "done %d %d", &pid, &status) == 2)
+        printf("background pid %d is done: exit value: %d\n", pid, status);
+    fflush(stdout);
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "usage: smallsh-client socket [command...]\n");
+        return 2;
+    }
+
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(argv[1]) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "%s: socket path too long\n", argv[1]);
+        return 2;
+    }
+    strcpy(addr.sun_path, argv[1]);
+    int sock = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (sock == -1 || connect(sock, (struct sockaddr*) &addr, sizeof(addr)) == -1)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    // A command given as arguments is the only line; it reads our stdin
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    bool readingLines = argc == 2;
+    if (!readingLines)
+    {
+        size_t size = 2;
+        for (int i = 2; i < argc; i++)
+            size += strlen(argv[i]) + 1;
+        char* line = malloc(size);
+        char* out = line;
+        for (int i = 2; i < argc; i++)
+            out += sprintf(out, i > 2 ? " %s" : "%s", argv[i]);
+        strcpy(out, "\n");
+        if (!sendToServer(sock, line, strlen(line), fds))
+            return 1;
+        free(line);
+        shutdown(sock, SHUT_WR);
+    }
+    else
+    {
+        fds[0] = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    }
+
+    // Pass lines on until stdin ends, and act on the replies until the
+    // server closes the connection (once every job has finished)
+    char input[65536], reply[4096];
+    size_t replyUsed = 0;
+    bool sentFDs = !readingLines;
+    int status = 0;
+    while (true)
+    {
+        struct pollfd pfds[2] = {{sock, POLLIN, 0}, {STDIN_FILENO, POLLIN, 0}};
+        if (poll(pfds, readingLines ? 2 : 1, -1) == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("poll()");
+            return 1;
+        }
+
+        if (readingLines && pfds[1].revents != 0)
+        {
+            ssize_t n = read(STDIN_FILENO, input, sizeof(input));
+            if (n <= 0)
+            {
+                readingLines = false;
+                shutdown(sock, SHUT_WR);
+            }
+            else if (!sendToServer(sock, input, n, sentFDs ? NULL : fds))
+            {
+                return 1;
+            }
+            sentFDs = true;
+        }
+
+        if (pfds[0].revents != 0)
+        {
+            ssize_t n = read(sock, reply + replyUsed, sizeof(reply) - replyUsed);
+            if (n <= 0)
+                break;
+            replyUsed += n;
+
+            char* start = reply;
+            char* newline;
+            while ((newline = memchr(start, '\n', reply + replyUsed - start)) != NULL)
+            {
+                *newline = '\0';
+                int lineStatus = handleReply(start);
+                if (lineStatus != -1)
+                    status = lineStatus;
+                start = newline + 1;
+            }
+            replyUsed -= start - reply;
+            memmove(reply, start, replyUsed);
+        }
+    }
+    close(sock);
+    return status > 255 ? 255 : status;
+}
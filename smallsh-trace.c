@@ -0,0 +1,129 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+
+// Summarizes a trace written by smallsh (SMALLSH_TRACE=file):
+// for every phase, how many times it ran and its latency percentiles.
+//
+// Usage: smallsh-trace trace_file
+
+// One timed phase, as written by smallsh
+struct traceRecord
+{
+    uint64_t start;
+    uint32_t duration;
+    uint16_t phase;
+    uint16_t unused;
+};
+
+// The durations recorded for one phase
+struct phaseTimes
+{
+    char name[16];
+    uint32_t* durations;
+    size_t count;
+    size_t capacity;
+};
+
+// For qsort()
+int compareDurations(const void* a, const void* b)
+{
+    uint32_t x = *(const uint32_t*) a;
+    uint32_t y = *(const uint32_t*) b;
+    return (x > y) - (x < y);
+}
+
+// Returns the pth percentile of sorted durations, in microseconds
+double percentile(struct phaseTimes* p, double pth)
+{
+    size_t index = (size_t) (pth / 100.0 * (p->count - 1) + 0.5);
+    return p->durations[index] / 1000.0;
+}
+
+int main(int argc, char *argv[])
+{
+    char magic[8];
+    uint32_t numPhases;
+    uint32_t unused;
+
+    if (argc != 2)
+    {
+        fprintf(stderr, "usage: smallsh-trace trace_file\n");
+        return 2;
+    }
+
+    FILE* file = fopen(argv[1], "rb");
+    if (file == NULL)
+    {
+        perror(argv[1]);
+        return 1;
+    }
+
+    // The header names the phases
+    if (fread(magic, 1, 8, file) != 8 || memcmp(magic, "SMSHTRC1", 8) != 0
+        || fread(&numPhases, 4, 1, file) != 1 || fread(&unused, 4, 1, file) != 1)
+    {
+        fprintf(stderr, "%s: not a smallsh trace\n", argv[1]);
+        return 1;
+    }
+    struct phaseTimes* phases = calloc(numPhases, sizeof(struct phaseTimes));
+    for (uint32_t i = 0; i < numPhases; i++)
+    {
+        if (fread(phases[i].name, 1, 16, file) != 16)
+        {
+            fprintf(stderr, "%s: truncated header\n", argv[1]);
+            return 1;
+        }
+        phases[i].name[15] = '\0';
+    }
+
+    // Sort every record into its phase
+    struct traceRecord records[4096];
+    size_t numRecords;
+    uint64_t first = UINT64_MAX, last = 0;
+    while ((numRecords = fread(records, sizeof(struct traceRecord), 4096, file)) > 0)
+    {
+        for (size_t i = 0; i < numRecords; i++)
+        {
+            struct traceRecord* r = &records[i];
+            if (r->phase >= numPhases)
+                continue;
+
+            struct phaseTimes* p = &phases[r->phase];
+            if (p->count == p->capacity)
+            {
+                p->capacity = p->capacity ? p->capacity * 2 : 1024;
+                p->durations = realloc(p->durations, p->capacity * sizeof(uint32_t));
+            }
+            p->durations[p->count++] = r->duration;
+
+            if (r->start < first)
+                first = r->start;
+            if (r->start + r->duration > last)
+                last = r->start + r->duration;
+        }
+    }
+    fclose(file);
+
+    printf("%-10s %9s %10s %10s %10s %10s %12s\n", "phase", "count", "p50 us", "p90 us", "p99 us", "max us", "total ms");
+    for (uint32_t i = 0; i < numPhases; i++)
+    {
+        struct phaseTimes* p = &phases[i];
+        if (p->count == 0)
+            continue;
+
+        uint64_t total = 0;
+        for (size_t j = 0; j < p->count; j++)
+            total += p->durations[j];
+        qsort(p->durations, p->count, sizeof(uint32_t), compareDurations);
+
+        printf("%-10s %9zu %10.1f %10.1f %10.1f %10.1f %12.2f\n", p->name, p->count,
+               percentile(p, 50), percentile(p, 90), percentile(p, 99),
+               p->durations[p->count - 1] / 1000.0, total / 1e6);
+    }
+    if (last > first)
+        printf("traced span: %.3f s\n", (last - first) / 1e9);
+
+    return 0;
+}
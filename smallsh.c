@@ -1,3 +1,4 @@
+#define _GNU_SOURCE    // pipe2(), F_SETPIPE_SZ and other Linux extensions
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
@@ -9,539 +10,6232 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <stdint.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <errno.h>
+#include <spawn.h>
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <stdarg.h>
+#include <limits.h>
+#include <sys/syscall.h>
+#include <linux/sched.h>    // struct clone_args, CLONE_INTO_CGROUP
+#include <sys/pidfd.h>
+#include <poll.h>
+#include <sys/sendfile.h>
+#include <sys/epoll.h>
+#include <sys/un.h>
+#include <sys/file.h>
+#include <sys/sysmacros.h>  // makedev()
 #define MAX_ARGS 512    // 512 arguments are allowed
-#define UNINITIALIZED_CONST -5
 #define BUFFERSIZE 2048
-#define MAXCHILDREN 5000
+#define ARENA_SIZE 65536 // initial size of the per-command arena
+#define ARENA_ALIGN 16
+#define PATH_BUCKETS 256 // size of the command location (hash builtin) table
+#define TRACE_RING 65536 // records held in memory by the tracer (a power of two)
+#define TRACE_FLUSH_MS 100
+#define READ_BLOCK 65536 // bytes of input read at a time when not using mmap
+#define MAP_RELEASE (1 << 20)   // how much of a mapped script to run before releasing its pages
+#define JOB_BUCKETS 64   // initial size of the background job hash table
+#define ZYGOTE_MAX 16    // most helpers SMALLSH_ZYGOTE can keep ready
+#define ZYGOTE_MSG 65536 // largest command line a helper can be sent
+#define HISTORY_RING 256 // newest history entries kept in memory
+#define HISTORY_WINDOW (1 << 20)    // bytes of the history file searched at a time
+#define VARIABLE_BUCKETS 256    // size of the shell variable hash table
+#define TIMEOUT_GRACE 2.0   // seconds a timed out job gets between SIGTERM and SIGKILL
+#define TIMEOUT_STATUS 124  // the status of a command that timed out
+#define EXIT_GRACE 5.0      // seconds exit waits for jobs after SIGTERM (SMALLSH_EXIT_GRACE)
+#define CACHE_BUCKETS 1024  // size of the command result cache's hash table
+#define CACHE_BUDGET (64 << 20) // bytes of output the cache keeps by default (SMALLSH_CACHE_SIZE)
+
+extern char **environ;
 
 int foregroundOnlyMode = 0; // Tracks whether commands can run in the background
+char shellPidStr[16];   // The shell's pid as a string, for $$ expansion (see cacheShellPid)
+size_t shellPidLen = 0;
+const int* exitStatus = NULL;   // main()'s statusVar, for $? expansion
+pid_t lastBackgroundPid = 0;    // The last process started in the background, for $! expansion
+volatile sig_atomic_t childExited = 0;  // Set by the SIGCHLD handler, cleared once children are reaped
+int pipeSize = 0;   // Pipe buffer size for pipelines (SMALLSH_PIPE_SIZE), 0 for the kernel default
+bool interactive = false;   // True when reading commands from a terminal (prompts are shown)
+bool jobControl = false;    // Every job gets its own process group and foreground jobs get the terminal
+pid_t shellPgid = 0;        // The shell's process group (it owns the terminal between jobs)
+
+// A block of memory handed out by an arena when its main buffer is full
+struct arenaBlock
+{
+    struct arenaBlock* next;
+    size_t size;
+};
+
+// A bump allocator for everything that only lives as long as one command
+// (the command struct, its arguments, file names and expansions).
+// Allocating is a pointer bump; everything is released at once by arenaReset().
+// If a command does not fit, the extra memory comes from malloc() and the
+// main buffer is grown on the next reset, so the arena settles at the size of
+// the largest command seen and memory use stays flat.
+struct arena
+{
+    char* base;
+    size_t size;
+    size_t used;
+    struct arenaBlock* overflow;    // blocks malloc'd since the last reset
+    size_t overflowBytes;
+};
+
+// Sets up an arena with a main buffer of the given size
+void arenaInit(struct arena* a, size_t size)
+{
+    a->base = malloc(size);
+    a->size = size;
+    a->used = 0;
+    a->overflow = NULL;
+    a->overflowBytes = 0;
+}
+
+// Returns size bytes of uninitialized memory from the arena
+void* arenaAlloc(struct arena* a, size_t size)
+{
+    size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+    if (size <= a->size - a->used)
+    {
+        void* mem = a->base + a->used;
+        a->used += size;
+        return mem;
+    }
+
+    // Out of room--fall back to the heap until the next reset
+    struct arenaBlock* block = malloc(ARENA_ALIGN + size);
+    block->next = a->overflow;
+    block->size = size;
+    a->overflow = block;
+    a->overflowBytes += size;
+    return (char*) block + ARENA_ALIGN;
+}
+
+// Appends len bytes to a buffer being built in the arena a, growing it as needed
+char* arenaAppend(struct arena* a, char* buf, size_t* used, size_t* cap, const char* bytes, size_t len)
+{
+    if (*used + len + 1 > *cap)
+    {
+        while (*used + len + 1 > *cap)
+            *cap *= 2;
+        char* bigger = arenaAlloc(a, *cap);
+        memcpy(bigger, buf, *used);
+        buf = bigger;
+    }
+    memcpy(buf + *used, bytes, len);
+    *used += len;
+    buf[*used] = '\0';
+    return buf;
+}
+
+// Copies len bytes of str into the arena and NUL terminates the copy
+char* arenaStrndup(struct arena* a, const char* str, size_t len)
+{
+    char* copy = arenaAlloc(a, len + 1);
+    memcpy(copy, str, len);
+    copy[len] = '\0';
+    return copy;
+}
+
+// Shrinks the most recent allocation from the arena to size bytes, handing
+// the rest back. mem must be the last pointer returned by arenaAlloc().
+void arenaTrim(struct arena* a, void* mem, size_t size)
+{
+    char* p = mem;
+    if (p >= a->base && p < a->base + a->size)
+    {
+        size = (size + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+        a->used = (p - a->base) + size;
+    }
+}
+
+// Releases everything allocated from the arena in one operation
+void arenaReset(struct arena* a)
+{
+    if (a->overflow != NULL)
+    {
+        while (a->overflow != NULL)
+        {
+            struct arenaBlock* next = a->overflow->next;
+            free(a->overflow);
+            a->overflow = next;
+        }
+
+        // Make the main buffer big enough for a command like this one
+        free(a->base);
+        a->size += a->overflowBytes;
+        a->base = malloc(a->size);
+        a->overflowBytes = 0;
+    }
+    a->used = 0;
+}
+
+// The phases of handling a command line that can be traced (SMALLSH_TRACE)
+enum tracePhase
+{
+    TRACE_READ,         // reading the line (readLine)
+    TRACE_PARSE,        // parseCommand
+    TRACE_EXPAND,       // expanding $ parameters in a word (also counted in parse)
+    TRACE_BUILTIN,      // builtInCommand
+    TRACE_REDIRECT,     // opening redirection files
+    TRACE_LOOKUP,       // finding the program on PATH
+    TRACE_SPAWN,        // fork/spawn up to the exec of the program
+    TRACE_LAUNCH,       // from the line being read to its first process existing
+    TRACE_WAIT,         // waiting for a foreground command
+    TRACE_REAP,         // backgroundChecker
+    TRACE_PHASES
+};
+
+const char* tracePhaseNames[TRACE_PHASES] =
+{
+    "read", "parse", "expand", "builtin", "redirect", "lookup", "spawn", "launch", "wait", "reap"
+};
+
+// One timed phase, as written to the trace file. The file starts with the
+// magic "SMSHTRC1", the number of phases and a 16 byte name for each.
+struct traceRecord
+{
+    uint64_t start;     // CLOCK_MONOTONIC nanoseconds
+    uint32_t duration;  // nanoseconds
+    uint16_t phase;
+    uint16_t unused;
+};
+
+// Trace records travel from the shell to a writer thread through this ring.
+// The shell only appends and the writer only drains, so neither takes a lock
+// per record; the writer is woken when the ring is half full and otherwise
+// flushes every TRACE_FLUSH_MS. If the writer falls behind, records are dropped
+// rather than slowing the shell down.
+struct traceRing
+{
+    struct traceRecord records[TRACE_RING];
+    _Atomic uint64_t head;  // next record the shell fills
+    _Atomic uint64_t tail;  // next record the writer drains
+    uint64_t dropped;
+    int fd;
+    bool stopping;
+    pthread_t writer;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+};
+
+struct traceRing* trace = NULL; // null unless tracing is enabled
+uint64_t traceLineStart = 0;    // when the current line finished being read
+
+// Returns the current CLOCK_MONOTONIC time in nanoseconds
+uint64_t monotonicNs()
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000000u + now.tv_nsec;
+}
+
+// Returns the start time for a traced phase (0 if tracing is off)
+uint64_t traceStart()
+{
+    return trace != NULL ? monotonicNs() : 0;
+}
+
+// Records that a phase which began at start has just finished
+void traceEnd(enum tracePhase phase, uint64_t start)
+{
+    if (trace == NULL)
+        return;
+
+    uint64_t now = monotonicNs();
+    uint64_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+    uint64_t used = head - atomic_load_explicit(&trace->tail, memory_order_acquire);
+    if (used == TRACE_RING)
+    {
+        trace->dropped++;
+        return;
+    }
+
+    struct traceRecord* r = &trace->records[head & (TRACE_RING - 1)];
+    r->start = start;
+    r->duration = now - start > UINT32_MAX ? UINT32_MAX : (uint32_t) (now - start);
+    r->phase = phase;
+    r->unused = 0;
+    atomic_store_explicit(&trace->head, head + 1, memory_order_release);
+
+    if (used + 1 == TRACE_RING / 2)
+    {
+        pthread_mutex_lock(&trace->lock);
+        pthread_cond_signal(&trace->wake);
+        pthread_mutex_unlock(&trace->lock);
+    }
+}
+
+// The writer thread: drains the ring to the trace file until told to stop
+void* traceWriter(void* arg)
+{
+    while (true)
+    {
+        pthread_mutex_lock(&trace->lock);
+        if (!trace->stopping)
+        {
+            struct timespec deadline;
+            clock_gettime(CLOCK_REALTIME, &deadline);
+            deadline.tv_nsec += TRACE_FLUSH_MS * 1000000L;
+            if (deadline.tv_nsec >= 1000000000L)
+            {
+                deadline.tv_sec++;
+                deadline.tv_nsec -= 1000000000L;
+            }
+            pthread_cond_timedwait(&trace->wake, &trace->lock, &deadline);
+        }
+        bool stopping = trace->stopping;
+        pthread_mutex_unlock(&trace->lock);
+
+        // Write everything that is ready, in at most two pieces (the ring wraps)
+        uint64_t tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+        uint64_t head = atomic_load_explicit(&trace->head, memory_order_acquire);
+        while (tail != head)
+        {
+            uint64_t index = tail & (TRACE_RING - 1);
+            uint64_t count = head - tail;
+            if (count > TRACE_RING - index)
+                count = TRACE_RING - index;
+            if (write(trace->fd, &trace->records[index], count * sizeof(struct traceRecord)) == -1)
+                break;
+            tail += count;
+            atomic_store_explicit(&trace->tail, tail, memory_order_release);
+        }
+
+        if (stopping)
+            return NULL;
+    }
+}
 
-// Counts the number of digits in a number (for use in variable expansion function)
-int digitCounter(int num)
+// Flushes the trace and stops the writer thread (runs at exit)
+void stopTrace()
 {
-    int count = 0;
-    while (num > 0)
+    pthread_mutex_lock(&trace->lock);
+    trace->stopping = true;
+    pthread_cond_signal(&trace->wake);
+    pthread_mutex_unlock(&trace->lock);
+    pthread_join(trace->writer, NULL);
+    close(trace->fd);
+
+    if (trace->dropped > 0)
+        fprintf(stderr, "smallsh: trace dropped %llu records\n", (unsigned long long) trace->dropped);
+}
+
+// Starts tracing to the given file
+void startTrace(const char* path)
+{
+    char header[16 + TRACE_PHASES * 16] = "SMSHTRC1";
+    uint32_t numPhases = TRACE_PHASES;
+    sigset_t all, old;
+
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0640);
+    if (fd == -1)
+    {
+        perror(path);
+        return;
+    }
+    memcpy(header + 8, &numPhases, sizeof(numPhases));
+    for (int i = 0; i < TRACE_PHASES; i++)
+        strncpy(header + 16 + i * 16, tracePhaseNames[i], 15);
+    write(fd, header, sizeof(header));
+
+    trace = calloc(1, sizeof(struct traceRing));
+    trace->fd = fd;
+    pthread_mutex_init(&trace->lock, NULL);
+    pthread_cond_init(&trace->wake, NULL);
+
+    // The writer never handles signals; they all go to the shell's own thread
+    sigfillset(&all);
+    pthread_sigmask(SIG_SETMASK, &all, &old);
+    if (pthread_create(&trace->writer, NULL, traceWriter, NULL) != 0)
     {
-        num = num/10; 
-        count++;
+        close(fd);
+        free(trace);
+        trace = NULL;
     }
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    if (trace != NULL)
+        atexit(stopTrace);
+}
+
+// Formats the shell's pid once so that $$ expansion never has to
+void cacheShellPid()
+{
+    shellPidLen = snprintf(shellPidStr, sizeof(shellPidStr), "%d", (int) getpid());
+}
+
+// A shell variable. Every variable is exported: the table starts out as a copy
+// of the environment the shell was started with, and export and unset change it.
+struct variable
+{
+    char* entry;        // "NAME=value", as it is passed to commands
+    size_t nameLen;
+    size_t valueLen;
+    struct variable* next;  // next variable in the same hash bucket
+};
+
+// The shell's variables, hashed by name so that expanding $NAME never has to
+// scan the environment
+struct variableTable
+{
+    struct variable* buckets[VARIABLE_BUCKETS];
+    int count;
+    char** envp;        // the environment commands are started with
+    bool envpStale;     // a variable has changed since envp was built
+    uint64_t envHash;   // a hash of envp (the same for the same variables in any
+                        // order), leaving out those the shell keeps itself
+};
+
+struct variableTable variables = {0};
+
+// Returns the bucket a variable name (of len bytes) belongs in (FNV-1a hash)
+size_t variableBucket(const char* name, size_t len)
+{
+    size_t hash = 2166136261u;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ (unsigned char) name[i]) * 16777619u;
+    return hash % VARIABLE_BUCKETS;
+}
+
+// Returns true for the characters a variable name can start with and contain
+bool isNameStart(char c)
+{
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+bool isNameChar(char c)
+{
+    return isNameStart(c) || (c >= '0' && c <= '9');
+}
+
+// Returns the link that points to the variable called name (len bytes), which
+// points to null if there is no such variable
+struct variable** findVariable(const char* name, size_t len)
+{
+    struct variable** link = &variables.buckets[variableBucket(name, len)];
 
-    return count;
+    while (*link != NULL && ((*link)->nameLen != len || memcmp((*link)->entry, name, len) != 0))
+        link = &(*link)->next;
+    return link;
 }
 
-// Receives a string and expands all instances of $$ into the 
-// process ID of the shell.
-char* performVariableExpansion(char* str)
+// Returns the value of the variable called name (len bytes) and stores its
+// length in *valueLen, or returns null if it is not set
+const char* lookupVariable(const char* name, size_t len, size_t* valueLen)
 {
-    char* expandHere = strstr(str, "$$");   // point to the first occurrence of $$ in the string
-    pid_t shellPid = getpid();
-    int shellPidDigits = digitCounter((int) shellPid);
-    char* newStr = str;
+    struct variable* v = *findVariable(name, len);
+    if (v == NULL)
+        return NULL;
+    *valueLen = v->valueLen;
+    return v->entry + v->nameLen + 1;
+}
+
+// Returns the value of the variable called name, or null if it is not set
+const char* getVariable(const char* name)
+{
+    size_t valueLen;
+    return lookupVariable(name, strlen(name), &valueLen);
+}
 
-    while (expandHere != NULL)
+// Sets a variable from a "NAME=value" string (nameLen bytes of name),
+// replacing any variable of that name
+void setVariable(const char* entry, size_t nameLen)
+{
+    struct variable** link = findVariable(entry, nameLen);
+    struct variable* v = *link;
+
+    if (v == NULL)
+    {
+        v = malloc(sizeof(struct variable));
+        v->nameLen = nameLen;
+        v->next = NULL;
+        *link = v;
+        variables.count++;
+    }
+    else
     {
-        // Allocate space for the new token (subtract two to eliminate the $$, add space for the pid)
-        newStr = calloc(strlen(str) - 2 + shellPidDigits, sizeof(char));
-        int numBytes = expandHere - str;  // get how many bytes exist before the $$
-        strncpy(newStr, str, numBytes);
-        char pidStr[digitCounter((int) shellPid)];
+        free(v->entry);
+    }
+    v->entry = strdup(entry);
+    v->valueLen = strlen(entry + nameLen + 1);
+    variables.envpStale = true;
+}
 
-        // Get the pid as a string and concatenate it to the new string
-        sprintf(pidStr, "%d", (int) shellPid);   
-        strcat(newStr, pidStr);   
+// Removes the variable called name, if it is set
+void unsetVariable(const char* name)
+{
+    struct variable** link = findVariable(name, strlen(name));
+    struct variable* v = *link;
 
-        // Concatenate the rest of the string (beyond the original $$)
-        expandHere = expandHere + 2; 
-        strcat(newStr, expandHere); 
+    if (v != NULL)
+    {
+        *link = v->next;
+        free(v->entry);
+        free(v);
+        variables.count--;
+        variables.envpStale = true;
+    }
+}
 
-        // Search the rest of the string
-        expandHere = strstr(newStr, "$$");   
-        str = newStr; 
+// Fills the variable table from the environment the shell was started with
+void initVariables()
+{
+    for (char** e = environ; *e != NULL; e++)
+    {
+        char* equals = strchr(*e, '=');
+        if (equals != NULL && *findVariable(*e, equals - *e) == NULL)
+            setVariable(*e, equals - *e);
     }
+}
+
+// Returns a 64-bit FNV-1a hash of len bytes
+uint64_t hashBytes(const void* bytes, size_t len)
+{
+    const unsigned char* b = bytes;
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < len; i++)
+        hash = (hash ^ b[i]) * 1099511628211ull;
+    return hash;
+}
+
+// Tells whether a "NAME=value" entry is one the shell keeps up to date
+// itself (PWD and OLDPWD, which every cd changes). These stay out of
+// envHash; the working directory is part of a cache key on its own.
+bool shellVariable(const char* entry)
+{
+    return strncmp(entry, "PWD=", 4) == 0 || strncmp(entry, "OLDPWD=", 7) == 0;
+}
 
-    return newStr;
+// Returns the environment to start commands with, rebuilding it if a
+// variable has changed since it was last built
+char** environment()
+{
+    if (variables.envp == NULL || variables.envpStale)
+    {
+        variables.envp = realloc(variables.envp, (variables.count + 1) * sizeof(char*));
+        variables.envHash = 0;
+        int n = 0;
+        for (int i = 0; i < VARIABLE_BUCKETS; i++)
+        {
+            for (struct variable* v = variables.buckets[i]; v != NULL; v = v->next)
+            {
+                variables.envp[n++] = v->entry;
+                if (!shellVariable(v->entry))
+                    variables.envHash += hashBytes(v->entry, strlen(v->entry));
+            }
+        }
+        variables.envp[n] = NULL;
+        variables.envpStale = false;
+    }
+    return variables.envp;
 }
 
+// Finds the value of the parameter referred to by the text after a $ (which
+// ends at end): a variable ($NAME or ${NAME}), $$ (the shell's pid), $? (the
+// last exit status) or $! (the last background process). Stores how many
+// bytes of the text the reference takes in *used and the value's length in
+// *valueLen; an unset variable is empty. Numbers are formatted into number
+// (16 bytes). Returns null if the $ does not start a reference.
+const char* parameterValue(const char* p, const char* end, size_t* used, size_t* valueLen, char* number)
+{
+    if (p == end)
+        return NULL;
+
+    if (*p == '$' || *p == '?' || *p == '!')
+    {
+        *used = 1;
+        if (*p == '$')
+        {
+            *valueLen = shellPidLen;
+            return shellPidStr;
+        }
+        if (*p == '!' && lastBackgroundPid == 0)
+        {
+            *valueLen = 0;
+            return "";
+        }
+        *valueLen = snprintf(number, 16, "%d", *p == '?' ? (exitStatus ? *exitStatus : 0) : (int) lastBackgroundPid);
+        return number;
+    }
+
+    const char* name = p;
+    bool braced = *p == '{';
+    if (braced)
+        name++;
+    if (name == end || !isNameStart(*name))
+        return NULL;
+    const char* nameEnd = name + 1;
+    while (nameEnd < end && isNameChar(*nameEnd))
+        nameEnd++;
+    if (braced && (nameEnd == end || *nameEnd != '}'))
+        return NULL;
 
-// A struct representing a user's command to the shell
+    *used = (nameEnd - p) + braced;
+    const char* value = lookupVariable(name, nameEnd - name, valueLen);
+    if (value == NULL)
+    {
+        *valueLen = 0;
+        return "";
+    }
+    return value;
+}
+
+// A struct representing a user's command to the shell.
+// A pipeline (cmd1 | cmd2 | ...) is a list of these linked through next,
+// one per stage.
 struct userCommand
 {
-    char* command; 
-    char* args[MAX_ARGS];
-    char* complete[MAX_ARGS + 1]; // to store the command and arguments, e.g. "ls -a"
+    char* command;      // the program to run (complete[0])
+    char** args;        // its arguments (complete + 1)
+    char* complete[MAX_ARGS + 2]; // the NULL terminated argv for exec, e.g. "ls -a"
     char* inputFile;    // If user specified an input file, save it here. Otherwise this will be null
     char* outputFile;   // If user specified an output file, save it here. Otherwise this will be null
+    bool appendOutput;  // >> (or &>>): append to outputFile instead of truncating it
+    char* errorFile;    // 2> file: where stderr goes (null to leave it alone)
+    bool appendError;   // 2>>: append to errorFile
+    bool errorToOutput; // 2>&1 (or &>): stderr goes wherever stdout goes
+    char* hereText;     // <<< word or << body: the text stdin reads (null for none)
+    size_t hereLength;
+    char* hereDelimiter;    // << delimiter, until readHereDocs() has read the body
     bool bgCommand;     // True or False (whether intended to run in background)
+    bool timed;         // Prefixed with the time keyword (report how long it took)
+    double timeout;     // Prefixed with timeout SECS (0 for none)
+    bool cached;        // Prefixed with cache (its output may come from the result cache)
+    int inputFD;        // An open descriptor stdin comes from instead of inputFile (-1 for none)
+    int outputFD;       // An open descriptor stdout goes to instead of outputFile (-1 for none)
+    int errorFD;        // An open descriptor stderr goes to instead of errorFile (-1 for none)
+    struct userCommand* next;   // The next stage of the pipeline, or null for the last stage
 };
 
-// Parses user's input into a command struct
-// A command will have the following structure
-// "command [arg1 arg2 ...] [< input_file] [> output_file] [&]""
-// where arguments in brackets are optional
-struct userCommand *parseCommand(char* input)
-{
-    // Strip newline character 
-    char *pos;
-    if ((pos=strchr(input, '\n')) != NULL)
-        *pos = '\0';
-    
-    struct userCommand *com = malloc(sizeof(struct userCommand));
-    char *saveptr; // for use with strtok_r
+// Allocates an empty command (one pipeline stage) from the arena a
+struct userCommand *newCommand(struct arena* a)
+{
+    struct userCommand *com = arenaAlloc(a, sizeof(struct userCommand));
+    com->command = NULL;
+    com->args = com->complete + 1;
+    com->complete[0] = NULL;
+    com->complete[1] = NULL;
     com->inputFile = NULL;  // assume no input redirection
     com->outputFile = NULL; // assume no output redirection
+    com->appendOutput = false;
+    com->errorFile = NULL;
+    com->appendError = false;
+    com->errorToOutput = false;
+    com->hereText = NULL;
+    com->hereLength = 0;
+    com->hereDelimiter = NULL;
     com->bgCommand = false; // assume it is not a background command
-    int argInd = 0; // track number of arguments
-    char *inputRedir = calloc(1, sizeof(char)); // Not sure how else to compare the token (which is a char*) to a single char...
-    char *outputRedir = calloc(1, sizeof(char)); // Not sure how else to compare the token (which is a char*) to a single char...
-    strcpy(outputRedir, ">");
-    strcpy(inputRedir, "<");
-
-    for (int i = 0; i < MAX_ARGS; i++) // initialize argument array to NULL
-    {
-        com->args[i] = NULL;
-    }
-    for (int i = 0; i < MAX_ARGS - 1; i++) // initialize complete command array to NULL
-    {
-        com->complete[i] = NULL;
-    }
-
-    // If the last token is an &, it is a background command
-    if (input[strlen(input) - 1] == '&')
-    {
-        com->bgCommand = true;
-        input[strlen(input) - 1] = ' '; // replace with a space so & is not read as an argument
-    }
-
-    // Get the command (first token)
-    char *token = strtok_r(input, " ", &saveptr);
-    com->command = calloc(strlen(token) + 1, sizeof(char));
-    strcpy(com->command, token);
-    com->complete[0] = com->command;    // point the first element of complete command to the command string
-    
-    // Get the arguments (read the rest of the input, ignoring <, >, &)
-    token = strtok_r(NULL, " ", &saveptr);
-    while (token) 
-    { 
-        // Perform any required variable expansion on this token
-        token = performVariableExpansion(token);
-
-        // If encountering a > at any point, get the output file (the next token)
-        if (strcmp(token, outputRedir) == 0)    
-        {
-            token = strtok_r(NULL, " ", &saveptr); 
-            com->outputFile = calloc(strlen(token) + 1, sizeof(char));
-            strcpy(com->outputFile, token);
-            token = strtok_r(NULL, " ", &saveptr);  // Get the next token
-        }
-        // If encountering a > at any point, get the iput file (the next token)
-        else if (strcmp(token, inputRedir) == 0)   
-        {
-            token = strtok_r(NULL, " ", &saveptr); 
-            com->inputFile = calloc(strlen(token) + 1, sizeof(char));
-            strcpy(com->inputFile, token);
-            token = strtok_r(NULL, " ", &saveptr);  // Get the next token
-        }
-        else    // Otherwise, add the argument to the arguments/complete command list (& has already been filtered out)
-        {
-            char* arg = calloc(strlen(token) + 1, sizeof(char));
-            strcpy(arg, token);
-            com->args[argInd] = arg;    
-            com->complete[argInd + 1] = arg;   
-            argInd++;
-            token = strtok_r(NULL, " ", &saveptr);
-        }
-    }
-
-// DEBUG PRINT STATEMENTS
-    // printf("FINISHED PARSING\n"); fflush(stdout);
-    // printf("The command is %s\n", com->command); fflush(stdout);
-    // printf("The arguments are: \n");  fflush(stdout);
-    // argInd = 0;
-    // while (com->args[argInd] != NULL) 
-    // {
-    //     printf("Arg Number %d: %s \n", argInd, com->args[argInd]);  fflush(stdout);
-    //     argInd++;
-    // }
-    // if (argInd==0) {printf("There were no arguments\n"); fflush(stdout);}
-    // else {printf("There were %d args in total\n", argInd); fflush(stdout);}
-    // if (com->bgCommand) {printf("Background command: True\n\n");fflush(stdout);}
-    // else {printf("Background command: False\n\n");fflush(stdout);}
-    // fflush(stdout);
-//END DEBUG PRINT STATEMENTS
-
-    free(inputRedir);
-    free(outputRedir);
+    com->timed = false;
+    com->timeout = 0;
+    com->cached = false;
+    com->inputFD = -1;
+    com->outputFD = -1;
+    com->errorFD = -1;
+    com->next = NULL;
     return com;
 }
 
-// Redirects the input from STDIN to the user's specified file.
-// If user has not specified a file for a background command, 
-// STDIN will be redirected to /dev/null
-// If user has not specified a file for a foreground command,
-// this function will do nothing (i.e. stdin will not be redirected)
-int redirectInput(struct userCommand* userCom)
+// The kinds of token a command line is made of
+enum tokenType
+{
+    TOKEN_END,          // end of the line
+    TOKEN_WORD,
+    TOKEN_INPUT,        // <
+    TOKEN_HERE_DOC,     // <<
+    TOKEN_HERE_STRING,  // <<<
+    TOKEN_OUTPUT,       // >
+    TOKEN_APPEND,       // >>
+    TOKEN_ERROR,        // 2>
+    TOKEN_ERROR_APPEND, // 2>>
+    TOKEN_ERROR_TO_OUTPUT,  // 2>&1
+    TOKEN_ALL,          // &>
+    TOKEN_ALL_APPEND,   // &>>
+    TOKEN_PIPE,         // |
+    TOKEN_BACKGROUND,   // &
+    TOKEN_BAD_QUOTE     // a quote that is never closed
+};
+
+// How each operator is written (for error messages)
+const char* tokenNames[] =
+{
+    "end of line", "word", "<", "<<", "<<<", ">", ">>", "2>", "2>>", "2>&1", "&>", "&>>", "|", "&", "quote"
+};
+
+// Splits a command line into tokens in place.
+// Words have their quotes and backslashes removed right where they lie
+// (which only ever shortens them), so the words can be used as exec's argv
+// without being copied. Only a word with a $ parameter to expand is built in the arena.
+struct lexer
 {
-    if (userCom->bgCommand && userCom->inputFile == NULL)   // No output file specified for bg comand
+    char* pos;          // next character to read
+    char* end;          // end of the line
+    char pending;       // operator overwritten by the NUL that ended the last word
+    struct arena* arena;
+};
+
+// Returns the token type of an operator character (TOKEN_WORD for anything else)
+enum tokenType operatorType(char c)
+{
+    switch (c)
     {
-        char* defaultRedir = calloc(strlen("/dev/null" + 1), sizeof(char));
-        strcpy(defaultRedir, "/dev/null");
-        int sourceFD = open(defaultRedir, O_RDONLY);
-        if (sourceFD == -1) 
-        { 
-            perror("source open()"); 
-            exit(1); 
-        }
+        case '<': return TOKEN_INPUT;
+        case '>': return TOKEN_OUTPUT;
+        case '|': return TOKEN_PIPE;
+        case '&': return TOKEN_BACKGROUND;
+        default: return TOKEN_WORD;
     }
+}
 
-    // If user specified a file for input redirection, attempt to
-    // open it for reading only
-    // (This small snippet of code was taken from the Exploration Module)
-    else if (userCom->inputFile != NULL)
+// Reads the rest of an operator whose first character (c) has been read:
+// << <<< >> &> &>> are told apart from < > & by the characters after it.
+enum tokenType readOperator(struct lexer* lex, char c)
+{
+    char* next = lex->pos;
+    bool more = next < lex->end;
+
+    switch (c)
     {
-        // Open the source file
-        int sourceFD = open(userCom->inputFile, O_RDONLY);
-        if (sourceFD == -1) 
-        { 
-            perror("source open()"); 
-            exit(1); 
+        case '<':
+            if (!more || next[0] != '<')
+                return TOKEN_INPUT;
+            if (next + 1 < lex->end && next[1] == '<')
+            {
+                lex->pos += 2;
+                return TOKEN_HERE_STRING;
+            }
+            lex->pos++;
+            return TOKEN_HERE_DOC;
+        case '>':
+            if (!more || next[0] != '>')
+                return TOKEN_OUTPUT;
+            lex->pos++;
+            return TOKEN_APPEND;
+        case '&':
+            if (!more || next[0] != '>')
+                return TOKEN_BACKGROUND;
+            if (next + 1 < lex->end && next[1] == '>')
+            {
+                lex->pos += 2;
+                return TOKEN_ALL_APPEND;
+            }
+            lex->pos++;
+            return TOKEN_ALL;
+        default:
+            return operatorType(c);
+    }
+}
+
+// Reads a stderr redirection (2> 2>> 2>&1) if one starts at lex->pos.
+// Returns TOKEN_WORD if there is none.
+enum tokenType readErrorOperator(struct lexer* lex)
+{
+    char* p = lex->pos;
+    if (lex->end - p < 2 || p[0] != '2' || p[1] != '>')
+        return TOKEN_WORD;
+
+    if (lex->end - p >= 4 && p[2] == '&' && p[3] == '1')
+    {
+        lex->pos += 4;
+        return TOKEN_ERROR_TO_OUTPUT;
+    }
+    if (lex->end - p >= 3 && p[2] == '>')
+    {
+        lex->pos += 3;
+        return TOKEN_ERROR_APPEND;
+    }
+    lex->pos += 2;
+    return TOKEN_ERROR;
+}
+
+// Returns true for the characters that separate words
+bool isBlank(char c)
+{
+    return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+// Reads the next token. For a word, *word is set to the NUL terminated word.
+// Supports 'single quotes' (everything literal), "double quotes" (where \ only
+// escapes " \ and $) and backslash escapes. Outside single quotes, $NAME,
+// ${NAME}, $$, $? and $! are replaced by their values (see parameterValue()).
+// A word that expands to nothing and has no quotes in it is dropped.
+enum tokenType nextToken(struct lexer* lex, char** word)
+{
+    // An operator that directly followed the last word
+    if (lex->pending)
+    {
+        char c = lex->pending;
+        lex->pending = '\0';
+        return readOperator(lex, c);
+    }
+
+    while (lex->pos < lex->end && isBlank(*lex->pos))
+        lex->pos++;
+    if (lex->pos == lex->end)
+        return TOKEN_END;
+    if (operatorType(*lex->pos) != TOKEN_WORD)
+    {
+        char c = *lex->pos++;
+        return readOperator(lex, c);
+    }
+    enum tokenType errorType = readErrorOperator(lex);
+    if (errorType != TOKEN_WORD)
+        return errorType;
+
+    char* start = lex->pos;
+    char* out = lex->pos;   // where the next character of the word is written
+    char quote = '\0';      // the quote we are inside of, if any
+    bool inArena = false;   // the word is being built in the arena (it has a $ parameter)
+    size_t capacity = 0;    // how big the arena copy is
+    bool quoted = false;    // the word has quotes in it (so it is kept even if empty)
+    char number[16];
+    uint64_t traced = 0;
+
+    while (lex->pos < lex->end)
+    {
+        char c = *lex->pos;
+
+        if (quote == '\0')
+        {
+            if (isBlank(c) || operatorType(c) != TOKEN_WORD)
+                break;
+            if (c == '\'' || c == '"')
+            {
+                quote = c;
+                quoted = true;
+                lex->pos++;
+                continue;
+            }
+            if (c == '\\' && lex->pos + 1 < lex->end)
+            {
+                *out++ = lex->pos[1];
+                lex->pos += 2;
+                continue;
+            }
         }
-        // Redirect STDIN to the source file 
-        int result = dup2(sourceFD, 0);
-        if (result == -1) 
-        { 
-            perror("source dup2()"); 
-            exit(1); 
+        else if (c == quote)
+        {
+            quote = '\0';
+            lex->pos++;
+            continue;
+        }
+        else if (quote == '"' && c == '\\' && lex->pos + 1 < lex->end
+                 && (lex->pos[1] == '"' || lex->pos[1] == '\\' || lex->pos[1] == '$'))
+        {
+            *out++ = lex->pos[1];
+            lex->pos += 2;
+            continue;
+        }
+
+        // A parameter is replaced by its value. The expanded word can be longer
+        // than the input, so it moves to the arena, into a copy big enough for
+        // the value and the rest of the line; it is copied again (to twice
+        // the size) only if a later value does not fit.
+        size_t used, valueLen;
+        const char* value;
+        if (c == '$' && quote != '\'' && (value = parameterValue(lex->pos + 1, lex->end, &used, &valueLen, number)) != NULL)
+        {
+            size_t needed = (out - start) + valueLen + (lex->end - lex->pos) + 1;
+            if (needed > capacity)
+            {
+                if (!inArena)
+                    traced = traceStart();
+                capacity = 2 * needed;
+                char* copy = arenaAlloc(lex->arena, capacity);
+                memcpy(copy, start, out - start);
+                out = copy + (out - start);
+                start = copy;
+                inArena = true;
+            }
+            memcpy(out, value, valueLen);
+            out += valueLen;
+            lex->pos += 1 + used;
+            continue;
+        }
+
+        *out++ = c;
+        lex->pos++;
+    }
+
+    if (quote != '\0')
+        return TOKEN_BAD_QUOTE;
+
+    // End the word. If nothing was removed from it, the NUL goes where the
+    // character that ended it was; an operator there is remembered.
+    if (!inArena && out == lex->pos && lex->pos < lex->end)
+    {
+        if (!isBlank(*lex->pos))
+            lex->pending = *lex->pos;
+        lex->pos++;
+    }
+    *out = '\0';
+    if (inArena)
+    {
+        arenaTrim(lex->arena, start, out - start + 1);
+        traceEnd(TRACE_EXPAND, traced);
+        if (out == start && !quoted)
+            return nextToken(lex, word);
+    }
+
+    *word = start;
+    return TOKEN_WORD;
+}
+
+// Records a redirection (type) of one of a stage's streams to/from word
+void setRedirection(struct arena* a, struct userCommand* com, enum tokenType type, char* word)
+{
+    switch (type)
+    {
+        case TOKEN_INPUT:
+            com->inputFile = word;
+            com->hereText = com->hereDelimiter = NULL;
+            break;
+        case TOKEN_HERE_STRING:     // the word plus a newline
+            com->hereLength = strlen(word) + 1;
+            com->hereText = arenaAlloc(a, com->hereLength);
+            memcpy(com->hereText, word, com->hereLength - 1);
+            com->hereText[com->hereLength - 1] = '\n';
+            com->inputFile = com->hereDelimiter = NULL;
+            break;
+        case TOKEN_HERE_DOC:        // the body is read later (see readHereDocs())
+            com->hereDelimiter = word;
+            com->inputFile = com->hereText = NULL;
+            break;
+        case TOKEN_ALL:
+        case TOKEN_ALL_APPEND:
+            com->errorFile = NULL;
+            com->errorToOutput = true;
+            // fall through
+        case TOKEN_OUTPUT:
+        case TOKEN_APPEND:
+            com->outputFile = word;
+            com->appendOutput = type == TOKEN_APPEND || type == TOKEN_ALL_APPEND;
+            break;
+        case TOKEN_ERROR:
+        case TOKEN_ERROR_APPEND:
+            com->errorFile = word;
+            com->appendError = type == TOKEN_ERROR_APPEND;
+            com->errorToOutput = false;
+            break;
+        default:
+            break;
+    }
+}
+
+// Parses a duration: a number of seconds, or of minutes or hours with an m
+// or h after it (an s is allowed too). Returns 0 if it is not a duration.
+double parseDuration(const char* str)
+{
+    char* end;
+    double seconds = strtod(str, &end);
+    if (end == str || !(seconds > 0))
+        return 0;
+    if (*end == 'm')
+        seconds *= 60;
+    else if (*end == 'h')
+        seconds *= 3600;
+    if (*end == 's' || *end == 'm' || *end == 'h')
+        end++;
+    return *end == '\0' ? seconds : 0;
+}
+
+// Reports a syntax error in a command line (parseCommand returns null after it)
+void *syntaxError(const char* message)
+{
+    fprintf(stderr, "syntax error: %s\n", message);
+    return NULL;
+}
+
+// Parses user's input into a command struct
+// A command will have the following structure
+// "[time] command [arg1 arg2 ...] [< input_file] [> output_file] [| command ...] [&]""
+// where arguments in brackets are optional
+// Besides < and >, a stage may redirect with >> file (append), 2> file,
+// 2>> file, 2>&1 (stderr to wherever stdout goes), &> file and &>> file (both),
+// <<< word (a here-string) and << delimiter (a here-document, whose body is
+// read by readHereDocs()).
+// Words may be quoted or escaped (see nextToken()), and words and operators may
+// be separated by any amount of blank space (or none).
+// The line is split in place, so the command's strings point into input (or
+// into the arena a); they stay valid until the line is reused or the arena is reset.
+// Returns a command with a null command for a blank line, and null (after
+// printing an error) if the line is not a valid command.
+struct userCommand *parseCommand(struct arena* a, char* input)
+{
+    struct lexer lex = {input, input + strlen(input), '\0', a};
+    struct userCommand *first = newCommand(a);
+    struct userCommand *com = first;    // the stage being filled in
+    int argc = 0;   // words in this stage so far
+    enum tokenType type;
+    char *word;
+
+    while ((type = nextToken(&lex, &word)) != TOKEN_END)
+    {
+        switch (type)
+        {
+            case TOKEN_WORD:
+                // "time command ..." runs the command and reports how long it took.
+                // "timeout SECS command ..." stops it if it takes longer (a
+                // timeout followed by anything but a duration is the program).
+                // "cache command ..." reuses the command's earlier output (cache
+                // on its own or with -c is the builtin).
+                if (com == first && argc == 1 && !first->timed && strcmp(first->complete[0], "time") == 0)
+                {
+                    first->timed = true;
+                    argc = 0;
+                }
+                else if (com == first && argc == 1 && !first->cached && strcmp(first->complete[0], "cache") == 0
+                         && strcmp(word, "-c") != 0)
+                {
+                    first->cached = true;
+                    argc = 0;
+                }
+                else if (com == first && argc == 2 && first->timeout == 0 && strcmp(first->complete[0], "timeout") == 0
+                         && (first->timeout = parseDuration(first->complete[1])) > 0)
+                {
+                    argc = 0;
+                }
+                if (argc == MAX_ARGS + 1)
+                    return syntaxError("too many arguments");
+                com->complete[argc++] = word;
+                break;
+
+            // A redirection is followed by the name of the file (or the here-string,
+            // or the here-document's delimiter). A later redirection of the same
+            // stream replaces an earlier one.
+            case TOKEN_INPUT:
+            case TOKEN_HERE_DOC:
+            case TOKEN_HERE_STRING:
+            case TOKEN_OUTPUT:
+            case TOKEN_APPEND:
+            case TOKEN_ERROR:
+            case TOKEN_ERROR_APPEND:
+            case TOKEN_ALL:
+            case TOKEN_ALL_APPEND:
+                if (nextToken(&lex, &word) != TOKEN_WORD)
+                {
+                    char message[64];
+                    snprintf(message, sizeof(message), "%s must be followed by %s", tokenNames[type],
+                             type == TOKEN_HERE_DOC ? "a delimiter" : type == TOKEN_HERE_STRING ? "a word" : "a file name");
+                    return syntaxError(message);
+                }
+                setRedirection(a, com, type, word);
+                break;
+
+            case TOKEN_ERROR_TO_OUTPUT:
+                com->errorFile = NULL;
+                com->errorToOutput = true;
+                break;
+
+            // A | ends this stage; the next words are the next command
+            case TOKEN_PIPE:
+                if (argc == 0)
+                    return syntaxError("| must be preceded by a command");
+                com->complete[argc] = NULL;
+                com->command = com->complete[0];
+                com->next = newCommand(a);
+                com = com->next;
+                argc = 0;
+                break;
+
+            // An & at the end of the line makes it a background command
+            case TOKEN_BACKGROUND:
+                if (nextToken(&lex, &word) != TOKEN_END)
+                    return syntaxError("& must be at the end of the command");
+                if (argc == 0)
+                    return syntaxError("& must follow a command");
+                first->bgCommand = true;
+                break;
+
+            default:
+                return syntaxError("unterminated quote");
+        }
+        if (first->bgCommand)
+            break;
+    }
+
+    if (argc == 0)
+    {
+        if (com == first && com->inputFile == NULL && com->outputFile == NULL && com->errorFile == NULL
+            && com->hereText == NULL && com->hereDelimiter == NULL && !com->errorToOutput)
+            return first;   // blank line
+        return syntaxError(com == first ? "missing command" : "| must be followed by a command");
+    }
+    com->complete[argc] = NULL;
+    com->command = com->complete[0];
+
+    for (struct userCommand *stage = first->next; stage != NULL; stage = stage->next)
+        stage->bgCommand = first->bgCommand;
+    return first;
+}
+
+// Puts the text of a here-string or here-document in an anonymous memory
+// file (nothing touches the disk) and returns a close-on-exec descriptor that
+// reads it from the start, or -1 on failure.
+int hereDocument(const char* text, size_t len)
+{
+    int fd = memfd_create("smallsh-here", MFD_CLOEXEC);
+    if (fd == -1)
+        return -1;
+
+    size_t written = 0;
+    while (written < len)
+    {
+        ssize_t n = write(fd, text + written, len - written);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+        {
+            close(fd);
+            return -1;
+        }
+        written += n;
+    }
+    lseek(fd, 0, SEEK_SET);
+    return fd;
+}
+
+// Opens the file the user wants STDIN redirected from (or the text of a
+// here-string or here-document, see hereDocument()).
+// If user has not specified a file for a background command,
+// STDIN will be redirected to /dev/null
+// If user has not specified a file for a foreground command, or stdin
+// comes from the previous stage of a pipeline (piped is true),
+// *fd is set to -1 (i.e. stdin will not be redirected)
+// The file is opened in the shell itself (close-on-exec) and is dup'd onto
+// fd 0 by the launcher, so a bad filename is reported before anything is spawned.
+// Returns 0 on success, -1 if the file could not be opened.
+int redirectInput(struct userCommand* userCom, bool piped, int* fd)
+{
+    const char* source = userCom->inputFile;
+    *fd = -1;
+
+    // Input the shell was handed (see the server mode's runLine())
+    if (userCom->inputFD != -1)
+    {
+        *fd = fcntl(userCom->inputFD, F_DUPFD_CLOEXEC, 0);
+        if (*fd == -1)
+        {
+            perror("fcntl()");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (userCom->hereText != NULL)
+    {
+        *fd = hereDocument(userCom->hereText, userCom->hereLength);
+        if (*fd == -1)
+        {
+            perror("here-document");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (userCom->bgCommand && !foregroundOnlyMode && !piped && source == NULL)   // No input file specified for bg comand
+    {
+        source = "/dev/null";
+    }
+
+    // If user specified a file for input redirection, attempt to
+    // open it for reading only
+    // (This small snippet of code was taken from the Exploration Module)
+    if (source != NULL)
+    {
+        *fd = open(source, O_RDONLY | O_CLOEXEC);
+        if (*fd == -1) 
+        { 
+            perror("source open()"); 
+            return -1; 
+        }
+    }
+
+    return 0;
+}
+
+// Opens the file the user wants STDOUT redirected to.
+// If user has not specified a file for a background command, 
+// STDOUT will be redirected to /dev/null
+// If user has not specified a file for a foreground command, or stdout
+// goes to the next stage of a pipeline (piped is true),
+// *fd is set to -1 (i.e. stdout will not be redirected)
+// Returns 0 on success, -1 if the file could not be opened.
+int redirectOutput(struct userCommand* userCom, bool piped, int* fd)
+{
+    const char* target = userCom->outputFile;
+    *fd = -1;
+
+    // Output the shell collects itself (see runCached()) or was handed (see runLine())
+    if (userCom->outputFD != -1)
+    {
+        *fd = fcntl(userCom->outputFD, F_DUPFD_CLOEXEC, 0);
+        if (*fd == -1)
+        {
+            perror("fcntl()");
+            return -1;
+        }
+        return 0;
+    }
+
+    if (userCom->bgCommand && !foregroundOnlyMode && !piped && target == NULL)  
+    {
+        target = "/dev/null";
+    }
+
+    // If user specified output redirection
+    // (The I/O module heavily influenced this section of code.)
+    if (target != NULL)
+    {
+        // Open the file for writing (>> appends to it instead of truncating it)
+        int mode = userCom->appendOutput ? O_APPEND : O_TRUNC;
+        *fd = open(target, O_WRONLY | O_CREAT | mode | O_CLOEXEC, 0640);
+        if (*fd == -1) 
+        {
+            perror("open() failed");
+            return -1;
+        }
+    }
+
+    return 0;
+}
+
+// Opens the file the user wants STDERR redirected to (2> or 2>>).
+// *fd is set to -1 if stderr is not redirected to a file (see launchStage()
+// for 2>&1).
+// Returns 0 on success, -1 if the file could not be opened.
+int redirectError(struct userCommand* userCom, int* fd)
+{
+    *fd = -1;
+    if (userCom->errorFD != -1)
+    {
+        *fd = fcntl(userCom->errorFD, F_DUPFD_CLOEXEC, 0);
+        if (*fd == -1)
+        {
+            perror("fcntl()");
+            return -1;
+        }
+        return 0;
+    }
+    if (userCom->errorFile == NULL)
+        return 0;
+
+    int mode = userCom->appendError ? O_APPEND : O_TRUNC;
+    *fd = open(userCom->errorFile, O_WRONLY | O_CREAT | mode | O_CLOEXEC, 0640);
+    if (*fd == -1)
+    {
+        perror(userCom->errorFile);
+        return -1;
+    }
+    return 0;
+}
+
+// The commands built in to the shell
+enum builtin
+{
+    BUILTIN_NONE,       // not a builtin: the command is run as a program
+    BUILTIN_EXIT,
+    BUILTIN_STATUS,
+    BUILTIN_CD,
+    BUILTIN_PARALLEL,
+    BUILTIN_HASH,
+    BUILTIN_TIMES,
+    BUILTIN_NOTIFY,
+    BUILTIN_JOBS,
+    BUILTIN_FG,
+    BUILTIN_BG,
+    BUILTIN_WAIT,
+    BUILTIN_HISTORY,
+    BUILTIN_EXPORT,
+    BUILTIN_UNSET,
+    BUILTIN_ULIMIT,
+    BUILTIN_CACHE,
+    BUILTIN_PUSHD,
+    BUILTIN_POPD,
+    BUILTIN_DIRS,
+    // Utilities that also exist as programs, run in the shell to save a
+    // process (see runUtility())
+    BUILTIN_ECHO,
+    BUILTIN_TRUE,
+    BUILTIN_FALSE,
+    BUILTIN_TEST,
+    BUILTIN_BRACKET,    // [ (test, ending with ])
+    BUILTIN_PWD,
+    BUILTIN_COUNT
+};
+
+const char* builtinNames[] =
+{
+    NULL, "exit", "status", "cd", "parallel", "hash", "times", "notify", "jobs", "fg", "bg",
+    "wait", "history", "export", "unset", "ulimit", "cache", "pushd", "popd", "dirs",
+    "echo", "true", "false", "test", "[", "pwd"
+};
+
+#define BUILTIN_SLOTS 64    // size of builtinTable (a power of two, well over BUILTIN_COUNT)
+
+// The builtins hashed by name (open addressing), so that finding out whether
+// a command is built in takes one hash of its name and, almost always, one
+// string comparison. Filled in by the first lookup.
+enum builtin builtinTable[BUILTIN_SLOTS];
+
+// Returns the slot a builtin's name hashes to (FNV-1a hash)
+size_t builtinSlot(const char* name)
+{
+    size_t hash = 2166136261u;
+    for (; *name; name++)
+        hash = (hash ^ (unsigned char) *name) * 16777619u;
+    return hash & (BUILTIN_SLOTS - 1);
+}
+
+/* 
+Checks if command is built in to the shell.
+Returns which builtin it is, or BUILTIN_NONE if it is not built in.
+The utilities (echo, true, false, test, [ and pwd) are only run in the
+shell in the foreground, untimed, without a timeout and not cached;
+otherwise they are run as programs, as before.
+*/
+enum builtin builtInCommand(struct userCommand* userCom)
+{
+    static bool filled = false;
+    if (!filled)
+    {
+        for (int b = BUILTIN_NONE + 1; b < BUILTIN_COUNT; b++)
+        {
+            size_t slot = builtinSlot(builtinNames[b]);
+            while (builtinTable[slot] != BUILTIN_NONE)
+                slot = (slot + 1) & (BUILTIN_SLOTS - 1);
+            builtinTable[slot] = b;
+        }
+        filled = true;
+    }
+
+    enum builtin builtIn = BUILTIN_NONE;
+    for (size_t slot = builtinSlot(userCom->command); builtinTable[slot] != BUILTIN_NONE; slot = (slot + 1) & (BUILTIN_SLOTS - 1))
+    {
+        if (strcmp(builtinNames[builtinTable[slot]], userCom->command) == 0)
+        {
+            builtIn = builtinTable[slot];
+            break;
+        }
+    }
+
+    if (builtIn >= BUILTIN_ECHO && ((userCom->bgCommand && !foregroundOnlyMode) || userCom->timed || userCom->timeout > 0 || userCom->cached))
+        builtIn = BUILTIN_NONE;
+    return builtIn;
+}
+
+// Returns the exit status of a process that exited normally, or the number of
+// the signal that terminated it
+int exitValue(int childExitMethod)
+{
+    if (WIFEXITED(childExitMethod))
+        return WEXITSTATUS(childExitMethod);
+    return WTERMSIG(childExitMethod);
+}
+
+// Resource usage of a finished command (all of its processes added together)
+struct commandUsage
+{
+    bool valid;             // false until a command has finished
+    pid_t pid;              // first process of the command
+    struct rusage usage;
+    double wallSeconds;     // from launch until the last process was reaped
+    bool inCgroup;          // it ran in a cgroup of its own (SMALLSH_CGROUP)
+    long long cgroupCpuUsec;    // CPU time the cgroup used
+    long long cgroupMemoryPeak; // most memory the cgroup used, in bytes (-1 if unknown)
+    double timedOut;        // the timeout it ran out of (0 if it did not time out)
+    int exitMethod;         // how its last stage finished
+};
+
+struct commandUsage lastForeground = {0};   // the most recent foreground command (status -v)
+struct commandUsage lastBackground = {0};   // the most recent background job to finish
+
+// Adds the resource usage of one process to a running total
+void addUsage(struct rusage* total, const struct rusage* ru)
+{
+    timeradd(&total->ru_utime, &ru->ru_utime, &total->ru_utime);
+    timeradd(&total->ru_stime, &ru->ru_stime, &total->ru_stime);
+    if (ru->ru_maxrss > total->ru_maxrss)
+        total->ru_maxrss = ru->ru_maxrss;
+    total->ru_minflt += ru->ru_minflt;
+    total->ru_majflt += ru->ru_majflt;
+    total->ru_inblock += ru->ru_inblock;
+    total->ru_oublock += ru->ru_oublock;
+    total->ru_nvcsw += ru->ru_nvcsw;
+    total->ru_nivcsw += ru->ru_nivcsw;
+}
+
+// Returns the seconds of CLOCK_MONOTONIC time since start
+double secondsSince(const struct timespec* start)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+// Formats the one line timing report for the time keyword into out
+void formatTiming(char* out, size_t size, const struct commandUsage* cu)
+{
+    snprintf(out, size, "real %.3fs  user %.3fs  sys %.3fs\n", cu->wallSeconds,
+             cu->usage.ru_utime.tv_sec + cu->usage.ru_utime.tv_usec / 1e6,
+             cu->usage.ru_stime.tv_sec + cu->usage.ru_stime.tv_usec / 1e6);
+}
+
+// Prints the timing report of a foreground command (to stderr, like bash)
+void printTiming(const struct commandUsage* cu)
+{
+    char line[128];
+    formatTiming(line, sizeof(line), cu);
+    fputs(line, stderr);
+}
+
+// When finished background jobs are reported (the notify builtin)
+enum notifyMode
+{
+    NOTIFY_PROMPT,      // all together, just before the next prompt
+    NOTIFY_NOW,         // as soon as they are reaped, even at the prompt (like set -b)
+    NOTIFY_SUMMARY      // just before the next prompt, one line for a batch of several
+};
+
+const char* notifyModeNames[] = {"prompt", "now", "summary"};
+
+// Reports of finished background jobs waiting to be shown. The reaper formats
+// each one into buf as the job is reaped; flushNotices() shows them all with
+// a single write().
+struct noticeQueue
+{
+    char* buf;
+    size_t len;
+    size_t cap;
+    int done;       // jobs reported in buf
+    int failed;     // of those, the ones that did not exit with status 0
+    enum notifyMode mode;
+} notices = {0};
+
+// Adds a formatted report to the notice queue
+void appendNotice(const char* format, ...)
+{
+    va_list ap;
+    while (true)
+    {
+        va_start(ap, format);
+        int n = vsnprintf(notices.buf + notices.len, notices.cap - notices.len, format, ap);
+        va_end(ap);
+        if (n < 0)
+            return;
+        if ((size_t) n < notices.cap - notices.len)
+        {
+            notices.len += n;
+            return;
+        }
+        notices.cap = notices.cap ? 2 * notices.cap + n : 4096;
+        notices.buf = realloc(notices.buf, notices.cap);
+    }
+}
+
+// Shows every queued report. In summary mode a batch of several jobs is shown
+// as a single line ("412 jobs done, 3 failed").
+void flushNotices()
+{
+    if (notices.len == 0)
+        return;
+
+    const char* out = notices.buf;
+    size_t len = notices.len;
+    char summary[64];
+    if (notices.mode == NOTIFY_SUMMARY && notices.done > 1)
+    {
+        len = snprintf(summary, sizeof(summary), "%d jobs done, %d failed\n", notices.done, notices.failed);
+        out = summary;
+    }
+
+    while (len > 0)
+    {
+        ssize_t written = write(STDOUT_FILENO, out, len);
+        if (written == -1 && errno == EINTR)
+            continue;
+        if (written <= 0)
+            break;
+        out += written;
+        len -= written;
+    }
+    notices.len = 0;
+    notices.done = notices.failed = 0;
+}
+
+// Runs the notify builtin: with no argument, shows when finished background
+// jobs are reported; "notify prompt|now|summary" changes it.
+// Returns the builtin's exit status.
+int runNotify(struct userCommand* com)
+{
+    if (com->args[0] == NULL)
+    {
+        printf("notify %s\n", notifyModeNames[notices.mode]); fflush(stdout);
+        return 0;
+    }
+    for (int mode = NOTIFY_PROMPT; mode <= NOTIFY_SUMMARY; mode++)
+    {
+        if (strcmp(com->args[0], notifyModeNames[mode]) == 0)
+        {
+            notices.mode = mode;
+            return 0;
+        }
+    }
+    fprintf(stderr, "usage: notify [prompt | now | summary]\n");
+    return 1;
+}
+
+// Prints everything that is known about how much a finished command used
+void printUsage(const char* label, const struct commandUsage* cu)
+{
+    if (!cu->valid)
+        return;
+    printf("%s (pid %d):\n", label, cu->pid);
+    printf("  real %.3fs  user %.3fs  sys %.3fs\n", cu->wallSeconds,
+           cu->usage.ru_utime.tv_sec + cu->usage.ru_utime.tv_usec / 1e6,
+           cu->usage.ru_stime.tv_sec + cu->usage.ru_stime.tv_usec / 1e6);
+    printf("  max rss %ld KB  page faults %ld major / %ld minor\n",
+           cu->usage.ru_maxrss, cu->usage.ru_majflt, cu->usage.ru_minflt);
+    printf("  block i/o %ld in / %ld out  context switches %ld voluntary / %ld involuntary\n",
+           cu->usage.ru_inblock, cu->usage.ru_oublock, cu->usage.ru_nvcsw, cu->usage.ru_nivcsw);
+    if (cu->timedOut > 0)
+        printf("  timed out after %gs\n", cu->timedOut);
+    if (cu->inCgroup)
+    {
+        printf("  cgroup cpu %.3fs", cu->cgroupCpuUsec / 1e6);
+        if (cu->cgroupMemoryPeak >= 0)
+            printf("  memory peak %lld KB", cu->cgroupMemoryPeak / 1024);
+        printf("\n");
+    }
+    fflush(stdout);
+}
+
+// Runs the times builtin: the CPU time used by the shell itself and by all
+// of the children it has reaped
+void runTimes()
+{
+    struct rusage self, children;
+    getrusage(RUSAGE_SELF, &self);
+    getrusage(RUSAGE_CHILDREN, &children);
+    printf("shell     user %ld.%06lds  sys %ld.%06lds\n",
+           (long) self.ru_utime.tv_sec, (long) self.ru_utime.tv_usec,
+           (long) self.ru_stime.tv_sec, (long) self.ru_stime.tv_usec);
+    printf("children  user %ld.%06lds  sys %ld.%06lds  max rss %ld KB\n",
+           (long) children.ru_utime.tv_sec, (long) children.ru_utime.tv_usec,
+           (long) children.ru_stime.tv_sec, (long) children.ru_stime.tv_usec, children.ru_maxrss);
+    fflush(stdout);
+}
+
+// The limits the ulimit builtin can put on commands. The first three are
+// rlimits, set in each child before it execs. The last two are cgroup v2
+// limits on a whole job, which only work with SMALLSH_CGROUP.
+enum limitKind
+{
+    LIMIT_CPU_TIME,
+    LIMIT_ADDRESS_SPACE,
+    LIMIT_OPEN_FILES,
+    LIMIT_JOB_MEMORY,
+    LIMIT_JOB_CPU,
+    LIMITS
+};
+
+struct limitOption
+{
+    char flag;          // ulimit -flag
+    int resource;       // the rlimit, or -1 for a cgroup limit
+    const char* name;
+    rlim_t unit;        // how many of the limit's own units (bytes) one of the user's is
+};
+
+const struct limitOption limitOptions[LIMITS] =
+{
+    {'t', RLIMIT_CPU, "cpu time (seconds)", 1},
+    {'v', RLIMIT_AS, "virtual memory (kbytes)", 1024},
+    {'n', RLIMIT_NOFILE, "open files", 1},
+    {'m', -1, "job memory (kbytes)", 1024},     // memory.max
+    {'C', -1, "job cpu (percent)", 1},          // cpu.max
+};
+
+// The limits commands are started with. A limit that has not been set is
+// inherited from the shell (rlimits) or not imposed (cgroup limits).
+struct childLimits
+{
+    unsigned set;           // bit (1 << kind) for each limit that has been set
+    rlim_t value[LIMITS];   // in the user's units, or RLIM_INFINITY
+    char* cgroupBase;       // SMALLSH_CGROUP: the cgroup v2 directory each job gets a leaf under (null when off)
+    unsigned long leaves;   // leaves made so far, for naming them
+};
+
+struct childLimits limits = {0};
+int launchCgroup = -1;  // the cgroup (directory fd) the job being started goes in, or -1
+
+// A job's cgroup leaf that could not be removed because something the job
+// started was still in it (e.g. still dying from cgroup.kill)
+struct staleCgroup
+{
+    char* path;
+    struct staleCgroup* next;
+};
+
+struct staleCgroup* staleCgroups = NULL;
+
+// Removes a job's cgroup leaf, or remembers it to try again later
+void removeCgroup(char* path)
+{
+    if (rmdir(path) == 0 || errno != EBUSY)
+    {
+        free(path);
+        return;
+    }
+    struct staleCgroup* stale = malloc(sizeof(struct staleCgroup));
+    stale->path = path;
+    stale->next = staleCgroups;
+    staleCgroups = stale;
+}
+
+// Tries again to remove the leaves removeCgroup() could not (before each new
+// leaf is made)
+void removeStaleCgroups()
+{
+    struct staleCgroup** link = &staleCgroups;
+    while (*link != NULL)
+    {
+        struct staleCgroup* stale = *link;
+        if (rmdir(stale->path) == 0 || errno != EBUSY)
+        {
+            *link = stale->next;
+            free(stale->path);
+            free(stale);
+        }
+        else
+        {
+            link = &stale->next;
+        }
+    }
+}
+
+// Removes the leaves that are left when the shell exits, giving each up to
+// TIMEOUT_GRACE seconds to empty (cgroup.events says when it has)
+void removeCgroupsAtExit()
+{
+    for (struct staleCgroup* stale = staleCgroups; stale != NULL; stale = stale->next)
+    {
+        char file[PATH_MAX], events[256];
+        snprintf(file, sizeof(file), "%s/cgroup.events", stale->path);
+        int fd = open(file, O_RDONLY | O_CLOEXEC);
+        struct timespec start;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+
+        while (fd != -1 && secondsSince(&start) < TIMEOUT_GRACE)
+        {
+            ssize_t len = pread(fd, events, sizeof(events) - 1, 0);
+            if (len <= 0)
+                break;
+            events[len] = '\0';
+            if (strstr(events, "populated 0") != NULL)
+                break;
+            struct pollfd changed = {fd, POLLPRI, 0};
+            poll(&changed, 1, 100);
+        }
+        if (fd != -1)
+            close(fd);
+    }
+    removeStaleCgroups();
+}
+
+// Formats a limit the way ulimit shows it
+void formatLimit(char* out, size_t size, rlim_t value)
+{
+    if (value == RLIM_INFINITY)
+        snprintf(out, size, "unlimited");
+    else
+        snprintf(out, size, "%llu", (unsigned long long) value);
+}
+
+// Returns true if children need rlimits set or a cgroup of their own before
+// they exec. posix_spawn() cannot do either, so they are handed to a helper
+// (see zygoteCommand()) or started by forkCommand().
+bool childrenLimited()
+{
+    return (limits.set & ((1 << LIMIT_CPU_TIME) | (1 << LIMIT_ADDRESS_SPACE) | (1 << LIMIT_OPEN_FILES))) != 0
+           || launchCgroup != -1;
+}
+
+// Sets the rlimits the user asked for in a child that is about to exec: the
+// caller itself if pid is 0 (a child of forkCommand()), otherwise a helper
+// that has not been handed its command yet.
+// Returns false (after reporting it) if one could not be set.
+bool applyLimits(pid_t pid)
+{
+    for (int i = 0; i < LIMITS; i++)
+    {
+        if (!(limits.set & (1 << i)) || limitOptions[i].resource == -1)
+            continue;
+        struct rlimit rl;
+        rl.rlim_cur = limits.value[i] == RLIM_INFINITY ? RLIM_INFINITY : limits.value[i] * limitOptions[i].unit;
+        rl.rlim_max = rl.rlim_cur;
+        if (prlimit(pid, limitOptions[i].resource, &rl, NULL) == -1)
+        {
+            int error = errno;
+            perror(limitOptions[i].name);
+            errno = error;
+            return false;
+        }
+    }
+    return true;
+}
+
+// Writes value to the file name in the cgroup directory dirFD.
+// Returns false (after reporting it) if that failed.
+bool writeCgroupFile(int dirFD, const char* path, const char* name, const char* value)
+{
+    int fd = openat(dirFD, name, O_WRONLY | O_CLOEXEC);
+    bool written = fd != -1 && write(fd, value, strlen(value)) == (ssize_t) strlen(value);
+    if (!written)
+        fprintf(stderr, "%s/%s: %s\n", path, name, strerror(errno));
+    if (fd != -1)
+        close(fd);
+    return written;
+}
+
+// Makes the cgroup v2 leaf a new job runs in (SMALLSH_CGROUP/smallsh-PID-N)
+// and writes the job memory and cpu limits to its memory.max and cpu.max.
+// Stores the leaf's path (malloc'd) in *path and returns a directory fd
+// for it, which the job's processes are cloned into (see forkCommand()).
+// Returns -1 after reporting the problem if the leaf could not be made.
+int makeJobCgroup(char** path)
+{
+    char name[PATH_MAX];
+    removeStaleCgroups();
+    snprintf(name, sizeof(name), "%s/smallsh-%s-%lu", limits.cgroupBase, shellPidStr, ++limits.leaves);
+    if (mkdir(name, 0755) == -1)
+    {
+        perror(name);
+        return -1;
+    }
+    int fd = open(name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd == -1)
+    {
+        perror(name);
+        rmdir(name);
+        return -1;
+    }
+
+    // A limit that cannot be applied (e.g. its controller is not enabled) is
+    // reported, but the job still runs
+    char value[64];
+    if (limits.set & (1 << LIMIT_JOB_MEMORY))
+    {
+        rlim_t kbytes = limits.value[LIMIT_JOB_MEMORY];
+        if (kbytes == RLIM_INFINITY)
+            snprintf(value, sizeof(value), "max");
+        else
+            snprintf(value, sizeof(value), "%llu", (unsigned long long) kbytes * 1024);
+        writeCgroupFile(fd, name, "memory.max", value);
+    }
+    if (limits.set & (1 << LIMIT_JOB_CPU))
+    {
+        rlim_t percent = limits.value[LIMIT_JOB_CPU];
+        if (percent == RLIM_INFINITY)
+            snprintf(value, sizeof(value), "max 100000");
+        else
+            snprintf(value, sizeof(value), "%llu 100000", (unsigned long long) percent * 1000);
+        writeCgroupFile(fd, name, "cpu.max", value);
+    }
+
+    *path = strdup(name);
+    return fd;
+}
+
+// Reads a number from a file in a cgroup directory: the file's first number,
+// or the one after key (e.g. "usage_usec") if key is not null.
+// Returns -1 if it is not there.
+long long readCgroupNumber(const char* path, const char* name, const char* key)
+{
+    char file[PATH_MAX], buf[4096];
+    snprintf(file, sizeof(file), "%s/%s", path, name);
+    int fd = open(file, O_RDONLY | O_CLOEXEC);
+    if (fd == -1)
+        return -1;
+    ssize_t len = read(fd, buf, sizeof(buf) - 1);
+    close(fd);
+    if (len <= 0)
+        return -1;
+    buf[len] = '\0';
+
+    char* number = buf;
+    if (key != NULL)
+    {
+        size_t keyLen = strlen(key);
+        number = buf;
+        while (number != NULL && (strncmp(number, key, keyLen) != 0 || number[keyLen] != ' '))
+        {
+            number = strchr(number, '\n');
+            if (number != NULL)
+                number++;
+        }
+        if (number == NULL)
+            return -1;
+        number += keyLen + 1;
+    }
+    return strtoll(number, NULL, 10);
+}
+
+// Fills in the cgroup part of a job's usage from its leaf
+void readCgroupUsage(const char* path, struct commandUsage* cu)
+{
+    cu->inCgroup = true;
+    cu->cgroupCpuUsec = readCgroupNumber(path, "cpu.stat", "usage_usec");
+    cu->cgroupMemoryPeak = readCgroupNumber(path, "memory.peak", NULL);
+}
+
+// One process of a job
+struct jobProcess
+{
+    pid_t pid;
+    bool stopped;                   // stopped by a signal (and not continued yet)
+    bool reaped;                    // finished and reaped
+    int pidfd;                      // for signalling it when its job times out, or for waiting on it (-1 if not opened)
+    struct job* job;                // the job this process belongs to
+    struct jobProcess* hashNext;    // next process in the same hash bucket
+};
+
+// A command or pipeline that the shell started and has not finished reaping.
+// A pipeline is a single job with one process per stage. Foreground jobs are
+// only in the table while the shell waits for them (or once they stop).
+struct job
+{
+    pid_t pid;          // pid reported to the user (the first process)
+    int number;         // job number, for %n
+    pid_t pgid;         // the job's process group (0 without job control)
+    int running;        // processes not yet reaped
+    int stopped;        // processes stopped by a signal
+    int stopSignal;     // the signal that stopped the latest one
+    int exitMethod;     // how the last stage finished
+    bool foreground;    // the shell is waiting for it (its completion is not reported)
+    bool timed;         // report timing when done (time keyword)
+    char* text;         // the command line, for the jobs builtin (or null)
+    struct timespec started;
+    struct rusage usage;    // all of the job's reaped processes added together
+    unsigned limitsSet;     // the ulimit settings it was started with (see struct childLimits)
+    rlim_t limits[LIMITS];
+    char* cgroup;       // the cgroup leaf it runs in (SMALLSH_CGROUP), or null
+    double timeout;     // seconds it may run for (timeout prefix or SMALLSH_TIMEOUT), 0 for ever
+    struct timespec deadline;   // when it is next signalled (SIGTERM, then SIGKILL)
+    int timeoutSignals; // how many of those have been sent
+    int client;         // server mode: the connection it reports to (-1 for none)
+    struct job* prev;   // previous/next job in launch order
+    struct job* next;
+    int numProcesses;
+    int capacity;       // room for this many processes (records are recycled)
+    struct jobProcess procs[];
+};
+
+// The background jobs that are still running. Every process is hashed by pid
+// so that adding and removing a job are O(1) per process. The table grows as
+// needed; there is no cap on the number of jobs.
+struct jobTable
+{
+    struct jobProcess** buckets;
+    size_t numBuckets;      // always a power of two
+    size_t numProcesses;    // number of processes in the table
+    size_t count;           // number of jobs in the table
+    size_t deadlines;       // jobs that still have a timeout signal to come
+    struct job* first;      // oldest job (for walking every job, e.g. in runExit)
+    struct job* last;       // newest job
+    struct job* freeList;   // recycled job records
+};
+
+// Returns the bucket a pid belongs in
+size_t jobBucket(struct jobTable* jobs, pid_t pid)
+{
+    return ((size_t) pid * 2654435761u) & (jobs->numBuckets - 1);
+}
+
+// Sets up an empty job table
+void initJobTable(struct jobTable* jobs)
+{
+    jobs->numBuckets = JOB_BUCKETS;
+    jobs->buckets = calloc(jobs->numBuckets, sizeof(struct jobProcess*));
+    jobs->numProcesses = 0;
+    jobs->count = 0;
+    jobs->deadlines = 0;
+    jobs->first = NULL;
+    jobs->last = NULL;
+    jobs->freeList = NULL;
+}
+
+// Doubles the number of buckets and rehashes every process
+void growJobTable(struct jobTable* jobs)
+{
+    struct jobProcess** oldBuckets = jobs->buckets;
+    size_t oldNumBuckets = jobs->numBuckets;
+
+    jobs->numBuckets *= 2;
+    jobs->buckets = calloc(jobs->numBuckets, sizeof(struct jobProcess*));
+    for (size_t i = 0; i < oldNumBuckets; i++)
+    {
+        struct jobProcess* p = oldBuckets[i];
+        while (p != NULL)
+        {
+            struct jobProcess* next = p->hashNext;
+            size_t b = jobBucket(jobs, p->pid);
+            p->hashNext = jobs->buckets[b];
+            jobs->buckets[b] = p;
+            p = next;
+        }
+    }
+    free(oldBuckets);
+}
+
+// Adds a job made of the given pids to the table of jobs that are still running
+struct job* addToBackgroundPids(pid_t* pids, int numPids, struct jobTable* jobs)
+{
+    struct job* j = jobs->freeList;
+
+    while (jobs->numProcesses + numPids > jobs->numBuckets)
+        growJobTable(jobs);
+
+    // Reuse a junk record if there is one (single commands are by far the most common)
+    if (j != NULL && j->capacity >= numPids)
+    {
+        jobs->freeList = j->next;
+    }
+    else
+    {
+        j = malloc(sizeof(struct job) + numPids * sizeof(struct jobProcess));
+        j->capacity = numPids;
+    }
+
+    j->pid = pids[0];
+    j->number = jobs->last != NULL ? jobs->last->number + 1 : 1;
+    j->pgid = 0;
+    j->running = numPids;
+    j->stopped = 0;
+    j->stopSignal = 0;
+    j->exitMethod = 0;
+    j->foreground = false;
+    j->timed = false;
+    j->text = NULL;
+    j->limitsSet = limits.set;
+    memcpy(j->limits, limits.value, sizeof(j->limits));
+    j->cgroup = NULL;
+    j->timeout = 0;
+    j->timeoutSignals = 0;
+    j->client = -1;
+    clock_gettime(CLOCK_MONOTONIC, &j->started);
+    memset(&j->usage, 0, sizeof(j->usage));
+    j->numProcesses = numPids;
+    for (int i = 0; i < numPids; i++)
+    {
+        struct jobProcess* p = &j->procs[i];
+        size_t b = jobBucket(jobs, pids[i]);
+        p->pid = pids[i];
+        p->stopped = false;
+        p->reaped = false;
+        p->pidfd = -1;
+        p->job = j;
+        p->hashNext = jobs->buckets[b];
+        jobs->buckets[b] = p;
+    }
+    jobs->numProcesses += numPids;
+
+    j->prev = jobs->last;
+    j->next = NULL;
+    if (jobs->last != NULL)
+        jobs->last->next = j;
+    else
+        jobs->first = j;
+    jobs->last = j;
+    jobs->count++;
+    return j;
+}
+
+// Finds the process with the given pid in the table of jobs still running.
+// Returns null if the pid is not part of a background job.
+struct jobProcess* findBackgroundPid(pid_t pid, struct jobTable* jobs)
+{
+    struct jobProcess* p = jobs->buckets[jobBucket(jobs, pid)];
+
+    while (p != NULL && p->pid != pid)
+        p = p->hashNext;
+    return p;
+}
+
+// Removes a job (and all of its processes) from the table of jobs still running
+void removeFromBackgroundPids(struct job* j, struct jobTable* jobs)
+{
+    for (int i = 0; i < j->numProcesses; i++)
+    {
+        struct jobProcess** link = &jobs->buckets[jobBucket(jobs, j->procs[i].pid)];
+        while (*link != &j->procs[i])
+            link = &(*link)->hashNext;
+        *link = j->procs[i].hashNext;
+    }
+    jobs->numProcesses -= j->numProcesses;
+    for (int i = 0; i < j->numProcesses; i++)
+    {
+        if (j->procs[i].pidfd != -1)
+            close(j->procs[i].pidfd);
+    }
+    if (j->timeout > 0 && j->timeoutSignals < 2)
+        jobs->deadlines--;
+
+    if (j->prev != NULL) j->prev->next = j->next;
+    else jobs->first = j->next;
+    if (j->next != NULL) j->next->prev = j->prev;
+    else jobs->last = j->prev;
+    jobs->count--;
+    free(j->text);
+    j->text = NULL;
+
+    // Its processes are gone, so its cgroup can go too
+    if (j->cgroup != NULL)
+    {
+        removeCgroup(j->cgroup);
+        j->cgroup = NULL;
+    }
+
+    // Keep the record for the next background job
+    j->next = jobs->freeList;
+    jobs->freeList = j;
+}
+
+// Records the resource usage of a job that has finished in *cu
+void jobUsage(struct job* j, struct commandUsage* cu)
+{
+    cu->valid = true;
+    cu->pid = j->pid;
+    cu->usage = j->usage;
+    cu->wallSeconds = secondsSince(&j->started);
+    cu->inCgroup = false;
+    cu->timedOut = j->timeoutSignals > 0 ? j->timeout : 0;
+    cu->exitMethod = j->exitMethod;
+    if (j->cgroup != NULL)
+        readCgroupUsage(j->cgroup, cu);
+}
+
+// Kills everything in a job's cgroup leaf (if it has one) with cgroup.kill
+void killJobCgroup(struct job* j)
+{
+    if (j->cgroup == NULL)
+        return;
+    int cgroupFD = open(j->cgroup, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (cgroupFD != -1)
+    {
+        writeCgroupFile(cgroupFD, j->cgroup, "cgroup.kill", "1");
+        close(cgroupFD);
+    }
+}
+
+// Returns the timeout set for every command with SMALLSH_TIMEOUT (in
+// seconds, 0 for none)
+double defaultTimeout()
+{
+    const char* value = getVariable("SMALLSH_TIMEOUT");
+    return value != NULL ? parseDuration(value) : 0;
+}
+
+// Adds seconds to a CLOCK_MONOTONIC time
+void addSeconds(struct timespec* t, double seconds)
+{
+    long long ns = t->tv_nsec + (long long) (seconds * 1e9);
+    t->tv_sec += ns / 1000000000;
+    t->tv_nsec = ns % 1000000000;
+}
+
+// Gives job j a timeout: once it has run for that many seconds it is sent
+// SIGTERM, and TIMEOUT_GRACE seconds later SIGKILL (see checkDeadlines()).
+// Its processes are signalled through pidfds, so a pid that has been reused
+// can never be hit.
+void setTimeout(struct job* j, double seconds, struct jobTable* jobs)
+{
+    for (int i = 0; i < j->numProcesses; i++)
+        j->procs[i].pidfd = pidfd_open(j->procs[i].pid, 0);
+    j->timeout = seconds;
+    j->deadline = j->started;
+    addSeconds(&j->deadline, seconds);
+    jobs->deadlines++;
+}
+
+// Signals every job whose deadline has passed. Returns the milliseconds until
+// the next deadline, or -1 if there is none.
+int checkDeadlines(struct jobTable* jobs)
+{
+    if (jobs->deadlines == 0)
+        return -1;
+
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    long long next = -1;
+    for (struct job* j = jobs->first; j != NULL; j = j->next)
+    {
+        if (j->timeout == 0 || j->timeoutSignals == 2)
+            continue;
+
+        long long ms = (j->deadline.tv_sec - now.tv_sec) * 1000 + (j->deadline.tv_nsec - now.tv_nsec + 999999) / 1000000;
+        if (ms <= 0)
+        {
+            int signo = j->timeoutSignals == 0 ? SIGTERM : SIGKILL;
+            for (int i = 0; i < j->numProcesses; i++)
+            {
+                if (j->procs[i].reaped || j->procs[i].pidfd == -1)
+                    continue;
+                pidfd_send_signal(j->procs[i].pidfd, signo, NULL, 0);
+                if (j->procs[i].stopped)
+                    pidfd_send_signal(j->procs[i].pidfd, SIGCONT, NULL, 0);
+            }
+            // Whatever the job's processes started goes too, if it can be found:
+            // in the job's process group, or in its cgroup (cgroup.kill)
+            if (j->pgid > 0)
+                kill(-j->pgid, signo);
+            if (signo == SIGKILL)
+                killJobCgroup(j);
+
+            if (++j->timeoutSignals == 2)
+            {
+                jobs->deadlines--;
+                continue;
+            }
+            j->deadline = now;
+            addSeconds(&j->deadline, TIMEOUT_GRACE);
+            ms = TIMEOUT_GRACE * 1000;
+        }
+        if (next == -1 || ms < next)
+            next = ms;
+    }
+    return next > INT_MAX ? INT_MAX : next;
+}
+
+// Prints the background processes that are currently running
+// (For debugging purposes)
+void printRunningChildren(struct jobTable* jobs)
+{
+    for (struct job* j = jobs->first; j != NULL; j = j->next)
+    {
+        for (int i = 0; i < j->numProcesses; i++)
+            printf("%d\n", j->procs[i].pid);
+    }
+}
+
+// Sends a signal to every process of a job: to its process group with job
+// control, otherwise to each process that has not been reaped
+void signalJob(struct job* j, int signo)
+{
+    if (j->pgid > 0)
+    {
+        kill(-j->pgid, signo);
+        return;
+    }
+    for (int i = 0; i < j->numProcesses; i++)
+    {
+        if (!j->procs[i].reaped)
+            kill(j->procs[i].pid, signo);
+    }
+}
+
+// Continues a stopped job. It counts as running from now on; the kernel only
+// reports the continue once the processes get to run again.
+void continueJob(struct job* j)
+{
+    signalJob(j, SIGCONT);
+    for (int i = 0; i < j->numProcesses; i++)
+        j->procs[i].stopped = false;
+    j->stopped = 0;
+}
+
+// Returns true if every process of a job that is left has stopped
+bool jobStopped(struct job* j)
+{
+    return j->running > 0 && j->stopped == j->running;
+}
+
+// Returns the job named by spec, or null if there is no such job:
+//   %n          job number n
+//   %%, %+      the newest job (also when spec is null)
+//   pid         the job with that process
+struct job* findJob(const char* spec, struct jobTable* jobs)
+{
+    if (spec == NULL || strcmp(spec, "%%") == 0 || strcmp(spec, "%+") == 0)
+        return jobs->last;
+    if (spec[0] == '%')
+    {
+        int number = atoi(spec + 1);
+        for (struct job* j = jobs->last; j != NULL; j = j->prev)
+        {
+            if (j->number == number)
+                return j;
+        }
+        return NULL;
+    }
+    struct jobProcess* p = findBackgroundPid(atoi(spec), jobs);
+    return p != NULL ? p->job : NULL;
+}
+
+// Builds the text of a command line for the jobs builtin (malloc'd)
+char* jobText(struct userCommand* com)
+{
+    size_t size = 3;
+    for (struct userCommand* stage = com; stage != NULL; stage = stage->next)
+    {
+        for (int i = 0; stage->complete[i] != NULL; i++)
+            size += strlen(stage->complete[i]) + 1;
+        size += (stage->inputFile ? strlen(stage->inputFile) + 4 : 0)
+              + (stage->outputFile ? strlen(stage->outputFile) + 4 : 0) + 3;
+    }
+
+    char* text = malloc(size);
+    char* out = text;
+    for (struct userCommand* stage = com; stage != NULL; stage = stage->next)
+    {
+        if (stage != com)
+            out = stpcpy(out, " | ");
+        for (int i = 0; stage->complete[i] != NULL; i++)
+        {
+            if (i > 0)
+                *out++ = ' ';
+            out = stpcpy(out, stage->complete[i]);
+        }
+        if (stage->inputFile != NULL)
+            out += sprintf(out, " < %s", stage->inputFile);
+        if (stage->outputFile != NULL)
+            out += sprintf(out, " > %s", stage->outputFile);
+    }
+    *out = '\0';
+    return text;
+}
+
+// Handler for SIGCHLD.
+// Only records that a child has changed state; the children are reaped by
+// backgroundChecker() from the main loop, where it is safe to print.
+void handle_SIGCHLD(int signo)
+{
+    childExited = 1;
+}
+
+// Handler for SIGTSTP.
+// When the shell receives SIGTSTP, it will toggle the globla variable
+// that tracks the foreground only state.
+void handle_SIGTSTP(int signo)
+{
+    if (foregroundOnlyMode == 0)  
+    {
+        foregroundOnlyMode = 1;
+        char* message = "Entering foreground-only mode (& is now ignored)\n: ";
+	    write(STDOUT_FILENO, message, interactive ? 51 : 49);   // no prompt unless interactive
+    }    
+    else if (foregroundOnlyMode == 1)  
+    {
+        foregroundOnlyMode = 0;
+        char* message = "Exiting foreground-only mode\n: ";
+        write(STDOUT_FILENO, message, interactive ? 31 : 29);
+    }
+}
+
+// A command name whose location on PATH has been looked up
+struct pathEntry
+{
+    char* name;
+    char* path;     // absolute (or PATH-relative) file that will be executed
+    unsigned long hits;
+    struct pathEntry* next; // next entry in the same hash bucket
+};
+
+// Remembers where commands were found on PATH, so that launching a command
+// again is a single execve() instead of one failing execve() per PATH
+// directory. The cache is emptied when PATH changes, and by cd when PATH has
+// relative directories in it.
+struct pathCache
+{
+    struct pathEntry* buckets[PATH_BUCKETS];
+    char* pathVar;          // the PATH the entries were found with
+    bool relativeDirs;      // PATH has an empty or relative directory
+    unsigned long hits;
+    unsigned long misses;
+};
+
+struct pathCache commandCache = {0};
+
+// Returns the bucket a command name belongs in (FNV-1a hash)
+size_t pathBucket(const char* name)
+{
+    size_t hash = 2166136261u;
+    for (; *name; name++)
+        hash = (hash ^ (unsigned char) *name) * 16777619u;
+    return hash % PATH_BUCKETS;
+}
+
+// Forgets every remembered command location
+void clearCommandCache()
+{
+    for (int i = 0; i < PATH_BUCKETS; i++)
+    {
+        while (commandCache.buckets[i] != NULL)
+        {
+            struct pathEntry* next = commandCache.buckets[i]->next;
+            free(commandCache.buckets[i]->name);
+            free(commandCache.buckets[i]->path);
+            free(commandCache.buckets[i]);
+            commandCache.buckets[i] = next;
+        }
+    }
+}
+
+// Forgets where one command was found (e.g. because it was removed)
+void forgetCommand(const char* name)
+{
+    struct pathEntry** link = &commandCache.buckets[pathBucket(name)];
+
+    while (*link != NULL && strcmp((*link)->name, name) != 0)
+        link = &(*link)->next;
+    if (*link != NULL)
+    {
+        struct pathEntry* e = *link;
+        *link = e->next;
+        free(e->name);
+        free(e->path);
+        free(e);
+    }
+}
+
+// Searches the directories of PATH for an executable file called name, the
+// way execvp() does. Returns a malloc'd path, or null if there is none.
+char* searchPath(const char* name, const char* pathVar)
+{
+    size_t nameLen = strlen(name);
+    const char* dir = pathVar;
+
+    while (true)
+    {
+        const char* end = strchrnul(dir, ':');
+        size_t dirLen = end - dir;
+        char* candidate = malloc(dirLen + nameLen + 3);
+        struct stat st;
+
+        // An empty directory means the current directory
+        if (dirLen == 0)
+            candidate[dirLen++] = '.';
+        else
+            memcpy(candidate, dir, dirLen);
+        candidate[dirLen] = '/';
+        memcpy(candidate + dirLen + 1, name, nameLen + 1);
+
+        if (stat(candidate, &st) == 0 && S_ISREG(st.st_mode) && access(candidate, X_OK) == 0)
+            return candidate;
+        free(candidate);
+
+        if (*end == '\0')
+            return NULL;
+        dir = end + 1;
+    }
+}
+
+// Returns the file to execute for a command, from the cache if possible.
+// Names containing a / are used as is. Returns null if the command is not on PATH.
+const char* lookupCommand(const char* name)
+{
+    const char* pathVar = getVariable("PATH");
+    if (pathVar == NULL)
+        pathVar = "/bin:/usr/bin";
+
+    if (strchr(name, '/') != NULL)
+        return name;
+
+    // Start over if PATH has changed since the cache was filled
+    if (commandCache.pathVar == NULL || strcmp(commandCache.pathVar, pathVar) != 0)
+    {
+        clearCommandCache();
+        free(commandCache.pathVar);
+        commandCache.pathVar = strdup(pathVar);
+        commandCache.relativeDirs = pathVar[0] != '/';
+        for (const char* c = strchr(pathVar, ':'); c != NULL; c = strchr(c + 1, ':'))
+        {
+            if (c[1] != '/')
+                commandCache.relativeDirs = true;
+        }
+    }
+
+    size_t b = pathBucket(name);
+    for (struct pathEntry* e = commandCache.buckets[b]; e != NULL; e = e->next)
+    {
+        if (strcmp(e->name, name) == 0)
+        {
+            e->hits++;
+            commandCache.hits++;
+            return e->path;
+        }
+    }
+
+    commandCache.misses++;
+    char* path = searchPath(name, pathVar);
+    if (path == NULL)
+        return NULL;
+
+    struct pathEntry* e = malloc(sizeof(struct pathEntry));
+    e->name = strdup(name);
+    e->path = path;
+    e->hits = 0;
+    e->next = commandCache.buckets[b];
+    commandCache.buckets[b] = e;
+    return path;
+}
+
+// Runs the hash builtin:
+//   hash           list the remembered commands and the cache hit rate
+//   hash -r        forget every remembered command
+//   hash name...   look the commands up now and remember them
+int runHash(struct userCommand* com)
+{
+    if (com->args[0] != NULL && strcmp(com->args[0], "-r") == 0)
+    {
+        clearCommandCache();
+        commandCache.hits = commandCache.misses = 0;
+        return 0;
+    }
+
+    int result = 0;
+    for (int i = 0; com->args[i] != NULL; i++)
+    {
+        if (lookupCommand(com->args[i]) == NULL)
+        {
+            fprintf(stderr, "hash: %s: not found\n", com->args[i]);
+            result = 1;
+        }
+    }
+    if (com->args[0] != NULL)
+        return result;
+
+    printf("hits\tcommand\n");
+    for (int i = 0; i < PATH_BUCKETS; i++)
+    {
+        for (struct pathEntry* e = commandCache.buckets[i]; e != NULL; e = e->next)
+            printf("%4lu\t%s\n", e->hits, e->path);
+    }
+    unsigned long lookups = commandCache.hits + commandCache.misses;
+    printf("hit rate: %.1f%% (%lu hits, %lu misses)\n",
+           lookups ? 100.0 * commandCache.hits / lookups : 0.0, commandCache.hits, commandCache.misses);
+    fflush(stdout);
+    return 0;
+}
+
+// Fills in out (room for MAX_ARGS + 3 pointers) with the argv that runs the
+// file at path with /bin/sh, as execvp() does when the kernel cannot exec a
+// file (ENOEXEC: a script without a #! line): /bin/sh path arg1 arg2 ...
+char** shellScriptArgv(const char* path, char* const* argv, char** out)
+{
+    int n = 0;
+    out[n++] = "/bin/sh";
+    out[n++] = (char*) path;
+    for (int i = 1; argv[i] != NULL && n < MAX_ARGS + 2; i++)
+        out[n++] = argv[i];
+    out[n] = NULL;
+    return out;
+}
+
+#if defined(_POSIX_SPAWN) && _POSIX_SPAWN > 0
+// Launches the user's program (found at path) with posix_spawn(), which glibc implements with
+// clone(CLONE_VM | CLONE_VFORK) so the shell's page tables are never copied.
+// inFD, outFD and errFD are dup'd onto the child's stdin, stdout and stderr
+// (-1 leaves that stream alone). They become spawn file actions and the child's signal
+// dispositions are set through the spawn attributes:
+//   - SIGINT is reset to the default action for foreground children
+//     (background children keep the shell's SIG_IGN, unless they are in a
+//     process group of their own, which Ctrl-C does not reach)
+//   - SIGTTIN and SIGTTOU, which the shell ignores with job control, are reset
+//   - SIGTSTP is ignored. posix_spawn can only reset signals to SIG_DFL, so
+//     the shell briefly switches its own handler to SIG_IGN (which survives
+//     exec) with SIGTSTP blocked, and restores it once the child exists.
+// pgid is the process group to put the child in: -1 for the shell's own, 0
+// for a new group led by the child (which also gets the terminal if it is in
+// the foreground), otherwise an existing job's group.
+// Returns 0 and stores the child's pid in *pid on success. Returns -1 if the
+// spawn objects could not be set up, in which case the caller falls back to
+// fork(). Any other failure (e.g. the program does not exist) is returned as
+// a positive errno value.
+int spawnCommand(struct userCommand* com, const char* path, int inFD, int outFD, int errFD, bool inForeground, pid_t pgid, pid_t* pid)
+{
+    posix_spawn_file_actions_t actions;
+    posix_spawnattr_t attr;
+    sigset_t blockTSTP, oldMask, defaults;
+    struct sigaction ignoreAction = {0};
+    struct sigaction oldTSTP;
+    int result;
+
+    if (posix_spawn_file_actions_init(&actions) != 0)
+        return -1;
+    if (posix_spawnattr_init(&attr) != 0)
+    {
+        posix_spawn_file_actions_destroy(&actions);
+        return -1;
+    }
+
+    result = 0;
+    if (inFD != -1)
+        result |= posix_spawn_file_actions_adddup2(&actions, inFD, STDIN_FILENO);
+    if (outFD != -1)
+        result |= posix_spawn_file_actions_adddup2(&actions, outFD, STDOUT_FILENO);
+    if (errFD != -1)
+        result |= posix_spawn_file_actions_adddup2(&actions, errFD, STDERR_FILENO);
+
+    sigemptyset(&blockTSTP);
+    sigaddset(&blockTSTP, SIGTSTP);
+    sigprocmask(SIG_BLOCK, &blockTSTP, &oldMask);
+
+    sigemptyset(&defaults);
+    if (inForeground || pgid != -1)
+        sigaddset(&defaults, SIGINT);
+    sigaddset(&defaults, SIGTTIN);
+    sigaddset(&defaults, SIGTTOU);
+    result |= posix_spawnattr_setsigdefault(&attr, &defaults);
+    result |= posix_spawnattr_setsigmask(&attr, &oldMask);
+
+    short flags = POSIX_SPAWN_SETSIGDEF | POSIX_SPAWN_SETSIGMASK;
+    if (pgid != -1)
+    {
+        flags |= POSIX_SPAWN_SETPGROUP;
+        result |= posix_spawnattr_setpgroup(&attr, pgid);
+    }
+#ifdef POSIX_SPAWN_TCSETPGROUP
+    // The child takes the terminal itself, before it can try to read from it
+    if (pgid == 0 && inForeground)
+    {
+        flags |= POSIX_SPAWN_TCSETPGROUP;
+        result |= posix_spawnattr_tcsetpgrp_np(&attr, STDIN_FILENO);
+    }
+#endif
+    result |= posix_spawnattr_setflags(&attr, flags);
+
+    if (result != 0)
+    {
+        result = -1;
+    }
+    else
+    {
+        ignoreAction.sa_handler = SIG_IGN;
+        sigaction(SIGTSTP, &ignoreAction, &oldTSTP);
+        result = posix_spawn(pid, path, &actions, &attr, com->complete, environment());
+        if (result == ENOEXEC)      // a script without #!: run it with /bin/sh
+        {
+            char* argv[MAX_ARGS + 3];
+            result = posix_spawn(pid, "/bin/sh", &actions, &attr, shellScriptArgv(path, com->complete, argv), environment());
+        }
+        sigaction(SIGTSTP, &oldTSTP, NULL);
+#ifndef POSIX_SPAWN_TCSETPGROUP
+        if (result == 0 && pgid == 0 && inForeground)
+            tcsetpgrp(STDIN_FILENO, *pid);
+#endif
+    }
+
+    sigprocmask(SIG_SETMASK, &oldMask, NULL);   // a pending SIGTSTP is delivered here
+    posix_spawnattr_destroy(&attr);
+    posix_spawn_file_actions_destroy(&actions);
+    return result;
+}
+#endif
+
+// Launches the user's program (found at path) the traditional way: fork() a
+// child, set up its signal handling, process group, limits and redirections,
+// then execve(). Used when spawnCommand() is unavailable or cannot be used,
+// and for limited children when no helper is ready.
+// A job with a cgroup of its own (launchCgroup) is cloned straight into it
+// with clone3(CLONE_INTO_CGROUP); where the kernel cannot do that, the child
+// moves itself there before it execs.
+// Returns 0 and stores the child's pid in *pid on success, or the errno if
+// no process could be created (launchStage() reports it; the shell, or a
+// server with other clients, carries on).
+int forkCommand(struct userCommand* com, const char* path, int inFD, int outFD, int errFD, bool inForeground, pid_t pgid, pid_t* pid)
+{
+    struct sigaction ignoreAction = {0};
+    char** envp = environment();
+
+    // Define SIGINT behavior for a child running in the foreground
+    struct sigaction SIGINT_action = {0};
+    SIGINT_action.sa_handler = SIG_DFL; // set default behavior
+    SIGINT_action.sa_flags = 0; // No flags set
+
+    // Fork a new process
+    bool inCgroup = false;
+    if (launchCgroup != -1)
+    {
+        struct clone_args args = {0};
+        args.flags = CLONE_INTO_CGROUP;
+        args.exit_signal = SIGCHLD;
+        args.cgroup = launchCgroup;
+        *pid = syscall(SYS_clone3, &args, sizeof(args));
+        inCgroup = *pid != -1;
+    }
+    if (!inCgroup)
+        *pid = fork();
+
+    switch (*pid)
+    {
+        case -1:    // (e.g. EAGAIN at RLIMIT_NPROC or the cgroup's pids.max)
+            return errno;
+
+        // The child will execute user's desired program
+        case 0: 
+            // Set any children to ignore SIGTSP
+            ignoreAction.sa_handler = SIG_IGN;
+            sigaction(SIGTSTP, &ignoreAction, NULL); 
+
+            // Join the job's process group, taking the terminal if it is a new
+            // foreground job (the parent does the same, whichever runs first)
+            if (pgid != -1)
+            {
+                setpgid(0, pgid);
+                if (pgid == 0 && inForeground)
+                    tcsetpgrp(STDIN_FILENO, getpid());
+            }
+            sigaction(SIGTTIN, &SIGINT_action, NULL);
+            sigaction(SIGTTOU, &SIGINT_action, NULL);
+
+            // Foreground children will terminate upon receipt of SIGINT. Background children
+            // have inherited parent's behavior and will ignore it (unless Ctrl-C
+            // cannot reach them anyway, being in a process group of their own).
+            if (inForeground || pgid != -1)
+            {
+                sigaction(SIGINT, &SIGINT_action, NULL);    // Register default behavior
+            }
+
+            // Move into the job's cgroup if clone3() could not, and apply
+            // the limits set with ulimit
+            if (launchCgroup != -1 && !inCgroup)
+            {
+                int procs = openat(launchCgroup, "cgroup.procs", O_WRONLY | O_CLOEXEC);
+                if (procs == -1 || write(procs, "0", 1) != 1)
+                {
+                    perror("cgroup.procs");
+                    _exit(1);
+                }
+                close(procs);
+            }
+            if (!applyLimits(0))
+                _exit(1);
+
+            // Handle IO redirecton before executing the program
+            if (inFD != -1 && dup2(inFD, STDIN_FILENO) == -1)
+            { 
+                perror("source dup2()"); 
+                _exit(1); 
+            }
+            if (outFD != -1 && dup2(outFD, STDOUT_FILENO) == -1)
+            {
+                perror("dup2() failed");
+                _exit(1);
+            }
+            if (errFD != -1 && dup2(errFD, STDERR_FILENO) == -1)
+            {
+                perror("dup2() failed");
+                _exit(1);
+            }
+
+            // Attempt to execute the user's specified program (with /bin/sh
+            // if it is a script without #!)
+            execve(path, com->complete, envp);
+            if (errno == ENOEXEC)
+            {
+                char* argv[MAX_ARGS + 3];
+                execve("/bin/sh", shellScriptArgv(path, com->complete, argv), envp);
+            }
+            perror(com->command);
+            _exit(1);
+            break;
+    }
+
+    if (pgid != -1)
+    {
+        setpgid(*pid, pgid != 0 ? pgid : *pid);
+        if (pgid == 0 && inForeground)
+            tcsetpgrp(STDIN_FILENO, *pid);
+    }
+    return 0;
+}
+
+// A pre-forked helper process waiting to become a command (see zygoteCommand())
+struct zygote
+{
+    pid_t pid;
+    int sock;   // the shell's end of the helper's socket
+};
+
+// SMALLSH_ZYGOTE=N keeps N helpers forked ahead of time, so launching a
+// command does not have to wait for a fork. With limits on children (see
+// ulimit and SMALLSH_CGROUP) one is kept even without it, as posix_spawn()
+// cannot start them.
+struct zygotePool
+{
+    int size;   // how many helpers to keep ready (0 means the pool is off)
+    int count;  // how many are ready
+    struct zygote helpers[ZYGOTE_MAX];
+} zygotes = {0};
+
+// What the shell sends a helper: this header, then the program's path and
+// its argv as consecutive NUL terminated strings. The stdin, stdout and
+// stderr to use (if redirected) travel with the message as SCM_RIGHTS, in that order.
+struct zygoteRequest
+{
+    uint32_t argc;
+    int32_t pgid;       // as for spawnCommand()
+    uint8_t inForeground;
+    uint8_t hasInput;
+    uint8_t hasOutput;
+    uint8_t hasError;
+};
+
+// The life of a helper: wait for one command, then exec it. Like a child of
+// forkCommand(), a helper whose exec fails reports the error itself and exits
+// with status 1.
+void zygoteMain(int sock)
+{
+    static char buf[ZYGOTE_MSG];
+    char* argv[MAX_ARGS + 2];
+    int fds[3];
+    union
+    {
+        struct cmsghdr align;
+        char space[CMSG_SPACE(sizeof(fds))];
+    } control;
+    struct iovec iov = {buf, sizeof(buf) - 1};
+    struct msghdr msg = {0};
+    struct zygoteRequest req;
+
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = control.space;
+    msg.msg_controllen = sizeof(control.space);
+
+    ssize_t len = recvmsg(sock, &msg, MSG_CMSG_CLOEXEC);
+    if (len < (ssize_t) sizeof(req))
+        _exit(0);   // the shell closed the pool (or exited)
+    buf[len] = '\0';
+    memcpy(&req, buf, sizeof(req));
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (cmsg != NULL && cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+        memcpy(fds, CMSG_DATA(cmsg), cmsg->cmsg_len - CMSG_LEN(0));
+
+    char* path = buf + sizeof(req);
+    char* arg = path + strlen(path) + 1;
+    for (uint32_t i = 0; i < req.argc && i <= MAX_ARGS; i++)
+    {
+        argv[i] = arg;
+        arg += strlen(arg) + 1;
+    }
+    argv[req.argc <= MAX_ARGS ? req.argc : MAX_ARGS + 1] = NULL;
+
+    // Join the job's process group (and take the terminal) before anything
+    // else, as forkCommand() does
+    if (req.pgid != -1)
+    {
+        setpgid(0, req.pgid);
+        if (req.pgid == 0 && req.inForeground)
+            tcsetpgrp(STDIN_FILENO, getpid());
+    }
+
+    // Foreground children terminate on SIGINT; background ones keep ignoring
+    // it unless they are in a process group of their own
+    struct sigaction defaultAction = {0};
+    defaultAction.sa_handler = SIG_DFL;
+    if (req.inForeground || req.pgid != -1)
+        sigaction(SIGINT, &defaultAction, NULL);
+    sigaction(SIGTTIN, &defaultAction, NULL);
+    sigaction(SIGTTOU, &defaultAction, NULL);
+
+    if (req.hasInput && dup2(fds[0], STDIN_FILENO) == -1)
+    {
+        perror("source dup2()");
+        _exit(1);
+    }
+    if (req.hasOutput && dup2(fds[req.hasInput], STDOUT_FILENO) == -1)
+    {
+        perror("dup2() failed");
+        _exit(1);
+    }
+    if (req.hasError && dup2(fds[req.hasInput + req.hasOutput], STDERR_FILENO) == -1)
+    {
+        perror("dup2() failed");
+        _exit(1);
+    }
+
+    execve(path, argv, variables.envp);
+    if (errno == ENOEXEC)
+    {
+        char* shArgv[MAX_ARGS + 3];
+        execve("/bin/sh", shellScriptArgv(path, argv, shArgv), variables.envp);
+    }
+    perror(argv[0]);
+    _exit(1);
+}
+
+// Forks helpers until the pool is full again. Called before each command line
+// is read, so the forks happen while the shell would otherwise be idle.
+void fillZygotes()
+{
+    sigset_t blockTSTP, oldMask;
+    struct sigaction ignoreAction = {0};
+    ignoreAction.sa_handler = SIG_IGN;
+    sigemptyset(&blockTSTP);
+    sigaddset(&blockTSTP, SIGTSTP);
+    int size = zygotes.size;
+    if (size == 0 && (childrenLimited() || limits.cgroupBase != NULL))
+        size = 1;
+    if (zygotes.count >= size)
+        return;
+    environment();  // helpers exec with the shell's environment as it is now
+
+    while (zygotes.count < size)
+    {
+        int sockets[2];
+        if (socketpair(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0, sockets) == -1)
+        {
+            perror("socketpair()");
+            return;
+        }
+
+        // A helper ignores SIGTSTP like every child; it is blocked until then
+        // so the shell's handler can never run in the helper
+        sigprocmask(SIG_BLOCK, &blockTSTP, &oldMask);
+        pid_t pid = fork();
+        if (pid == 0)
+        {
+            sigaction(SIGTSTP, &ignoreAction, NULL);
+            sigprocmask(SIG_SETMASK, &oldMask, NULL);
+            // It keeps none of the shell's descriptors but its socket (the
+            // other helpers' sockets, a server's client connections, ...)
+            close_range(3, sockets[1] - 1, 0);
+            close_range(sockets[1] + 1, ~0U, 0);
+            zygoteMain(sockets[1]);
+        }
+        sigprocmask(SIG_SETMASK, &oldMask, NULL);
+        close(sockets[1]);
+
+        if (pid == -1)
+        {
+            perror("fork() failed!");
+            close(sockets[0]);
+            return;
+        }
+        zygotes.helpers[zygotes.count].pid = pid;
+        zygotes.helpers[zygotes.count].sock = sockets[0];
+        zygotes.count++;
+    }
+}
+
+// Gets rid of every ready helper (each exits when its socket closes). Helpers
+// are copies of the shell from when they were forked, so the pool must be
+// flushed whenever the state children inherit (the working directory, the
+// environment) changes. fillZygotes() then starts fresh ones.
+void flushZygotes()
+{
+    while (zygotes.count > 0)
+    {
+        struct zygote* z = &zygotes.helpers[--zygotes.count];
+        close(z->sock);
+        waitpid(z->pid, NULL, 0);
+    }
+}
+
+// Puts the limits on children on a helper that is about to be handed a
+// command. Returns false (after reporting it) if that failed.
+bool limitZygote(pid_t pid)
+{
+    if (launchCgroup != -1)
+    {
+        char pidStr[16];
+        snprintf(pidStr, sizeof(pidStr), "%d", pid);
+        if (!writeCgroupFile(launchCgroup, "job cgroup", "cgroup.procs", pidStr))
+            return false;
+    }
+    return applyLimits(pid);
+}
+
+// Launches the user's program (found at path) through a helper from the pool:
+// the argv and redirections are sent to the helper, which execs the program,
+// so the program's pid is the helper's pid. The shell does not wait for the
+// exec; handing the command over is all it costs. Limits on children are put
+// on the helper first: its rlimits with prlimit() and, for a job with a
+// cgroup of its own, the helper itself in the cgroup.
+// Returns 0 and stores the program's pid in *pid, -1 if no helper could
+// take the command (the caller then launches it another way), or the errno
+// if the limits could not be put on the helper (after reporting it).
+int zygoteCommand(struct userCommand* com, const char* path, int inFD, int outFD, int errFD, bool inForeground, pid_t pgid, pid_t* pid)
+{
+    static char buf[ZYGOTE_MSG];
+    struct zygoteRequest req = {0};
+    size_t len = sizeof(req);
+    int fds[3];
+    int numFDs = 0;
+    union
+    {
+        struct cmsghdr align;
+        char space[CMSG_SPACE(sizeof(fds))];
+    } control;
+
+    if (zygotes.count == 0)
+        return -1;
+
+    // Pack the path and the argv after the header
+    size_t pathLen = strlen(path) + 1;
+    if (len + pathLen >= sizeof(buf))
+        return -1;
+    memcpy(buf + len, path, pathLen);
+    len += pathLen;
+    for (req.argc = 0; com->complete[req.argc] != NULL; req.argc++)
+    {
+        size_t argLen = strlen(com->complete[req.argc]) + 1;
+        if (len + argLen >= sizeof(buf))
+            return -1;
+        memcpy(buf + len, com->complete[req.argc], argLen);
+        len += argLen;
+    }
+    req.inForeground = inForeground;
+    req.pgid = pgid;
+    if (inFD != -1)
+    {
+        req.hasInput = 1;
+        fds[numFDs++] = inFD;
+    }
+    if (outFD != -1)
+    {
+        req.hasOutput = 1;
+        fds[numFDs++] = outFD;
+    }
+    if (errFD != -1)
+    {
+        req.hasError = 1;
+        fds[numFDs++] = errFD;
+    }
+    memcpy(buf, &req, sizeof(req));
+
+    struct iovec iov = {buf, len};
+    struct msghdr msg = {0};
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    if (numFDs > 0)
+    {
+        msg.msg_control = control.space;
+        msg.msg_controllen = CMSG_SPACE(numFDs * sizeof(int));
+        struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+        cmsg->cmsg_level = SOL_SOCKET;
+        cmsg->cmsg_type = SCM_RIGHTS;
+        cmsg->cmsg_len = CMSG_LEN(numFDs * sizeof(int));
+        memcpy(CMSG_DATA(cmsg), fds, numFDs * sizeof(int));
+    }
+
+    // Limit the helper, then hand the command over. The message stays queued
+    // for the helper after the shell's end of the socket is closed.
+    struct zygote z = zygotes.helpers[--zygotes.count];
+    if (!limitZygote(z.pid))
+    {
+        int error = errno;
+        close(z.sock);
+        waitpid(z.pid, NULL, 0);
+        return error;
+    }
+    bool sent = sendmsg(z.sock, &msg, MSG_NOSIGNAL) == (ssize_t) len;
+    close(z.sock);
+    if (!sent)
+    {
+        // The helper has gone away (or never got the command, and exits now)
+        waitpid(z.pid, NULL, 0);
+        return -1;
+    }
+
+    // The next stage may join the process group before the helper gets to run
+    if (pgid != -1)
+    {
+        setpgid(z.pid, pgid != 0 ? pgid : z.pid);
+        if (pgid == 0 && inForeground)
+            tcsetpgrp(STDIN_FILENO, z.pid);
+    }
+    *pid = z.pid;
+    return 0;
+}
+
+// Starts one stage of a command. pipeIn/pipeOut are the pipe ends the stage
+// reads from and writes to (-1 if there is no previous/next stage); a file
+// named with < or > takes precedence over the pipe. With 2>&1, stderr goes
+// wherever stdout ends up. pgid is the process group to start it in (see spawnCommand()).
+// Returns 0 and stores the child's pid in *pid, or -1 (after printing an
+// error) if the stage could not be started.
+int launchStage(struct userCommand* com, int pipeIn, int pipeOut, bool inForeground, pid_t pgid, pid_t* pid)
+{
+    int inFD, outFD, errFD;
+    int result = -1;
+
+    // Open the redirection files before launching anything
+    uint64_t traced = traceStart();
+    if (redirectInput(com, pipeIn != -1, &inFD) == -1)
+        return -1;
+    if (redirectOutput(com, pipeOut != -1, &outFD) == -1)
+    {
+        if (inFD != -1) close(inFD);
+        return -1;
+    }
+    if (redirectError(com, &errFD) == -1)
+    {
+        if (inFD != -1) close(inFD);
+        if (outFD != -1) close(outFD);
+        return -1;
+    }
+    traceEnd(TRACE_REDIRECT, traced);
+    if (inFD == -1) inFD = pipeIn;
+    if (outFD == -1) outFD = pipeOut;
+    int errFile = errFD;    // the descriptor to close afterwards (if a file was opened)
+    if (com->errorToOutput)
+        errFD = outFD != -1 ? outFD : STDOUT_FILENO;
+
+    // Find the program, then launch it. If a remembered location has
+    // disappeared, look the command up again and retry once.
+    for (int attempt = 0; attempt < 2; attempt++)
+    {
+        traced = traceStart();
+        const char* path = lookupCommand(com->command);
+        traceEnd(TRACE_LOOKUP, traced);
+        if (path == NULL)
+        {
+            result = ENOENT;
+            break;
+        }
+
+        // Limited children (see ulimit) can be started by a helper or
+        // forkCommand(), not posix_spawn()
+        traced = traceStart();
+        bool limited = childrenLimited();
+        result = zygoteCommand(com, path, inFD, outFD, errFD, inForeground, pgid, pid);
+#if defined(_POSIX_SPAWN) && _POSIX_SPAWN > 0
+        if (result == -1 && !limited)
+        {
+            result = spawnCommand(com, path, inFD, outFD, errFD, inForeground, pgid, pid);
+        }
+#endif
+        if (result == -1)
+        {
+            result = forkCommand(com, path, inFD, outFD, errFD, inForeground, pgid, pid);
+        }
+        traceEnd(TRACE_SPAWN, traced);
+
+        if ((result != ENOENT && result != EACCES) || path == com->command)
+            break;
+        forgetCommand(com->command);
+    }
+
+    // The child has its own copies of the redirection files now
+    if (inFD != pipeIn) close(inFD);
+    if (outFD != pipeOut) close(outFD);
+    if (errFile != -1) close(errFile);
+
+    // The program could not be started (e.g. it does not exist). That is
+    // said wherever its stderr would have gone if it was handed one.
+    if (result != 0)
+    {
+        dprintf(com->errorFD != -1 ? com->errorFD : STDERR_FILENO, "%s: %s\n", com->command, strerror(result));
+        return -1;
+    }
+    return 0;
+}
+
+// Returns the number of stages in a command (1 unless it is a pipeline)
+int countStages(struct userCommand* com)
+{
+    int numStages = 0;
+    for (struct userCommand* stage = com; stage != NULL; stage = stage->next)
+        numStages++;
+    return numStages;
+}
+
+// Launches every stage of a command, connecting neighbouring stages with pipes
+// (see launchStage()). The pids of the stages that started are stored in pids,
+// which must have room for countStages(com) entries. *lastStarted tells
+// whether the last stage (whose status is the command's status) started.
+// With ownGroup the stages make up a new process group, led by the first one.
+// Returns the number of pids stored.
+int startCommand(struct userCommand* com, bool inForeground, bool ownGroup, pid_t* pids, bool* lastStarted)
+{
+    int numPids = 0;
+    int pipeIn = -1;    // read end of the pipe from the previous stage
+
+    *lastStarted = false;
+    for (struct userCommand* stage = com; stage != NULL; stage = stage->next)
+    {
+        int pipeFDs[2] = {-1, -1};
+
+        // Connect this stage to the next one. Both ends are close-on-exec, so
+        // each child only keeps the ends that were dup'd onto its stdin/stdout.
+        if (stage->next != NULL)
+        {
+            if (pipe2(pipeFDs, O_CLOEXEC) == -1)
+            {
+                perror("pipe2()");
+                break;
+            }
+            if (pipeSize > 0)
+                fcntl(pipeFDs[1], F_SETPIPE_SZ, pipeSize);
+        }
+
+        pid_t pgid = !ownGroup ? -1 : numPids > 0 ? pids[0] : 0;
+        *lastStarted = launchStage(stage, pipeIn, pipeFDs[1], inForeground, pgid, &pids[numPids]) == 0;
+        if (*lastStarted)
+            numPids++;
+
+        if (pipeIn != -1) close(pipeIn);
+        if (pipeFDs[1] != -1) close(pipeFDs[1]);
+        pipeIn = pipeFDs[0];
+    }
+    if (pipeIn != -1) close(pipeIn);
+
+    return numPids;
+}
+
+// Queues the report that a job has stopped
+void reportStopped(struct job* j)
+{
+    appendNotice("[%d] stopped by signal %d  %s\n", j->number, j->stopSignal, j->text ? j->text : "");
+    if (notices.mode == NOTIFY_NOW)
+        flushNotices();
+}
+
+// Records what wait4() reported for a child: that it stopped, continued or
+// finished (with its resource usage). If it was the last running process of
+// a background job, reports that the job is done (or stopped). A finished
+// foreground job is left for its waiter (see waitForeground()).
+// Returns false if the pid was not part of a job.
+bool backgroundReaped(pid_t pid, int childExitMethod, const struct rusage* ru, struct jobTable* jobs)
+{
+    struct jobProcess* p = findBackgroundPid(pid, jobs);
+    if (p == NULL)
+        return false;
+    struct job* j = p->job;
+
+    if (WIFSTOPPED(childExitMethod) || WIFCONTINUED(childExitMethod))
+    {
+        bool stopped = WIFSTOPPED(childExitMethod);
+        if (p->stopped != stopped)
+        {
+            p->stopped = stopped;
+            j->stopped += stopped ? 1 : -1;
+        }
+        if (stopped)
+        {
+            j->stopSignal = WSTOPSIG(childExitMethod);
+            if (jobStopped(j) && !j->foreground)
+                reportStopped(j);
+        }
+        return true;
+    }
+    if (p->stopped)     // killed while stopped
+    {
+        p->stopped = false;
+        j->stopped--;
+    }
+    p->reaped = true;
+
+    // A job's status is the status of its last stage
+    if (p == &j->procs[j->numProcesses - 1])
+        j->exitMethod = childExitMethod;
+    addUsage(&j->usage, ru);
+    if (--j->running == 0 && !j->foreground)
+    {
+        jobUsage(j, &lastBackground);
+
+        if (j->timeoutSignals > 0)
+            appendNotice("background pid %d timed out after %gs: %s %d\n", j->pid, j->timeout,
+                         WIFEXITED(j->exitMethod) ? "exit value:" : "terminated by signal", exitValue(j->exitMethod));
+        else
+            appendNotice("background pid %d is done: exit value: %d\n", j->pid, exitValue(j->exitMethod));
+        if (j->timed)
+        {
+            char line[128];
+            formatTiming(line, sizeof(line), &lastBackground);
+            appendNotice("%s", line);
+        }
+        notices.done++;
+        if (!WIFEXITED(j->exitMethod) || WEXITSTATUS(j->exitMethod) != 0 || j->timeoutSignals > 0)
+            notices.failed++;
+        if (notices.mode == NOTIFY_NOW)
+            flushNotices();
+        removeFromBackgroundPids(j, jobs);
+    }
+    return true;
+}
+
+// Reaps every background process that has finished since the last check
+// and queues a report for each job whose processes have all finished (or
+// stopped). Does nothing (no syscalls) unless SIGCHLD has arrived since the last call.
+void backgroundChecker(struct jobTable* jobs)
+{
+    int childExitMethod;
+    struct rusage ru;
+    pid_t pid;
+
+    if (!childExited)
+        return;
+    childExited = 0;
+
+    // Collect every child that is ready, one wait4() per finished child
+    uint64_t traced = traceStart();
+    while ((pid = wait4(-1, &childExitMethod, WNOHANG | WUNTRACED | WCONTINUED, &ru)) > 0)
+    {
+        backgroundReaped(pid, childExitMethod, &ru, jobs);
+    }
+    traceEnd(TRACE_REAP, traced);
+}
+
+// Reaps the processes of the jobs being shut down by runExit() as their
+// pidfds (registered with epoll) become readable, until every one is gone
+// or the deadline passes
+void drainJobs(int epollFD, int* remaining, const struct timespec* deadline, struct jobTable* jobs)
+{
+    struct epoll_event events[64];
+    struct timespec now;
+
+    while (*remaining > 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        long long ms = (deadline->tv_sec - now.tv_sec) * 1000 + (deadline->tv_nsec - now.tv_nsec + 999999) / 1000000;
+        if (ms <= 0)
+            return;
+
+        int n = epoll_wait(epollFD, events, 64, ms > INT_MAX ? INT_MAX : ms);
+        if (n == -1 && errno != EINTR)
+        {
+            perror("epoll_wait()");
+            return;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            struct jobProcess* p = events[i].data.ptr;
+            int childExitMethod;
+            struct rusage ru;
+            if (wait4(p->pid, &childExitMethod, WNOHANG, &ru) != p->pid)
+                continue;
+            epoll_ctl(epollFD, EPOLL_CTL_DEL, p->pidfd, NULL);
+            backgroundReaped(p->pid, childExitMethod, &ru, jobs);
+            (*remaining)--;
+        }
+    }
+}
+
+// Runs the exit command for the shell.
+// Every job is sent SIGTERM in one pass (stopped jobs are continued so they
+// can act on it) and given SMALLSH_EXIT_GRACE seconds (EXIT_GRACE by default)
+// to finish; their processes are waited for together through pidfds in an
+// epoll set. Whatever is left is sent SIGKILL. Then the shell says how each
+// job ended and exits. All of this is linear in the number of jobs.
+void runExit(struct jobTable* jobs)
+{
+    if (jobs->first == NULL)
+        exit(0);
+
+    const char* value = getVariable("SMALLSH_EXIT_GRACE");
+    double grace = value != NULL ? parseDuration(value) : EXIT_GRACE;
+    int epollFD = epoll_create1(EPOLL_CLOEXEC);
+    int remaining = 0, unwatched = 0;
+
+    // Signal every job and watch each of its processes that is left. The jobs
+    // are treated as foreground jobs so they are reported here, not as notices.
+    for (struct job* j = jobs->first; j != NULL; j = j->next)
+    {
+        j->foreground = true;
+        signalJob(j, SIGTERM);
+        if (j->stopped > 0)
+            signalJob(j, SIGCONT);
+        for (int i = 0; i < j->numProcesses; i++)
+        {
+            struct jobProcess* p = &j->procs[i];
+            if (p->reaped)
+                continue;
+            if (p->pidfd == -1)
+                p->pidfd = pidfd_open(p->pid, 0);
+            struct epoll_event event = {.events = EPOLLIN, .data.ptr = p};
+            if (p->pidfd == -1 || epoll_ctl(epollFD, EPOLL_CTL_ADD, p->pidfd, &event) == -1)
+                unwatched++;
+            else
+                remaining++;
+        }
+    }
+
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    addSeconds(&deadline, grace);
+    drainJobs(epollFD, &remaining, &deadline, jobs);
+
+    // Kill what did not go (and, with job control or cgroups, whatever it started)
+    int killed = 0;
+    for (struct job* j = jobs->first; j != NULL; j = j->next)
+    {
+        if (j->running == 0)
+            continue;
+        j->timeoutSignals = 2;  // (marks it as killed for the report)
+        for (int i = 0; i < j->numProcesses; i++)
+        {
+            if (!j->procs[i].reaped && j->procs[i].pidfd != -1)
+                pidfd_send_signal(j->procs[i].pidfd, SIGKILL, NULL, 0);
+        }
+        if (j->pgid > 0)
+            kill(-j->pgid, SIGKILL);
+        killJobCgroup(j);
+        killed++;
+    }
+    if (killed > 0)
+    {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        addSeconds(&deadline, TIMEOUT_GRACE);
+        drainJobs(epollFD, &remaining, &deadline, jobs);
+    }
+    close(epollFD);
+
+    // Say how each job ended
+    int exited = 0, signalled = 0, left = 0;
+    for (struct job* j = jobs->first; j != NULL; j = j->next)
+    {
+        printf("[%d] %d %s: ", j->number, j->pid, j->text ? j->text : "");
+        if (j->running > 0)
+        {
+            printf("still running\n");
+            left++;
+        }
+        else if (j->timeoutSignals == 2)
+            printf("killed after %gs\n", grace);
+        else if (WIFEXITED(j->exitMethod))
+        {
+            printf("exit value %d\n", WEXITSTATUS(j->exitMethod));
+            exited++;
+        }
+        else
+        {
+            printf("terminated by signal %d\n", WTERMSIG(j->exitMethod));
+            signalled++;
+        }
+    }
+    printf("%zu jobs: %d exited, %d terminated, %d killed", jobs->count, exited, signalled, killed - left);
+    if (left > 0 || unwatched > 0)
+        printf(", %d still running (%d processes could not be watched)", left, unwatched);
+    printf("\n");
+    fflush(stdout);
+
+    // Remove the jobs' cgroup leaves
+    while (jobs->first != NULL)
+        removeFromBackgroundPids(jobs->first, jobs);
+    exit(0);
+}
+
+// Blocks until job j has finished or stopped, handling whatever else happens
+// to the shell's children in the meantime.
+// While any job has a timeout, the shell sleeps in ppoll() on the job's
+// pidfds until the next deadline instead, with SIGCHLD let in only there
+// (so a child that stops also wakes it up).
+void waitForJob(struct job* j, struct jobTable* jobs)
+{
+    int childExitMethod;
+    struct rusage ru;
+
+    if (jobs->deadlines > 0)
+    {
+        struct pollfd fds[j->numProcesses];
+        sigset_t blockCHLD, oldMask;
+        sigemptyset(&blockCHLD);
+        sigaddset(&blockCHLD, SIGCHLD);
+        sigprocmask(SIG_BLOCK, &blockCHLD, &oldMask);
+
+        while (j->running > 0 && !jobStopped(j))
+        {
+            pid_t pid = wait4(-1, &childExitMethod, WNOHANG | WUNTRACED, &ru);
+            if (pid > 0)
+            {
+                backgroundReaped(pid, childExitMethod, &ru, jobs);
+                continue;
+            }
+            if (pid == -1 && errno != EINTR)
+            {
+                perror("wait4()");
+                break;
+            }
+
+            int nfds = 0;
+            for (int i = 0; i < j->numProcesses; i++)
+            {
+                if (!j->procs[i].reaped && j->procs[i].pidfd != -1)
+                {
+                    fds[nfds].fd = j->procs[i].pidfd;
+                    fds[nfds++].events = POLLIN;
+                }
+            }
+            int ms = checkDeadlines(jobs);
+            struct timespec timeout = {ms / 1000, (ms % 1000) * 1000000L};
+            ppoll(fds, nfds, ms >= 0 ? &timeout : NULL, &oldMask);
+        }
+        sigprocmask(SIG_SETMASK, &oldMask, NULL);
+        return;
+    }
+
+    while (j->running > 0 && !jobStopped(j))
+    {
+        pid_t pid = wait4(-1, &childExitMethod, WUNTRACED, &ru);
+        if (pid == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("wait4()");
+            return;
+        }
+        backgroundReaped(pid, childExitMethod, &ru, jobs);
+    }
+}
+
+// Waits for the foreground job j, which has the terminal if there is job
+// control, and then takes the terminal back. If the job finished, its status
+// (and resource usage) become the shell's and it is removed from the table.
+// If it stopped, it stays in the table as a stopped job.
+// Returns true if the job finished.
+bool waitForeground(struct job* j, struct jobTable* jobs, int* statusVar)
+{
+    uint64_t traced = traceStart();
+    j->foreground = true;
+    waitForJob(j, jobs);
+    traceEnd(TRACE_WAIT, traced);
+    if (jobControl)
+        tcsetpgrp(STDIN_FILENO, shellPgid);
+
+    if (j->running > 0)
+    {
+        j->foreground = false;
+        *statusVar = 128 + j->stopSignal;
+        return false;
+    }
+
+    jobUsage(j, &lastForeground);
+    if (j->timed)
+        printTiming(&lastForeground);
+
+    if (j->timeoutSignals > 0)
+    {
+        *statusVar = TIMEOUT_STATUS;
+        printf("timed out after %gs: %s %d\n", j->timeout,
+               WIFEXITED(j->exitMethod) ? "exit value" : "terminated by signal", exitValue(j->exitMethod));
+        fflush(stdout);
+    }
+    else if (WIFEXITED(j->exitMethod)) // Process exited normally
+    {
+        *statusVar = WEXITSTATUS(j->exitMethod);
+    }
+    else    // Process terminated with a signal
+    {
+        *statusVar = WTERMSIG(j->exitMethod);
+        printf("terminated by signal %d\n", *statusVar); fflush(stdout);
+    }
+    removeFromBackgroundPids(j, jobs);
+    return true;
+}
+
+// Launches a command or pipeline (see startCommand()) and tracks its
+// processes as one job, in a cgroup leaf of its own with SMALLSH_CGROUP and
+// with its timeout set. *lastStarted tells whether the last stage started.
+// Returns the job, or null if nothing could be started.
+struct job* launchJob(struct userCommand* com, struct jobTable* backgroundPids, bool inForeground, bool* lastStarted)
+{
+    pid_t pids[countStages(com)];
+    struct timespec started;
+
+    // With SMALLSH_CGROUP, every job gets a cgroup of its own
+    char* cgroup = NULL;
+    if (limits.cgroupBase != NULL)
+        launchCgroup = makeJobCgroup(&cgroup);
+
+    clock_gettime(CLOCK_MONOTONIC, &started);
+    int numPids = startCommand(com, inForeground, jobControl, pids, lastStarted);
+    if (launchCgroup != -1)
+    {
+        close(launchCgroup);
+        launchCgroup = -1;
+    }
+    if (numPids == 0 && cgroup != NULL)
+        removeCgroup(cgroup);
+    if (numPids > 0 && traceLineStart != 0)
+        traceEnd(TRACE_LAUNCH, traceLineStart);
+    if (numPids == 0)
+        return NULL;
+
+    // The stages are tracked as one job, in the foreground or background
+    struct job* j = addToBackgroundPids(pids, numPids, backgroundPids);
+    j->timed = com->timed;
+    j->started = started;
+    j->pgid = jobControl ? pids[0] : 0;
+    j->cgroup = cgroup;
+    double timeout = com->timeout > 0 ? com->timeout : defaultTimeout();
+    if (timeout > 0)
+        setTimeout(j, timeout, backgroundPids);
+    return j;
+}
+
+/* 
+Execute a non-built in command or pipeline.
+This function launches each stage of the command in a new child process
+(see launchJob()).
+Meanwhile, the parent process will block until every stage has finished if
+the command was specified to run in the foreground (or if 
+foreground only mode is enabled), and store the result of the last stage
+in *statusVar.
+If the command was specified to run in the background, and foreground
+only mode is disabled, its pids are tracked as one job and control returns
+to the user.
+With job control, the command runs in a process group of its own, and a
+foreground command is given the terminal until it finishes or stops.
+ */
+void execute(struct userCommand* com, struct jobTable* backgroundPids, int* statusVar)
+{
+    bool lastStarted;
+    bool inForeground = !com->bgCommand || foregroundOnlyMode;
+
+    struct job* j = launchJob(com, backgroundPids, inForeground, &lastStarted);
+    if (j == NULL)   // Nothing could be started
+    {
+        if (inForeground)
+        {
+            memset(&lastForeground, 0, sizeof(lastForeground));
+            *statusVar = 1;
+        }
+        return;
+    }
+
+    // If user requested a foreground command, or the command must be run in the foreground
+    // because foreground only mode is enabled, then parent will WAIT for every stage to end.
+    if (inForeground)   
+    {
+        if (!waitForeground(j, backgroundPids, statusVar))
+        {
+            // It stopped; it carries on as a background job (see fg and bg)
+            j->text = jobText(com);
+            printf("\n"); fflush(stdout);
+            reportStopped(j);
+        }
+        else if (!lastStarted)  // The last stage could not be started
+        {
+            *statusVar = 1;
+        }
+    }
+    else    // Running in the background--return control to the user
+    {
+        j->text = jobText(com);
+        lastBackgroundPid = j->procs[j->numProcesses - 1].pid;
+        printf("background pid is %d\n", j->pid); fflush(stdout);
+    }
+}
+
+// Runs the jobs builtin: lists the background jobs (newest marked +).
+// With -v, also shows each job's processes and how long it has run.
+void runJobs(struct userCommand* com, struct jobTable* jobs)
+{
+    bool verbose = com->args[0] != NULL && strcmp(com->args[0], "-v") == 0;
+
+    // Anything that has finished is reported first rather than listed
+    backgroundChecker(jobs);
+    flushNotices();
+
+    for (struct job* j = jobs->first; j != NULL; j = j->next)
+    {
+        printf("[%d]%c %-8s %s\n", j->number, j == jobs->last ? '+' : ' ',
+               jobStopped(j) ? "Stopped" : "Running", j->text ? j->text : "");
+        if (verbose)
+        {
+            printf("     pids");
+            for (int i = 0; i < j->numProcesses; i++)
+                printf(" %d%s", j->procs[i].pid, j->procs[i].reaped ? " (done)" : j->procs[i].stopped ? " (stopped)" : "");
+            printf("\n     running %.3fs", secondsSince(&j->started));
+            if (j->pgid > 0)
+                printf("  process group %d", j->pgid);
+            if (j->timeout > 0)
+                printf("  timeout %gs%s", j->timeout, j->timeoutSignals > 0 ? " (timed out)" : "");
+            printf("  user %.3fs  sys %.3fs (reaped processes)\n",
+                   j->usage.ru_utime.tv_sec + j->usage.ru_utime.tv_usec / 1e6,
+                   j->usage.ru_stime.tv_sec + j->usage.ru_stime.tv_usec / 1e6);
+            if (j->limitsSet != 0)
+            {
+                printf("     limits");
+                for (int i = 0; i < LIMITS; i++)
+                {
+                    char value[32];
+                    formatLimit(value, sizeof(value), j->limits[i]);
+                    if (j->limitsSet & (1 << i))
+                        printf("  %s %s", limitOptions[i].name, value);
+                }
+                printf("\n");
+            }
+            if (j->cgroup != NULL)
+            {
+                long long memory = readCgroupNumber(j->cgroup, "memory.current", NULL);
+                printf("     cgroup %s  cpu %.3fs", j->cgroup, readCgroupNumber(j->cgroup, "cpu.stat", "usage_usec") / 1e6);
+                if (memory >= 0)
+                    printf("  memory %lld KB", memory / 1024);
+                printf("\n");
+            }
+        }
+    }
+    fflush(stdout);
+}
+
+// Runs the fg builtin: continues a job (the newest by default, see findJob())
+// in the foreground, giving it the terminal, and waits for it.
+// Returns the shell's new status.
+int runFg(struct userCommand* com, struct jobTable* jobs, int status)
+{
+    struct job* j = findJob(com->args[0], jobs);
+    if (j == NULL)
+    {
+        fprintf(stderr, "fg: %s: no such job\n", com->args[0] ? com->args[0] : "current");
+        return 1;
+    }
+
+    printf("%s\n", j->text ? j->text : ""); fflush(stdout);
+    if (jobControl)
+        tcsetpgrp(STDIN_FILENO, j->pgid);
+    if (j->stopped > 0)
+        continueJob(j);
+    if (!waitForeground(j, jobs, &status))
+        reportStopped(j);
+    return status;
+}
+
+// Runs the bg builtin: continues a stopped job (the newest by default) in the background.
+// Returns the builtin's exit status.
+int runBg(struct userCommand* com, struct jobTable* jobs)
+{
+    struct job* j = findJob(com->args[0], jobs);
+    if (j == NULL)
+    {
+        fprintf(stderr, "bg: %s: no such job\n", com->args[0] ? com->args[0] : "current");
+        return 1;
+    }
+
+    if (j->stopped > 0)
+        continueJob(j);
+    printf("[%d] %s &\n", j->number, j->text ? j->text : ""); fflush(stdout);
+    return 0;
+}
+
+// Runs the wait builtin: blocks in wait4() until the given jobs (%n or pid,
+// see findJob()) have finished, or every background job if none are given.
+// Waiting ends early for a job that stops. Finished jobs are reported as usual.
+// Returns the exit value of the last job waited for (127 if it did not exist).
+int runWait(struct userCommand* com, struct jobTable* jobs)
+{
+    int status = 0;
+
+    if (com->args[0] == NULL)
+    {
+        struct job* j = jobs->first;
+        while (j != NULL)
+        {
+            if (jobStopped(j))
+            {
+                j = j->next;
+                continue;
+            }
+            waitForJob(j, jobs);
+            j = jobs->first;    // j may have been removed; start over
+        }
+        return 0;
+    }
+
+    for (int i = 0; com->args[i] != NULL; i++)
+    {
+        struct job* j = findJob(com->args[i], jobs);
+        if (j == NULL)
+        {
+            fprintf(stderr, "wait: %s: no such job\n", com->args[i]);
+            status = 127;
+            continue;
+        }
+
+        // A finished job's record goes to the free list untouched, so its
+        // exit status can still be read from it here
+        waitForJob(j, jobs);
+        if (j->running > 0)
+            status = 128 + j->stopSignal;
+        else
+            status = j->timeoutSignals > 0 ? TIMEOUT_STATUS : exitValue(j->exitMethod);
+    }
+    return status;
+}
+  
+
+// The shell's working directory, kept as a logical path (through symlinks,
+// as the user typed it) so that cd and pwd never need getcwd(), and the
+// pushd stack: for each entry, a descriptor held open on the directory
+// (O_PATH), so going back to it is one fchdir() however deep it is
+struct directoryStack
+{
+    char* pwd;          // the working directory ($PWD)
+    char* oldPwd;       // the one before ($OLDPWD), or null
+    int count;
+    int capacity;
+    int* fds;           // the stack, newest last
+    char** paths;
+} directories = {0};
+
+// Sets $PWD (and $OLDPWD to what it was) after the shell has changed
+// directory to path (malloc'd, absolute)
+void setWorkingDirectory(char* path)
+{
+    free(directories.oldPwd);
+    directories.oldPwd = directories.pwd;
+    directories.pwd = path;
+
+    char* entry = malloc(strlen(path) + 8);
+    sprintf(entry, "PWD=%s", path);
+    setVariable(entry, 3);
+    free(entry);
+    if (directories.oldPwd != NULL)
+    {
+        entry = malloc(strlen(directories.oldPwd) + 8);
+        sprintf(entry, "OLDPWD=%s", directories.oldPwd);
+        setVariable(entry, 6);
+        free(entry);
+    }
+
+    // Commands found through a relative PATH directory may be somewhere else now
+    if (commandCache.relativeDirs)
+        clearCommandCache();
+
+    // Ready helpers are still in the old directory
+    flushZygotes();
+}
+
+// Finds out the working directory the shell starts in: $PWD if it names
+// the current directory, or what getcwd() says (once)
+void initDirectories()
+{
+    const char* pwd = getenv("PWD");
+    struct stat named, current;
+    if (pwd != NULL && pwd[0] == '/' && stat(pwd, &named) == 0 && stat(".", &current) == 0
+        && named.st_dev == current.st_dev && named.st_ino == current.st_ino)
+    {
+        directories.pwd = strdup(pwd);
+    }
+    else
+    {
+        directories.pwd = getcwd(NULL, 0);
+        if (directories.pwd == NULL)
+            directories.pwd = strdup(".");
+    }
+}
+
+// Returns path (relative to base if it does not start with /) as an
+// absolute path without . and .. components or repeated slashes (malloc'd).
+// A .. removes the component before it, as in the logical path cd keeps.
+char* logicalPath(const char* base, const char* path)
+{
+    size_t baseLen = path[0] == '/' ? 0 : strlen(base);
+    char* result = malloc(baseLen + strlen(path) + 3);
+    size_t len = 0;
+
+    if (baseLen > 0)
+    {
+        memcpy(result, base, baseLen);
+        len = baseLen;
+        while (len > 1 && result[len - 1] == '/')
+            len--;
+    }
+    for (const char* p = path; *p != '\0';)
+    {
+        const char* end = strchrnul(p, '/');
+        size_t n = end - p;
+        if (n == 2 && p[0] == '.' && p[1] == '.')
+        {
+            while (len > 0 && result[len - 1] != '/')
+                len--;
+            if (len > 0)
+                len--;      // (the slash before it)
+        }
+        else if (n > 0 && !(n == 1 && p[0] == '.'))
+        {
+            if (len == 0 || result[len - 1] != '/')
+                result[len++] = '/';
+            memcpy(result + len, p, n);
+            len += n;
+        }
+        p = *end == '/' ? end + 1 : end;
+    }
+    if (len == 0)
+        result[len++] = '/';
+    result[len] = '\0';
+    return result;
+}
+
+// Changes the shell's directory to path. A path without .. is handed to
+// chdir() as it is, so a relative one is looked up from the current
+// directory only; one with .. goes to the logical path (so cd .. after
+// following a symlink comes back out of it, as the user expects).
+// Returns 0, or 1 after reporting the error.
+int changeDirectory(const char* path)
+{
+    char* target = logicalPath(directories.pwd, path);
+    bool dotDot = strcmp(path, "..") == 0 || strncmp(path, "../", 3) == 0
+               || strstr(path, "/../") != NULL || (strlen(path) >= 3 && strcmp(path + strlen(path) - 3, "/..") == 0);
+
+    if (chdir(dotDot ? target : path) == -1)
+    {
+        fprintf(stderr, "cd: %s: %s\n", path, strerror(errno));
+        free(target);
+        return 1;
+    }
+    setWorkingDirectory(target);
+    return 0;
+}
+
+// Runs the cd builtin:
+//   cd         go to $HOME
+//   cd dir     go to dir (relative to the working directory unless it starts with /)
+//   cd -       go back to $OLDPWD (and say where that is)
+// Returns the status (1 if the directory could not be changed).
+int cd(struct userCommand *com)
+{
+    if (com->args[0] != NULL && com->args[1] != NULL)
+    {
+        fprintf(stderr, "cd: too many arguments\n");
+        return 1;
+    }
+
+    const char* path = com->args[0];
+    if (path == NULL)
+    {
+        path = getVariable("HOME");
+        if (path == NULL)
+        {
+            fprintf(stderr, "cd: HOME not set\n");
+            return 1;
+        }
+    }
+    else if (strcmp(path, "-") == 0)
+    {
+        if (directories.oldPwd == NULL)
+        {
+            fprintf(stderr, "cd: OLDPWD not set\n");
+            return 1;
+        }
+        char* oldPwd = strdup(directories.oldPwd);
+        int result = changeDirectory(oldPwd);
+        free(oldPwd);
+        if (result == 0)
+        {
+            printf("%s\n", directories.pwd); fflush(stdout);
+        }
+        return result;
+    }
+    return changeDirectory(path);
+}
+
+// Runs the dirs builtin: prints the working directory and then the pushd
+// stack, newest first (dirs -c empties the stack)
+int runDirs(struct userCommand* com)
+{
+    if (com->args[0] != NULL && strcmp(com->args[0], "-c") == 0)
+    {
+        while (directories.count > 0)
+        {
+            directories.count--;
+            close(directories.fds[directories.count]);
+            free(directories.paths[directories.count]);
+        }
+        return 0;
+    }
+    printf("%s", directories.pwd);
+    for (int i = directories.count - 1; i >= 0; i--)
+        printf(" %s", directories.paths[i]);
+    printf("\n");
+    fflush(stdout);
+    return 0;
+}
+
+// Runs the pushd builtin: pushd dir saves the working directory on the
+// stack (as an open descriptor) and changes to dir; pushd alone swaps the
+// working directory with the top of the stack. Prints the stack like dirs.
+int runPushd(struct userCommand* com)
+{
+    if (com->args[0] != NULL && com->args[1] != NULL)
+    {
+        fprintf(stderr, "pushd: too many arguments\n");
+        return 1;
+    }
+    if (com->args[0] == NULL && directories.count == 0)
+    {
+        fprintf(stderr, "pushd: no other directory\n");
+        return 1;
+    }
+
+    int here = open(".", O_PATH | O_DIRECTORY | O_CLOEXEC);
+    if (here == -1)
+    {
+        perror("pushd");
+        return 1;
+    }
+    if (directories.count == directories.capacity)
+    {
+        directories.capacity = directories.capacity ? directories.capacity * 2 : 8;
+        directories.fds = realloc(directories.fds, directories.capacity * sizeof(int));
+        directories.paths = realloc(directories.paths, directories.capacity * sizeof(char*));
+    }
+
+    if (com->args[0] == NULL)
+    {
+        // Swap: go to the top entry, which then holds where the shell was
+        int top = directories.count - 1;
+        if (fchdir(directories.fds[top]) == -1)
+        {
+            perror("pushd");
+            close(here);
+            return 1;
+        }
+        char* path = directories.paths[top];
+        close(directories.fds[top]);
+        directories.fds[top] = here;
+        directories.paths[top] = strdup(directories.pwd);
+        setWorkingDirectory(path);
+    }
+    else
+    {
+        char* pwd = strdup(directories.pwd);
+        if (changeDirectory(com->args[0]) != 0)
+        {
+            free(pwd);
+            close(here);
+            return 1;
+        }
+        directories.fds[directories.count] = here;
+        directories.paths[directories.count++] = pwd;
+    }
+
+    struct userCommand none = {.args = (char*[]) {NULL}};
+    return runDirs(&none);
+}
+
+// Runs the popd builtin: goes back to the directory on top of the pushd
+// stack (one fchdir() on its descriptor) and removes it. Prints the stack
+// like dirs.
+int runPopd(struct userCommand* com)
+{
+    if (directories.count == 0)
+    {
+        fprintf(stderr, "popd: directory stack empty\n");
+        return 1;
+    }
+
+    int top = directories.count - 1;
+    if (fchdir(directories.fds[top]) == -1)
+    {
+        fprintf(stderr, "popd: %s: %s\n", directories.paths[top], strerror(errno));
+        return 1;
+    }
+    close(directories.fds[top]);
+    directories.count--;
+    setWorkingDirectory(directories.paths[top]);
+
+    struct userCommand none = {.args = (char*[]) {NULL}};
+    return runDirs(&none);
+}
+
+// Runs the export builtin:
+//   export                    list every variable
+//   export NAME=value...      set variables (commands started later see them)
+//   export NAME...            nothing to do (every variable is exported)
+// Returns the builtin's exit status.
+int runExport(struct userCommand* com)
+{
+    int result = 0;
+
+    if (com->args[0] == NULL)
+    {
+        for (char** e = environment(); *e != NULL; e++)
+            printf("%s\n", *e);
+        fflush(stdout);
+        return 0;
+    }
+
+    for (int i = 0; com->args[i] != NULL; i++)
+    {
+        const char* arg = com->args[i];
+        size_t nameLen = 0;
+        while (isNameChar(arg[nameLen]))
+            nameLen++;
+        if (!isNameStart(arg[0]) || (arg[nameLen] != '=' && arg[nameLen] != '\0'))
+        {
+            fprintf(stderr, "export: %s: not a valid identifier\n", arg);
+            result = 1;
+        }
+        else if (arg[nameLen] == '=')
+        {
+            setVariable(arg, nameLen);
+        }
+    }
+
+    // Ready helpers have the old environment (a new PATH empties the command
+    // cache by itself, see lookupCommand())
+    if (variables.envpStale)
+        flushZygotes();
+    return result;
+}
+
+// Runs the unset builtin: removes each named variable
+int runUnset(struct userCommand* com)
+{
+    for (int i = 0; com->args[i] != NULL; i++)
+        unsetVariable(com->args[i]);
+    if (variables.envpStale)
+        flushZygotes();
+    return 0;
+}
+
+// Prints one of the limits commands are started with, for ulimit
+void printLimit(int kind)
+{
+    rlim_t value = RLIM_INFINITY;
+    char text[32];
+
+    if (limits.set & (1 << kind))
+    {
+        value = limits.value[kind];
+    }
+    else if (limitOptions[kind].resource != -1)     // inherited from the shell
+    {
+        struct rlimit rl;
+        getrlimit(limitOptions[kind].resource, &rl);
+        if (rl.rlim_cur != RLIM_INFINITY)
+            value = rl.rlim_cur / limitOptions[kind].unit;
+    }
+    formatLimit(text, sizeof(text), value);
+    printf("%-24s (-%c) %s\n", limitOptions[kind].name, limitOptions[kind].flag, text);
+}
+
+// Runs the ulimit builtin, which limits the commands started after it (not
+// the shell itself):
+//   ulimit                 show every limit
+//   ulimit -t|-v|-n        show one
+//   ulimit -t N|unlimited  cpu time (seconds) of each process
+//   ulimit -v N|unlimited  virtual memory (kbytes) of each process
+//   ulimit -n N|unlimited  open files of each process
+//   ulimit -m N|unlimited  memory (kbytes) of each job, with SMALLSH_CGROUP
+//   ulimit -C N|unlimited  cpu of each job (percent of a CPU), with SMALLSH_CGROUP
+// Several may be given at once. Returns the builtin's exit status.
+int runUlimit(struct userCommand* com)
+{
+    int result = 0;
+
+    if (com->args[0] == NULL || strcmp(com->args[0], "-a") == 0)
+    {
+        for (int i = 0; i < LIMITS; i++)
+            printLimit(i);
+        fflush(stdout);
+        return 0;
+    }
+
+    for (int i = 0; com->args[i] != NULL; i++)
+    {
+        const char* arg = com->args[i];
+        int kind = 0;
+        while (kind < LIMITS && (arg[0] != '-' || arg[1] != limitOptions[kind].flag || arg[2] != '\0'))
+            kind++;
+        if (kind == LIMITS)
+        {
+            fprintf(stderr, "ulimit: %s: unknown limit (use -t, -v, -n, -m or -C)\n", arg);
+            return 1;
+        }
+
+        const char* value = com->args[i + 1];
+        if (value == NULL || value[0] == '-')
+        {
+            printLimit(kind);
+            continue;
+        }
+        i++;
+
+        if (limitOptions[kind].resource == -1 && limits.cgroupBase == NULL)
+        {
+            fprintf(stderr, "ulimit: -%c: needs SMALLSH_CGROUP (a cgroup v2 directory for jobs)\n", limitOptions[kind].flag);
+            result = 1;
+            continue;
+        }
+
+        char* end;
+        unsigned long long number = strtoull(value, &end, 10);
+        if (strcmp(value, "unlimited") == 0)
+        {
+            number = RLIM_INFINITY;
+        }
+        else if (end == value || *end != '\0' || number == 0 || number >= RLIM_INFINITY / limitOptions[kind].unit)
+        {
+            fprintf(stderr, "ulimit: %s: invalid limit\n", value);
+            result = 1;
+            continue;
+        }
+        limits.value[kind] = number;
+        limits.set |= 1 << kind;
+    }
+    fflush(stdout);
+    return result;
+}
+
+// Writes all len bytes of buf to fd. Returns false if that failed.
+bool writeAll(int fd, const char* buf, size_t len)
+{
+    while (len > 0)
+    {
+        ssize_t n = write(fd, buf, len);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n <= 0)
+            return false;
+        buf += n;
+        len -= n;
+    }
+    return true;
+}
+
+// The echo utility: writes its arguments separated by spaces and followed by
+// a newline (-n leaves the newline out) to outFD, in one write(). Leading
+// arguments made only of the letters n, e and E are options, as they are to
+// /bin/echo; -E (no escapes) is what it does anyway.
+// Returns -1 without writing anything if /bin/echo would do something else
+// (-e, --help or --version, or POSIXLY_CORRECT set), so that the program is
+// run instead.
+int runEcho(struct userCommand* com, int outFD, int errFD)
+{
+    char** args = com->args;
+    bool newline = true;
+    if (getVariable("POSIXLY_CORRECT") != NULL)
+        return -1;
+    if (args[0] != NULL && args[1] == NULL && (strcmp(args[0], "--help") == 0 || strcmp(args[0], "--version") == 0))
+        return -1;
+    for (; args[0] != NULL && args[0][0] == '-' && args[0][1] != '\0'
+           && strspn(args[0] + 1, "neE") == strlen(args[0] + 1); args++)
+    {
+        if (strchr(args[0], 'e') != NULL)
+            return -1;
+        if (strchr(args[0], 'n') != NULL)
+            newline = false;
+    }
+
+    size_t size = 1;
+    for (int i = 0; args[i] != NULL; i++)
+        size += strlen(args[i]) + 1;
+    char* buf = malloc(size);
+    size_t len = 0;
+    for (int i = 0; args[i] != NULL; i++)
+    {
+        if (i > 0)
+            buf[len++] = ' ';
+        size_t argLen = strlen(args[i]);
+        memcpy(buf + len, args[i], argLen);
+        len += argLen;
+    }
+    if (newline)
+        buf[len++] = '\n';
+
+    bool written = writeAll(outFD, buf, len);
+    free(buf);
+    if (!written)
+    {
+        dprintf(errFD, "echo: write error: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+// The pwd utility: writes the working directory (as cd keeps it) to outFD
+int runPwd(int outFD, int errFD)
+{
+    size_t len = strlen(directories.pwd);
+    char cwd[len + 1];
+    memcpy(cwd, directories.pwd, len);
+    cwd[len++] = '\n';
+    if (!writeAll(outFD, cwd, len))
+    {
+        dprintf(errFD, "pwd: write error: %s\n", strerror(errno));
+        return 1;
+    }
+    return 0;
+}
+
+// Parses an integer operand of test. Returns false if it is not a number.
+bool testInteger(const char* str, long long* value)
+{
+    char* end;
+    errno = 0;
+    *value = strtoll(str, &end, 10);
+    while (end != str && isBlank(*end))
+        end++;
+    return end != str && *end == '\0' && errno == 0;
+}
+
+// Evaluates a unary test (-n str, -f file, ...). Returns 0 if it is true, 1
+// if it is false, or -1 if op is not a unary operator.
+int testUnary(const char* op, const char* operand)
+{
+    struct stat st;
+
+    if (op[0] != '-' || op[1] == '\0' || op[2] != '\0')
+        return -1;
+    switch (op[1])
+    {
+        case 'n': return operand[0] == '\0';
+        case 'z': return operand[0] != '\0';
+        case 'r': return access(operand, R_OK) != 0;
+        case 'w': return access(operand, W_OK) != 0;
+        case 'x': return access(operand, X_OK) != 0;
+        case 't': return !isatty(atoi(operand));
+        case 'h':
+        case 'L': return lstat(operand, &st) != 0 || !S_ISLNK(st.st_mode);
+        case 'e':
+        case 'f':
+        case 'd':
+        case 's':
+        case 'p':
+        case 'S':
+        case 'b':
+        case 'c':
+            break;
+        default:
+            return -1;
+    }
+
+    if (stat(operand, &st) != 0)
+        return 1;
+    switch (op[1])
+    {
+        case 'f': return !S_ISREG(st.st_mode);
+        case 'd': return !S_ISDIR(st.st_mode);
+        case 's': return st.st_size == 0;
+        case 'p': return !S_ISFIFO(st.st_mode);
+        case 'S': return !S_ISSOCK(st.st_mode);
+        case 'b': return !S_ISBLK(st.st_mode);
+        case 'c': return !S_ISCHR(st.st_mode);
+        default:  return 0;     // -e
+    }
+}
+
+// Evaluates a binary test (a = b, m -lt n, f -nt g, ...). Returns 0 if it is
+// true, 1 if it is false, or -1 if op is not a binary operator or an operand
+// of a comparison is not a number.
+int testBinary(const char* left, const char* op, const char* right)
+{
+    if (strcmp(op, "=") == 0 || strcmp(op, "==") == 0)
+        return strcmp(left, right) != 0;
+    if (strcmp(op, "!=") == 0)
+        return strcmp(left, right) == 0;
+
+    if (strcmp(op, "-nt") == 0 || strcmp(op, "-ot") == 0 || strcmp(op, "-ef") == 0)
+    {
+        struct stat l, r;
+        bool haveLeft = stat(left, &l) == 0, haveRight = stat(right, &r) == 0;
+        if (op[1] == 'e')
+            return !(haveLeft && haveRight && l.st_dev == r.st_dev && l.st_ino == r.st_ino);
+        if (op[1] == 'o')   // -ot is -nt the other way around
+        {
+            struct stat swap = l;
+            l = r;
+            r = swap;
+            bool swapHave = haveLeft;
+            haveLeft = haveRight;
+            haveRight = swapHave;
+        }
+        if (!haveLeft)
+            return 1;
+        if (!haveRight)
+            return 0;
+        return !(l.st_mtim.tv_sec > r.st_mtim.tv_sec
+                 || (l.st_mtim.tv_sec == r.st_mtim.tv_sec && l.st_mtim.tv_nsec > r.st_mtim.tv_nsec));
+    }
+
+    static const char* comparisons[] = {"-eq", "-ne", "-lt", "-le", "-gt", "-ge"};
+    for (int i = 0; i < 6; i++)
+    {
+        if (strcmp(op, comparisons[i]) != 0)
+            continue;
+        long long l, r;
+        if (!testInteger(left, &l) || !testInteger(right, &r))
+            return -1;
+        bool results[] = {l == r, l != r, l < r, l <= r, l > r, l >= r};
+        return !results[i];
+    }
+    return -1;
+}
+
+// Evaluates the argc arguments of test the way POSIX decides what they mean
+// from how many there are (up to four; ! negates, ( ) groups).
+// Returns 0 if the expression is true, 1 if it is false, and -1 for anything
+// else: more arguments (-a and -o), or an error, which /usr/bin/test reports
+// in its own words. The program is then run instead.
+int testExpression(char** argv, int argc)
+{
+    int result;
+
+    switch (argc)
+    {
+        case 0:
+            return 1;
+        case 1:
+            return argv[0][0] == '\0';
+        case 2:
+            if (strcmp(argv[0], "!") == 0)
+                return argv[1][0] != '\0';
+            return testUnary(argv[0], argv[1]);
+        case 3:
+            result = testBinary(argv[0], argv[1], argv[2]);
+            if (result != -1)
+                return result;
+            if (strcmp(argv[0], "!") == 0)
+            {
+                result = testExpression(argv + 1, 2);
+                return result == -1 ? -1 : !result;
+            }
+            if (strcmp(argv[0], "(") == 0 && strcmp(argv[2], ")") == 0)
+                return testExpression(argv + 1, 1);
+            return -1;
+        case 4:
+            if (strcmp(argv[0], "!") == 0)
+            {
+                result = testExpression(argv + 1, 3);
+                return result == -1 ? -1 : !result;
+            }
+            if (strcmp(argv[0], "(") == 0 && strcmp(argv[3], ")") == 0)
+                return testExpression(argv + 1, 2);
+            return -1;
+        default:
+            return -1;
+    }
+}
+
+// Runs one of the utilities the shell has built in (echo, true, false, test,
+// [ or pwd) without starting a process. Its redirections are opened just as
+// they are for a program, and it writes straight to them.
+// Returns the utility's exit status, or -1 (having written nothing) if the
+// arguments are ones it does not handle the way the program would; the
+// program is then run instead.
+int runUtility(struct userCommand* com, enum builtin which)
+{
+    int inFD, outFD, errFD;
+    int result = 0;
+
+    if (redirectInput(com, false, &inFD) == -1)
+        return 1;
+    if (redirectOutput(com, false, &outFD) == -1)
+    {
+        if (inFD != -1) close(inFD);
+        return 1;
+    }
+    if (redirectError(com, &errFD) == -1)
+    {
+        if (inFD != -1) close(inFD);
+        if (outFD != -1) close(outFD);
+        return 1;
+    }
+    int out = outFD != -1 ? outFD : STDOUT_FILENO;
+    int err = com->errorToOutput ? out : errFD != -1 ? errFD : STDERR_FILENO;
+    fflush(stdout);
+
+    int argc = 0;
+    while (com->args[argc] != NULL)
+        argc++;
+
+    switch (which)
+    {
+        case BUILTIN_ECHO:
+            result = runEcho(com, out, err);
+            break;
+        case BUILTIN_FALSE:
+            result = argc == 1 && (strcmp(com->args[0], "--help") == 0 || strcmp(com->args[0], "--version") == 0) ? -1 : 1;
+            break;
+        case BUILTIN_BRACKET:
+            if (argc == 0 || strcmp(com->args[argc - 1], "]") != 0)
+                result = -1;    // (and [ --help)
+            else
+                result = testExpression(com->args, argc - 1);
+            break;
+        case BUILTIN_TEST:
+            result = testExpression(com->args, argc);
+            break;
+        case BUILTIN_PWD:   // (-L and -P are left to the program)
+            result = argc == 0 ? runPwd(out, err) : -1;
+            break;
+        default:    // true (the programs' --help and --version are not built in)
+            if (argc == 1 && (strcmp(com->args[0], "--help") == 0 || strcmp(com->args[0], "--version") == 0))
+                result = -1;
+            break;
+    }
+
+    if (inFD != -1) close(inFD);
+    if (outFD != -1) close(outFD);
+    if (errFD != -1) close(errFD);
+    return result;
+}
+
+// A command's result, kept by the cache prefix: what it wrote to stdout (in
+// an anonymous memory file) and its exit status
+struct cacheEntry
+{
+    uint64_t hash;
+    char* key;          // everything the result depends on (see cacheKey())
+    size_t keyLen;
+    int fd;             // memfd holding the output
+    size_t size;
+    int status;
+    unsigned long hits;
+    struct cacheEntry* hashNext;    // next entry in the same hash bucket
+    struct cacheEntry* newer;       // the LRU list, newest first
+    struct cacheEntry* older;
+};
+
+// The results of cached commands, hashed by key. The least recently used
+// are dropped once their output adds up to more than the budget
+// (SMALLSH_CACHE_SIZE bytes, CACHE_BUDGET by default).
+struct resultCache
+{
+    struct cacheEntry* buckets[CACHE_BUCKETS];
+    struct cacheEntry* newest;
+    struct cacheEntry* oldest;
+    size_t bytes;       // output held (plus the keys)
+    int count;
+    unsigned long hits;
+    unsigned long misses;
+};
+
+struct resultCache results = {0};
+
+// Returns the most output the cache may hold
+size_t cacheBudget()
+{
+    const char* value = getVariable("SMALLSH_CACHE_SIZE");
+    if (value == NULL)
+        return CACHE_BUDGET;
+    char* end;
+    double size = strtod(value, &end);
+    if (*end == 'K' || *end == 'k')
+        size *= 1024;
+    else if (*end == 'M' || *end == 'm')
+        size *= 1024 * 1024;
+    else if (*end == 'G' || *end == 'g')
+        size *= 1024 * 1024 * 1024;
+    return size > 0 ? (size_t) size : 0;
+}
+
+// Builds the key a cached command's result is filed under, in the arena a:
+// the program's path and identity (so a reinstalled program misses), the
+// arguments, the working directory, the environment, and the identity of
+// the input (the < file's device, inode, size and mtime, or the text of a
+// here-document). A command with neither reads the shell's stdin, which is
+// keyed the same way (with its offset) if it is a regular file and left out
+// if it is /dev/null. Returns null if the program or input file cannot be
+// found, or stdin is anything else (a terminal or pipe, whose input cannot
+// be known): the command is then just run.
+char* cacheKey(struct arena* a, struct userCommand* com, size_t* keyLen)
+{
+    const char* path = lookupCommand(com->command);
+    struct stat program, input;
+    const char* cwd = directories.pwd;
+    off_t offset = 0;
+    if (path == NULL || stat(path, &program) == -1)
+        return NULL;
+    if (com->inputFile != NULL && stat(com->inputFile, &input) == -1)
+        return NULL;
+    if (com->inputFile == NULL && com->hereText == NULL)
+    {
+        int in = com->inputFD != -1 ? com->inputFD : STDIN_FILENO;
+        if (fstat(in, &input) == -1)
+            return NULL;
+        if (S_ISREG(input.st_mode))
+            offset = lseek(in, 0, SEEK_CUR);
+        else if (!S_ISCHR(input.st_mode) || input.st_rdev != makedev(1, 3))    // /dev/null
+            return NULL;
+    }
+
+    size_t used = 0, cap = 256;
+    char* key = arenaAlloc(a, cap);
+    key = arenaAppend(a, key, &used, &cap, path, strlen(path) + 1);
+    key = arenaAppend(a, key, &used, &cap, (char*) &program.st_dev, sizeof(program.st_dev));
+    key = arenaAppend(a, key, &used, &cap, (char*) &program.st_ino, sizeof(program.st_ino));
+    key = arenaAppend(a, key, &used, &cap, (char*) &program.st_size, sizeof(program.st_size));
+    key = arenaAppend(a, key, &used, &cap, (char*) &program.st_mtim, sizeof(program.st_mtim));
+    for (int i = 0; com->complete[i] != NULL; i++)
+        key = arenaAppend(a, key, &used, &cap, com->complete[i], strlen(com->complete[i]) + 1);
+    key = arenaAppend(a, key, &used, &cap, "", 1);
+    key = arenaAppend(a, key, &used, &cap, cwd, strlen(cwd) + 1);
+    environment();
+    key = arenaAppend(a, key, &used, &cap, (char*) &variables.envHash, sizeof(variables.envHash));
+    if (com->hereText != NULL)
+    {
+        key = arenaAppend(a, key, &used, &cap, "<<", 2);
+        key = arenaAppend(a, key, &used, &cap, com->hereText, com->hereLength);
+    }
+    else if (com->inputFile != NULL || S_ISREG(input.st_mode))
+    {
+        key = arenaAppend(a, key, &used, &cap, "<", 1);
+        key = arenaAppend(a, key, &used, &cap, (char*) &offset, sizeof(offset));
+        key = arenaAppend(a, key, &used, &cap, (char*) &input.st_dev, sizeof(input.st_dev));
+        key = arenaAppend(a, key, &used, &cap, (char*) &input.st_ino, sizeof(input.st_ino));
+        key = arenaAppend(a, key, &used, &cap, (char*) &input.st_size, sizeof(input.st_size));
+        key = arenaAppend(a, key, &used, &cap, (char*) &input.st_mtim, sizeof(input.st_mtim));
+    }
+    *keyLen = used;
+    return key;
+}
+
+// Takes an entry out of the LRU list
+void unlinkCacheEntry(struct cacheEntry* e)
+{
+    if (e->newer != NULL) e->newer->older = e->older;
+    else results.newest = e->older;
+    if (e->older != NULL) e->older->newer = e->newer;
+    else results.oldest = e->newer;
+}
+
+// Puts an entry at the front of the LRU list
+void pushCacheEntry(struct cacheEntry* e)
+{
+    e->newer = NULL;
+    e->older = results.newest;
+    if (results.newest != NULL)
+        results.newest->newer = e;
+    else
+        results.oldest = e;
+    results.newest = e;
+}
+
+// Drops an entry from the cache
+void dropCacheEntry(struct cacheEntry* e)
+{
+    struct cacheEntry** link = &results.buckets[e->hash % CACHE_BUCKETS];
+    while (*link != e)
+        link = &(*link)->hashNext;
+    *link = e->hashNext;
+    unlinkCacheEntry(e);
+    results.bytes -= e->size + e->keyLen;
+    results.count--;
+    close(e->fd);
+    free(e->key);
+    free(e);
+}
+
+// Drops the least recently used entries until the cache fits in its budget
+void trimCache()
+{
+    size_t budget = cacheBudget();
+    while (results.oldest != NULL && results.bytes > budget)
+        dropCacheEntry(results.oldest);
+}
+
+// Copies size bytes from the start of the file in (a memfd) to out, with
+// copy_file_range() (within the kernel, sharing pages where the filesystem
+// can), or sendfile() if out is not a regular file, or read/write if both
+// fail. Returns false (after reporting it) if the copy failed.
+bool copyOutput(int in, size_t size, int out)
+{
+    off_t offset = 0;
+
+    while ((size_t) offset < size)
+    {
+        ssize_t n = copy_file_range(in, &offset, out, NULL, size - offset, 0);
+        if (n > 0)
+            continue;
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == 0)
+            break;
+
+        n = sendfile(out, in, &offset, size - offset);
+        if (n > 0)
+            continue;
+        if (n == -1 && errno == EINTR)
+            continue;
+
+        // Neither works with these descriptors: copy through a buffer
+        char buf[65536];
+        n = pread(in, buf, sizeof(buf) < size - offset ? sizeof(buf) : size - offset, offset);
+        if (n <= 0 || !writeAll(out, buf, n))
+        {
+            perror("cache");
+            return false;
+        }
+        offset += n;
+    }
+    return true;
+}
+
+// Runs a command prefixed with cache. If the same command (see cacheKey())
+// has run before, its output is copied from the cache to where its stdout
+// is going and its exit status is returned, without starting anything.
+// Otherwise it runs with its stdout collected in a memfd, which is then
+// copied out and kept, as long as it exited normally. (A command whose job
+// stops loses what it writes after that.)
+// A pipeline or background command is just run.
+void runCached(struct userCommand* com, struct jobTable* jobs, int* statusVar, struct arena* a)
+{
+    size_t keyLen;
+    char* key = NULL;
+    if (com->next == NULL && (!com->bgCommand || foregroundOnlyMode))
+        key = cacheKey(a, com, &keyLen);
+    if (key == NULL)
+    {
+        execute(com, jobs, statusVar);
+        return;
+    }
+
+    uint64_t hash = hashBytes(key, keyLen);
+    bool keep = true;
+    struct cacheEntry* e = results.buckets[hash % CACHE_BUCKETS];
+    while (e != NULL && (e->hash != hash || e->keyLen != keyLen || memcmp(e->key, key, keyLen) != 0))
+        e = e->hashNext;
+
+    if (e == NULL)
+    {
+        results.misses++;
+        int fd = memfd_create("smallsh-cache", MFD_CLOEXEC);
+        if (fd == -1)
+        {
+            perror("cache");
+            execute(com, jobs, statusVar);
+            return;
+        }
+
+        // Run it with stdout going to the memfd. Only a command that ran to
+        // the end leaves a new lastForeground behind.
+        struct commandUsage previous = lastForeground;
+        lastForeground.valid = false;
+        com->outputFD = fd;
+        execute(com, jobs, statusVar);
+        com->outputFD = -1;
+        if (!lastForeground.valid)
+        {
+            lastForeground = previous;
+            close(fd);
+            return;
+        }
+
+        struct stat st;
+        fstat(fd, &st);
+        e = malloc(sizeof(struct cacheEntry));
+        e->hash = hash;
+        e->key = malloc(keyLen);
+        memcpy(e->key, key, keyLen);
+        e->keyLen = keyLen;
+        e->fd = fd;
+        e->size = st.st_size;
+        e->status = *statusVar;
+        e->hits = 0;
+
+        // What it wrote still has to go where it was meant to (and a result
+        // that is no good for next time is dropped once it has)
+        keep = WIFEXITED(lastForeground.exitMethod) && lastForeground.timedOut == 0;
+        if (keep)
+        {
+            e->hashNext = results.buckets[hash % CACHE_BUCKETS];
+            results.buckets[hash % CACHE_BUCKETS] = e;
+            pushCacheEntry(e);
+            results.bytes += e->size + e->keyLen;
+            results.count++;
+        }
+    }
+    else
+    {
+        results.hits++;
+        e->hits++;
+        unlinkCacheEntry(e);
+        pushCacheEntry(e);
+        *statusVar = e->status;
+    }
+
+    // Copy the output to where the command's stdout goes
+    int outFD;
+    if (redirectOutput(com, false, &outFD) == 0)
+    {
+        fflush(stdout);
+        if (!copyOutput(e->fd, e->size, outFD != -1 ? outFD : STDOUT_FILENO))
+            *statusVar = 1;
+        if (outFD != -1)
+            close(outFD);
+    }
+    else
+    {
+        *statusVar = 1;
+    }
+
+    if (!keep)
+    {
+        close(e->fd);
+        free(e->key);
+        free(e);
+        return;
+    }
+    trimCache();
+}
+
+// Runs the cache builtin:
+//   cache      list the cached results and the hit rate
+//   cache -c   drop every cached result
+int runCache(struct userCommand* com)
+{
+    if (com->args[0] != NULL && strcmp(com->args[0], "-c") == 0)
+    {
+        while (results.oldest != NULL)
+            dropCacheEntry(results.oldest);
+        results.hits = results.misses = 0;
+        return 0;
+    }
+    if (com->args[0] != NULL)
+    {
+        fprintf(stderr, "cache: usage: cache [-c] or cache command...\n");
+        return 1;
+    }
+
+    printf("hits\tstatus\tbytes\tcommand\n");
+    for (struct cacheEntry* e = results.newest; e != NULL; e = e->older)
+    {
+        // The arguments follow the program's path and identity in the key
+        const char* arg = e->key + strlen(e->key) + 1 + sizeof(dev_t) + sizeof(ino_t) + sizeof(off_t) + sizeof(struct timespec);
+        printf("%4lu\t%d\t%zu\t", e->hits, e->status, e->size);
+        for (bool firstArg = true; *arg != '\0'; arg += strlen(arg) + 1, firstArg = false)
+            printf(firstArg ? "%s" : " %s", arg);
+        printf("\n");
+    }
+    unsigned long lookups = results.hits + results.misses;
+    printf("%d results, %zu of %zu bytes; hit rate: %.1f%% (%lu hits, %lu misses)\n",
+           results.count, results.bytes, cacheBudget(),
+           lookups ? 100.0 * results.hits / lookups : 0.0, results.hits, results.misses);
+    fflush(stdout);
+    return 0;
+}
+
+// Where the shell's command lines come from.
+// Input is taken in large blocks (or mapped whole, for regular files) and
+// split into lines in place, so no line is ever copied.
+struct lineReader
+{
+    int fd;
+    char* buf;
+    size_t size;    // bytes of input in buf
+    size_t cap;     // size of buf (read buffers always keep one spare byte)
+    size_t pos;     // where the next line starts
+    bool eof;       // no more input will be added to buf
+    bool mapped;    // buf is a private mapping of a regular file
+    char* tail;     // copy of an unterminated last line of a mapped file
+    size_t released;    // bytes at the start of a mapped file already given back
+    void (*onInterrupt)(void*); // called when a signal interrupts a read (or null)
+    void* interruptArg;
+};
+
+// Starts reading command lines from fd.
+// A regular file is mapped into memory rather than read. The descriptor is then
+// moved to the end of the file so a child reading stdin does not re-read the script.
+void readerInitFd(struct lineReader* r, int fd)
+{
+    struct stat st;
+    off_t offset = lseek(fd, 0, SEEK_CUR);
+
+    r->fd = fd;
+    r->pos = 0;
+    r->eof = false;
+    r->mapped = false;
+    r->tail = NULL;
+    r->released = 0;
+    r->onInterrupt = NULL;
+
+    if (offset != -1 && fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > offset)
+    {
+        r->buf = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (r->buf != MAP_FAILED)
+        {
+            madvise(r->buf, st.st_size, MADV_SEQUENTIAL);
+            r->size = r->cap = st.st_size;
+            r->pos = offset;
+            r->eof = true;
+            r->mapped = true;
+            lseek(fd, 0, SEEK_END);
+            return;
+        }
+    }
+
+    r->cap = READ_BLOCK;
+    r->buf = malloc(r->cap);
+    r->size = 0;
+}
+
+// Starts reading command lines from a string (for smallsh -c).
+// The string is split in place.
+void readerInitString(struct lineReader* r, char* str)
+{
+    r->fd = -1;
+    r->buf = str;
+    r->size = strlen(str);
+    r->cap = r->size + 1;   // the string's own NUL is the spare byte
+    r->pos = 0;
+    r->eof = true;
+    r->mapped = false;
+    r->tail = NULL;
+    r->released = 0;
+    r->onInterrupt = NULL;
+}
+
+// Closes the input and frees the reader's buffers
+void readerClose(struct lineReader* r)
+{
+    if (r->fd != -1)
+        close(r->fd);
+    if (r->mapped)
+        munmap(r->buf, r->size);
+    else if (r->fd != -1)
+        free(r->buf);
+    free(r->tail);
+}
+
+// Returns the next line of input with the newline replaced by a NUL, storing
+// its length (without the newline) in *len. The line stays valid until the
+// next call. Returns NULL at end of input or on a read error.
+char* readLine(struct lineReader* r, size_t* len)
+{
+    while (true)
+    {
+        char* start = r->buf + r->pos;
+        char* newline = memchr(start, '\n', r->size - r->pos);
+
+        if (newline != NULL)
+        {
+            // Pages of a mapped script that have been run are dropped, so the
+            // copies made by splitting lines in place do not pile up
+            if (r->mapped && r->pos - r->released >= MAP_RELEASE)
+            {
+                size_t upTo = r->pos & ~(size_t) (sysconf(_SC_PAGESIZE) - 1);
+                madvise(r->buf + r->released, upTo - r->released, MADV_DONTNEED);
+                r->released = upTo;
+            }
+
+            *newline = '\0';
+            *len = newline - start;
+            r->pos += *len + 1;
+            return start;
+        }
+
+        if (r->eof)
+        {
+            if (r->pos == r->size)
+                return NULL;
+
+            // The last line has no newline
+            *len = r->size - r->pos;
+            r->pos = r->size;
+            if (r->mapped)  // there may be no room after it in the mapping
+            {
+                free(r->tail);
+                r->tail = strndup(start, *len);
+                return r->tail;
+            }
+            start[*len] = '\0';
+            return start;
+        }
+
+        // Move the partial line to the front and read the next block after it
+        memmove(r->buf, start, r->size - r->pos);
+        r->size -= r->pos;
+        r->pos = 0;
+        if (r->cap - r->size <= READ_BLOCK / 2)
+        {
+            r->cap *= 2;
+            r->buf = realloc(r->buf, r->cap);
+        }
+
+        ssize_t bytesRead = read(r->fd, r->buf + r->size, r->cap - r->size - 1);
+        if (bytesRead == -1 && errno == EINTR)
+        {
+            if (r->onInterrupt != NULL)
+                r->onInterrupt(r->interruptArg);
+            continue;
+        }
+        if (bytesRead <= 0)
+            r->eof = true;
+        else
+            r->size += bytesRead;
+    }
+}
+
+// Reads the body of every here-document (<< delimiter) in a command: the lines
+// that follow it, up to a line that is just the delimiter. The body is copied
+// into the arena a, so parseCommand() must have been given a line that
+// reading more lines cannot overwrite (see hasHereDoc()).
+// Returns false (after printing an error) if the input ends first.
+bool readHereDocs(struct userCommand* com, struct lineReader* r, struct arena* a)
+{
+    for (struct userCommand* stage = com; stage != NULL; stage = stage->next)
+    {
+        if (stage->hereDelimiter == NULL)
+            continue;
+
+        size_t cap = 256;
+        char* body = arenaAlloc(a, cap);
+        size_t length = 0;
+        while (true)
+        {
+            if (interactive && r->fd == STDIN_FILENO)
+            {
+                printf("> ");
+                fflush(stdout);
+            }
+            size_t lineLength;
+            char* line = readLine(r, &lineLength);
+            if (line == NULL)
+            {
+                fprintf(stderr, "syntax error: here-document ended by end of input (wanted %s)\n", stage->hereDelimiter);
+                return false;
+            }
+            if (strcmp(line, stage->hereDelimiter) == 0)
+                break;
+
+            // Grow the body in the arena (the old copy is simply left behind)
+            if (length + lineLength + 1 > cap)
+            {
+                while (length + lineLength + 1 > cap)
+                    cap *= 2;
+                char* bigger = arenaAlloc(a, cap);
+                memcpy(bigger, body, length);
+                body = bigger;
+            }
+            memcpy(body + length, line, lineLength);
+            length += lineLength;
+            body[length++] = '\n';
+        }
+        stage->hereText = body;
+        stage->hereLength = length;
+        stage->hereDelimiter = NULL;
+    }
+    return true;
+}
+
+// Returns true if a line may contain a here-document. Such a line is copied
+// before it is parsed, because reading the body can move the reader's buffer.
+bool hasHereDoc(const char* line, size_t len)
+{
+    return memmem(line, len, "<<", 2) != NULL;
+}
+
+// The command history. Every line is appended to a history file, and the
+// byte offset of each entry is appended to an index file next to it (one
+// uint64_t per entry), so entry n is found without reading the entries
+// before it. Both files are mapped rather than read, so starting up costs the
+// same with a million entries as with ten. Several shells may share the
+// files: a line and its index entry are appended under one flock(), and
+// entries are numbered as they are in the file, so entry n is the same line
+// in every shell. This session's newest entries are also kept in a ring, so
+// !! and friends never touch the files.
+struct history
+{
+    bool enabled;
+    int fd;             // the history file (append only)
+    int indexFD;        // its index
+    char* map;          // the history file, mapped (mapSize bytes)
+    size_t mapSize;
+    uint64_t* offsets;  // the index, mapped (mappedEntries of them)
+    size_t mappedEntries;
+    size_t count;       // number of the newest entry (in the file, when this
+                        // shell last added one)
+    char* ring[HISTORY_RING];   // this shell's entry n, if kept, is ring[(n - 1) % HISTORY_RING]
+    size_t ringLength[HISTORY_RING];
+    size_t ringNumber[HISTORY_RING];    // the number of the entry in each slot (0 if none)
+} history = {0};
+
+// Maps the history file and its index as they are now
+void mapHistory()
+{
+    struct stat st, indexSt;
+
+    if (history.map != NULL)
+        munmap(history.map, history.mapSize);
+    if (history.offsets != NULL)
+        munmap(history.offsets, history.mappedEntries * sizeof(uint64_t));
+    history.map = NULL;
+    history.offsets = NULL;
+    history.mapSize = history.mappedEntries = 0;
+
+    if (fstat(history.fd, &st) == -1 || fstat(history.indexFD, &indexSt) == -1)
+        return;
+    if (st.st_size > 0)
+    {
+        history.map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, history.fd, 0);
+        if (history.map == MAP_FAILED)
+            history.map = NULL;
+        else
+            history.mapSize = st.st_size;
+    }
+    if (indexSt.st_size >= (off_t) sizeof(uint64_t))
+    {
+        history.offsets = mmap(NULL, indexSt.st_size, PROT_READ, MAP_SHARED, history.indexFD, 0);
+        if (history.offsets == MAP_FAILED)
+            history.offsets = NULL;
+        else
+            history.mappedEntries = indexSt.st_size / sizeof(uint64_t);
+    }
+}
+
+// Returns true if the index matches the history file: the last offset it
+// holds starts the file's last line
+bool historyIndexValid()
+{
+    if (history.mapSize == 0)
+        return history.mappedEntries == 0;
+    if (history.mappedEntries == 0 || history.map[history.mapSize - 1] != '\n')
+        return false;
+    uint64_t last = history.offsets[history.mappedEntries - 1];
+    return last < history.mapSize && (last == 0 || history.map[last - 1] == '\n')
+        && memchr(history.map + last, '\n', history.mapSize - last) == history.map + history.mapSize - 1;
+}
+
+// Rebuilds the index from the history file (when it was missing or the file
+// was changed by something else). This is the only time the whole file is read.
+void rebuildHistoryIndex()
+{
+    size_t cap = 4096, n = 0;
+    uint64_t* offsets = malloc(cap * sizeof(uint64_t));
+    size_t end = history.mapSize;
+
+    // A last line without a newline (from a crash) is left out of the history
+    while (end > 0 && history.map[end - 1] != '\n')
+        end--;
+    for (size_t pos = 0; pos < end; )
+    {
+        if (n == cap)
+        {
+            cap *= 2;
+            offsets = realloc(offsets, cap * sizeof(uint64_t));
+        }
+        offsets[n++] = pos;
+        pos = (char*) memchr(history.map + pos, '\n', end - pos) - history.map + 1;
+    }
+
+    if (ftruncate(history.indexFD, 0) == 0)
+        write(history.indexFD, offsets, n * sizeof(uint64_t));
+    free(offsets);
+    mapHistory();
+}
+
+// Opens (or creates) the history file at path and its index (path.idx)
+void initHistory(const char* path)
+{
+    char indexPath[4096];
+    snprintf(indexPath, sizeof(indexPath), "%s.idx", path);
+
+    history.fd = open(path, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    history.indexFD = open(indexPath, O_RDWR | O_CREAT | O_APPEND | O_CLOEXEC, 0600);
+    if (history.fd == -1 || history.indexFD == -1)
+    {
+        perror(history.fd == -1 ? path : indexPath);
+        if (history.fd != -1) close(history.fd);
+        if (history.indexFD != -1) close(history.indexFD);
+        return;
+    }
+
+    flock(history.fd, LOCK_EX);     // another shell may be adding an entry
+    mapHistory();
+    if (history.mapSize > 0 && history.map[history.mapSize - 1] != '\n')
+    {
+        // A line cut short by a crash: end it, so it is an entry like any other
+        write(history.fd, "\n", 1);
+        mapHistory();
+    }
+    if (!historyIndexValid())
+        rebuildHistoryIndex();
+    flock(history.fd, LOCK_UN);
+    history.count = history.mappedEntries;
+    history.enabled = true;
+}
+
+// Finds history entry n (counting from 1). Stores its text (not NUL
+// terminated) in *text and its length in *len.
+// Returns false if there is no such entry.
+bool historyEntry(size_t n, const char** text, size_t* len)
+{
+    if (n == 0 || n > history.count)
+        return false;
+
+    // This session's newest entries are in the ring
+    size_t slot = (n - 1) % HISTORY_RING;
+    if (history.ringNumber[slot] == n)
+    {
+        *text = history.ring[slot];
+        *len = history.ringLength[slot];
+        return true;
+    }
+
+    // Everything else is in the file (which may have grown since it was mapped)
+    if (n > history.mappedEntries)
+        mapHistory();
+    if (n > history.mappedEntries)
+        return false;
+    uint64_t start = history.offsets[n - 1];
+    uint64_t end = n < history.mappedEntries ? history.offsets[n] : history.mapSize;
+    *text = history.map + start;
+    *len = end - start - 1;     // without the newline
+    return true;
+}
+
+// Adds a line to the history: to the end of the file and index, and to the
+// ring. Its number is the number of entries in the index once it is added
+// (other shells may have added some since this one last did).
+void addHistory(const char* line, size_t len)
+{
+    struct iovec iov[3] = {{"\n", 1}, {(void*) line, len}, {"\n", 1}};
+    struct stat st, indexSt;
+    size_t number = history.count + 1;
+
+    // Nothing else appends between finding where the line starts and adding
+    // that to the index. A last line without a newline (from a crash) is
+    // ended first, so this one is not glued onto it.
+    flock(history.fd, LOCK_EX);
+    if (fstat(history.fd, &st) == 0)
+    {
+        char last = '\n';
+        if (st.st_size > 0 && pread(history.fd, &last, 1, st.st_size - 1) != 1)
+            last = '\n';
+        int ended = last == '\n';     // (then the first newline is left out)
+        uint64_t offset = st.st_size + !ended;
+        if (writev(history.fd, iov + ended, 3 - ended) == (ssize_t) (len + 2 - ended)
+            && write(history.indexFD, &offset, sizeof(offset)) == sizeof(offset)
+            && fstat(history.indexFD, &indexSt) == 0)
+            number = indexSt.st_size / sizeof(uint64_t);
+    }
+    flock(history.fd, LOCK_UN);
+
+    size_t slot = (number - 1) % HISTORY_RING;
+    free(history.ring[slot]);
+    history.ring[slot] = strndup(line, len);
+    history.ringLength[slot] = len;
+    history.ringNumber[slot] = number;
+    history.count = number;
+}
+
+// Returns the number of the newest entry before entry `before` that contains
+// needle, or 0 if there is none. The ring is searched first, then the file
+// from the end backwards, one HISTORY_WINDOW at a time with memmem(), so a
+// recent match is found without scanning the whole file. There is no index of
+// the text: an old or missing needle costs a scan of the file. The offsets
+// index only turns the byte offset of a match into its entry number.
+size_t searchHistory(const char* needle, size_t needleLen, size_t before)
+{
+    size_t n = before - 1;
+    const char* text;
+    size_t len;
+
+    // This session's newest entries, as long as they are in the ring
+    while (n > 0 && history.ringNumber[(n - 1) % HISTORY_RING] == n)
+    {
+        historyEntry(n, &text, &len);
+        if (memmem(text, len, needle, needleLen) != NULL)
+            return n;
+        n--;
+    }
+    if (n == 0)
+        return 0;
+
+    // The rest: entries 1..n of the file
+    if (n > history.mappedEntries)
+        mapHistory();
+    if (n > history.mappedEntries)
+        n = history.mappedEntries;
+    if (n == 0)
+        return 0;
+    // Windows overlap by needleLen - 1 bytes so a match can straddle them, and
+    // each one moves back HISTORY_WINDOW bytes however long the needle is
+    size_t window = HISTORY_WINDOW + needleLen - 1;
+    size_t end = n < history.mappedEntries ? history.offsets[n] : history.mapSize;
+    while (end > 0)
+    {
+        size_t start = end > window ? end - window : 0;
+
+        // The last match in [start, end)
+        const char* match = NULL;
+        const char* from = history.map + start;
+        const char* found;
+        while ((found = memmem(from, history.map + end - from, needle, needleLen)) != NULL)
+        {
+            match = found;
+            from = found + 1;
+        }
+        if (match != NULL)
+        {
+            // Binary search for the entry holding the match
+            size_t offset = match - history.map;
+            size_t low = 0, high = n;
+            while (high - low > 1)
+            {
+                size_t mid = (low + high) / 2;
+                if (history.offsets[mid] <= offset)
+                    low = mid;
+                else
+                    high = mid;
+            }
+            return low + 1;
+        }
+
+        if (start == 0)
+            break;
+        end = start + needleLen - 1;
+    }
+    return 0;
+}
+
+// Replaces history references in a line:
+//   !!      the previous command          !n      entry n
+//   !-n     the nth previous command      !?text  the newest command containing text
+// (a !? reference ends at the next ? or the end of the line). Nothing is
+// replaced inside single quotes (a ' inside double quotes is not one) or
+// after a backslash, or when ! is followed by a blank or = (or is $!).
+// Returns the line (in the arena a if anything was replaced, with *len
+// updated), or null after printing an error if an entry does not exist.
+char* expandHistory(struct arena* a, char* line, size_t* len)
+{
+    char* bang = memchr(line, '!', *len);
+    if (bang == NULL)
+        return line;
+
+    size_t cap = *len + 64, used = 0;
+    char* out = arenaAlloc(a, cap);
+    bool quoted = false;
+    bool doubleQuoted = false;
+    bool replaced = false;
+    char* p = line;
+    char* end = line + *len;
+
+    out[0] = '\0';
+    while (p < end)
+    {
+        char* next = p + 1;
+        size_t number = 0;
+
+        if (*p == '\'' && !doubleQuoted)
+            quoted = !quoted;
+        else if (*p == '"' && !quoted)
+            doubleQuoted = !doubleQuoted;
+        if (*p == '\\' && p + 1 < end)
+        {
+            out = arenaAppend(a, out, &used, &cap, p, 2);
+            p += 2;
+            continue;
+        }
+        if (*p != '!' || quoted || p + 1 == end || isBlank(p[1]) || p[1] == '=' || (p > line && p[-1] == '$'))
+        {
+            out = arenaAppend(a, out, &used, &cap, p, 1);
+            p++;
+            continue;
+        }
+
+        if (p[1] == '!')
+        {
+            number = history.count;
+            next = p + 2;
+        }
+        else if (p[1] >= '0' && p[1] <= '9')
+        {
+            number = strtoul(p + 1, &next, 10);
+        }
+        else if (p[1] == '-' && p + 2 < end && p[2] >= '0' && p[2] <= '9')
+        {
+            size_t back = strtoul(p + 2, &next, 10);
+            number = back <= history.count ? history.count + 1 - back : 0;
+        }
+        else if (p[1] == '?')
+        {
+            char* needle = p + 2;
+            char* close = memchr(needle, '?', end - needle);
+            char* needleEnd = close != NULL ? close : end;
+            next = close != NULL ? close + 1 : end;
+            number = needleEnd > needle ? searchHistory(needle, needleEnd - needle, history.count + 1) : 0;
+        }
+        else    // not a reference
+        {
+            out = arenaAppend(a, out, &used, &cap, p, 1);
+            p++;
+            continue;
+        }
+
+        const char* text;
+        size_t textLen;
+        if (!historyEntry(number, &text, &textLen))
+        {
+            fprintf(stderr, "%.*s: event not found\n", (int) (next - p), p);
+            return NULL;
+        }
+        out = arenaAppend(a, out, &used, &cap, text, textLen);
+        replaced = true;
+        p = next;
+    }
+
+    if (!replaced)
+        return line;
+    *len = used;
+    return out;
+}
+
+// Runs the history builtin:
+//   history           list every entry
+//   history n         list the last n entries
+//   history -s text   list the entries containing text, newest first
+// Returns the builtin's exit status.
+int runHistory(struct userCommand* com)
+{
+    const char* text;
+    size_t len;
+
+    if (!history.enabled)
+    {
+        fprintf(stderr, "history: no history (interactive shells and SMALLSH_HISTORY only)\n");
+        return 1;
+    }
+
+    if (com->args[0] != NULL && strcmp(com->args[0], "-s") == 0)
+    {
+        if (com->args[1] == NULL)
+        {
+            fprintf(stderr, "usage: history [n | -s text]\n");
+            return 1;
+        }
+        size_t needleLen = strlen(com->args[1]);
+        for (size_t n = searchHistory(com->args[1], needleLen, history.count + 1); n > 0;
+             n = searchHistory(com->args[1], needleLen, n))
+        {
+            historyEntry(n, &text, &len);
+            printf("%5zu  %.*s\n", n, (int) len, text);
+        }
+        fflush(stdout);
+        return 0;
+    }
+
+    size_t first = 1;
+    if (com->args[0] != NULL)
+    {
+        size_t last = strtoul(com->args[0], NULL, 10);
+        first = last < history.count ? history.count - last + 1 : 1;
+    }
+    for (size_t n = first; n <= history.count; n++)
+    {
+        if (historyEntry(n, &text, &len))
+            printf("%5zu  %.*s\n", n, (int) len, text);
+    }
+    fflush(stdout);
+    return 0;
+}
+
+// Copies str to out inside single quotes, so the command line parser reads it
+// back as one literal word. Returns the end of what was written.
+char* quoteWord(char* out, const char* str, size_t len)
+{
+    *out++ = '\'';
+    for (size_t i = 0; i < len; i++)
+    {
+        if (str[i] == '\'')     // ' becomes '\''
+        {
+            memcpy(out, "'\\''", 4);
+            out += 4;
+        }
+        else
+        {
+            *out++ = str[i];
+        }
+    }
+    *out++ = '\'';
+    return out;
+}
+
+// Builds one command line for parallel's template mode: every {} in the
+// template is replaced by arg, or arg is appended if the template has no {}.
+// Every word is quoted so that it reaches the command exactly as given.
+// The line is allocated from the arena a.
+char* parallelLine(struct arena* a, char** template, int numTemplate, const char* arg)
+{
+    size_t argLen = strlen(arg);
+    size_t size = 1;
+    bool substituted = false;
+
+    // Worst case: every character is a quote (4 bytes each) plus the enclosing quotes
+    for (int i = 0; i < numTemplate; i++)
+    {
+        size += 3;
+        for (const char* c = template[i]; *c; c++)
+            size += (c[0] == '{' && c[1] == '}') ? 4 * argLen : 4;
+    }
+    size += 4 * argLen + 3;
+
+    char* line = arenaAlloc(a, size);
+    char* out = line;
+    for (int i = 0; i < numTemplate; i++)
+    {
+        if (i > 0)
+            *out++ = ' ';
+        const char* piece = template[i];
+        const char* braces;
+        while ((braces = strstr(piece, "{}")) != NULL)
+        {
+            out = quoteWord(out, piece, braces - piece);
+            out = quoteWord(out, arg, argLen);
+            substituted = true;
+            piece = braces + 2;
+        }
+        out = quoteWord(out, piece, strlen(piece));
+    }
+    if (!substituted)
+    {
+        *out++ = ' ';
+        out = quoteWord(out, arg, argLen);
+    }
+    *out = '\0';
+    return line;
+}
+
+/*
+Runs the parallel builtin:
+    parallel [-j N] < command_file
+    parallel [-j N] command [args...] ::: arg1 arg2 ...
+The first form runs each line of the file as a command. The second runs the
+command once per argument after :::, with {} replaced by the argument (or
+the argument appended). At most N commands (default: one per CPU) run at a
+time; the next one starts as soon as one finishes. Commands run like
+foreground commands (Ctrl-C stops them, and no new ones are started), with
+the same timeout (timeout or SMALLSH_TIMEOUT); one that times out counts as
+failed. Background jobs that finish or reach their deadline in the meantime
+are handled as usual.
+Prints how many commands succeeded and failed and sets *statusVar to 1 if
+any failed.
+*/
+void runParallel(struct userCommand* com, struct jobTable* backgroundPids, int* statusVar)
+{
+    long maxRunning = sysconf(_SC_NPROCESSORS_ONLN);
+    int argInd = 0;
+    int templateEnd = -1;   // index of ::: in args, if given
+    struct lineReader reader;
+    int numArgs = 0;
+
+    // Read the options
+    if (com->args[0] != NULL && strcmp(com->args[0], "-j") == 0)
+    {
+        if (com->args[1] == NULL || (maxRunning = atol(com->args[1])) < 1)
+        {
+            fprintf(stderr, "parallel: -j needs a positive number\n");
+            *statusVar = 1;
+            return;
+        }
+        argInd = 2;
+    }
+    while (com->args[argInd + numArgs] != NULL)
+    {
+        if (templateEnd == -1 && strcmp(com->args[argInd + numArgs], ":::") == 0)
+            templateEnd = argInd + numArgs;
+        numArgs++;
+    }
+
+    // Find where the commands come from
+    if (templateEnd != -1)
+    {
+        if (templateEnd == argInd)
+        {
+            fprintf(stderr, "parallel: nothing to run before :::\n");
+            *statusVar = 1;
+            return;
+        }
+    }
+    else if (numArgs == 0 && com->inputFile != NULL)
+    {
+        int listFD = open(com->inputFile, O_RDONLY | O_CLOEXEC);
+        if (listFD == -1)
+        {
+            perror("source open()");
+            *statusVar = 1;
+            return;
+        }
+        readerInitFd(&reader, listFD);
+    }
+    else
+    {
+        fprintf(stderr, "usage: parallel [-j N] < command_file\n"
+                        "       parallel [-j N] command [args...] ::: arg1 arg2 ...\n");
+        *statusVar = 1;
+        return;
+    }
+
+    // The commands that are running, hashed by pid (a pipeline is one entry)
+    struct jobTable running;
+    initJobTable(&running);
+    struct arena lineArena;
+    arenaInit(&lineArena, ARENA_SIZE);
+
+    int nextArg = templateEnd + 1;
+    int started = 0, succeeded = 0, failed = 0, timedOut = 0;
+    bool interrupted = false;
+    bool moreCommands = true;
+
+    while (true)
+    {
+        // Start commands until the limit is reached
+        while (moreCommands && !interrupted && (long) running.count < maxRunning)
+        {
+            char* line;
+            size_t lineLength;
+
+            if (templateEnd != -1)
+            {
+                if (com->args[nextArg] == NULL)
+                {
+                    moreCommands = false;
+                    break;
+                }
+                line = parallelLine(&lineArena, &com->args[argInd], templateEnd - argInd, com->args[nextArg++]);
+            }
+            else if ((line = readLine(&reader, &lineLength)) == NULL)
+            {
+                moreCommands = false;
+                break;
+            }
+            if (line[0] == '\0' || line[0] == '#')  // skip blank lines and comments
+                continue;
+
+            bool fromFile = templateEnd == -1;
+            if (fromFile && hasHereDoc(line, lineLength))
+                line = arenaStrndup(&lineArena, line, lineLength);
+            struct userCommand* task = parseCommand(&lineArena, line);
+            if (task != NULL && fromFile && !readHereDocs(task, &reader, &lineArena))
+                task = NULL;
+            if (task != NULL && task->command != NULL)
+            {
+                pid_t pids[countStages(task)];
+                bool lastStarted;
+                struct timespec taskStarted;
+                clock_gettime(CLOCK_MONOTONIC, &taskStarted);
+                int numPids = startCommand(task, true, false, pids, &lastStarted);
+                started++;
+
+                if (!lastStarted)
+                    failed++;
+                if (numPids > 0)
+                {
+                    struct job* j = addToBackgroundPids(pids, numPids, &running);
+                    if (!lastStarted)   // only count it once, as the failure above
+                        j->exitMethod = -1;
+                    j->started = taskStarted;
+                    double timeout = task->timeout > 0 ? task->timeout : defaultTimeout();
+                    if (timeout > 0)
+                        setTimeout(j, timeout, &running);
+                }
+            }
+            arenaReset(&lineArena);
+        }
+
+        if (running.count == 0)
+            break;
+
+        // Wait for any child; ours are accounted for here, others are background jobs.
+        // While any job has a timeout, sleep in ppoll() until the next deadline
+        // instead, as waitForJob() does.
+        int childExitMethod;
+        struct rusage ru;
+        pid_t pid;
+        if (running.deadlines > 0 || backgroundPids->deadlines > 0)
+        {
+            sigset_t blockCHLD, oldMask;
+            sigemptyset(&blockCHLD);
+            sigaddset(&blockCHLD, SIGCHLD);
+            sigprocmask(SIG_BLOCK, &blockCHLD, &oldMask);
+            pid = wait4(-1, &childExitMethod, WNOHANG, &ru);
+            if (pid == 0)
+            {
+                struct pollfd fds[running.numProcesses];
+                int nfds = 0;
+                for (struct job* j = running.first; j != NULL; j = j->next)
+                {
+                    for (int i = 0; i < j->numProcesses; i++)
+                    {
+                        if (!j->procs[i].reaped && j->procs[i].pidfd != -1)
+                        {
+                            fds[nfds].fd = j->procs[i].pidfd;
+                            fds[nfds++].events = POLLIN;
+                        }
+                    }
+                }
+                int ms = checkDeadlines(&running);
+                int backgroundMs = checkDeadlines(backgroundPids);
+                if (ms == -1 || (backgroundMs != -1 && backgroundMs < ms))
+                    ms = backgroundMs;
+                struct timespec timeout = {ms / 1000, (ms % 1000) * 1000000L};
+                ppoll(fds, nfds, ms >= 0 ? &timeout : NULL, &oldMask);
+            }
+            sigprocmask(SIG_SETMASK, &oldMask, NULL);
+            if (pid == 0)
+                continue;
+        }
+        else
+        {
+            pid = wait4(-1, &childExitMethod, 0, &ru);
+        }
+        if (pid == -1)
+        {
+            if (errno == EINTR)
+                continue;
+            perror("wait4()");
+            break;
+        }
+
+        struct jobProcess* p = findBackgroundPid(pid, &running);
+        if (p == NULL)
+        {
+            backgroundReaped(pid, childExitMethod, &ru, backgroundPids);
+            continue;
+        }
+        struct job* j = p->job;
+        p->reaped = true;
+        if (p == &j->procs[j->numProcesses - 1] && j->exitMethod != -1)
+            j->exitMethod = childExitMethod;
+        if (--j->running > 0)
+            continue;
+
+        if (j->timeoutSignals > 0)
+            timedOut++;
+        if (j->exitMethod != -1)
+        {
+            if (j->timeoutSignals == 0 && WIFEXITED(j->exitMethod) && WEXITSTATUS(j->exitMethod) == 0)
+                succeeded++;
+            else
+                failed++;
+            if (WIFSIGNALED(j->exitMethod) && WTERMSIG(j->exitMethod) == SIGINT)
+                interrupted = true;
         }
+        removeFromBackgroundPids(j, &running);
     }
 
-    return 0;
+    if (templateEnd == -1)
+        readerClose(&reader);
+    free(lineArena.base);
+    free(running.buckets);
+    while (running.freeList != NULL)
+    {
+        struct job* next = running.freeList->next;
+        free(running.freeList);
+        running.freeList = next;
+    }
+
+    if (timedOut > 0)
+        printf("parallel: %d commands, %d succeeded, %d failed (%d timed out)%s\n", started, succeeded, failed,
+               timedOut, interrupted ? " (interrupted)" : "");
+    else
+        printf("parallel: %d commands, %d succeeded, %d failed%s\n", started, succeeded, failed,
+               interrupted ? " (interrupted)" : "");
+    fflush(stdout);
+    *statusVar = failed > 0 || interrupted;
 }
 
-// Redirects the input from STDOUT to the user's specified file
-// If user has not specified a file for a background command, 
-// STDOUT will be redirected to /dev/null
-// If user has not specified a file for a foreground command,
-// this function will do nothing (i.e. stdout will not be redirected)
-int redirectOutput(struct userCommand* userCom)
+// Handler for SIGALRM, which only interrupts the read of a command line when
+// a job's deadline comes (see armDeadlineTimer())
+void handle_SIGALRM(int signo)
 {
-    if (userCom->bgCommand && userCom->outputFile == NULL)  
-    {
-        char* defaultRedir = calloc(strlen("/dev/null" + 1), sizeof(char));
-        strcpy(defaultRedir, "/dev/null");
-        int targetFD = open(defaultRedir, O_WRONLY | O_CREAT | O_TRUNC, 0640);
-        if (targetFD == -1) 
-        {
-            perror("open() failed");
-            exit(1);
-        }
-    }
+}
 
-    // If user specified output redirection
-    // (The I/O module heavily influenced this section of code.)
-    else if (userCom->outputFile != NULL)
+bool deadlineTimerArmed = false;
+
+// While the shell waits for a command line, nothing else would notice a job's
+// deadline passing, so a timer (SIGALRM) interrupts the read then.
+// Signals the jobs that are due and arms the timer for the next deadline,
+// or disarms it if there is none.
+void armDeadlineTimer(struct jobTable* jobs)
+{
+    struct itimerval timer = {0};
+    int ms = checkDeadlines(jobs);
+
+    if (ms < 0 && !deadlineTimerArmed)
+        return;
+    if (ms >= 0)
     {
-        // Open the file for writing
-        int targetFD = open(userCom->outputFile, O_WRONLY | O_CREAT | O_TRUNC, 0640);
-        if (targetFD == -1) 
-        {
-            perror("open() failed");
-            exit(1);
-        }
-        // Redirect STDOUT to the target file
-        int result = dup2(targetFD, 1);
-        if (result ==  -1)
-        {
-            perror("dup2() failed");
-            exit(1);
-        }
+        timer.it_value.tv_sec = ms / 1000;
+        timer.it_value.tv_usec = ms % 1000 * 1000 + 1000;
     }
+    setitimer(ITIMER_REAL, &timer, NULL);
+    deadlineTimerArmed = ms >= 0;
+}
 
-    return 0;
+// Reports the background jobs that have finished (jobs is the job table).
+// Used while the shell waits at the prompt in notify now mode, or when a
+// job's deadline interrupts the wait.
+void reportFinishedJobs(void* jobs)
+{
+    backgroundChecker(jobs);
+    flushNotices();
+    armDeadlineTimer(jobs);
 }
 
-/* 
-Checks if command is built in to the shell.
-Currently only exit, cd and status are built in.
-Returns True if built in, false if not
-*/
-bool builtInCommand(struct userCommand* userCom)
+// Chooses whether SIGCHLD interrupts the shell's system calls (restart false)
+// or lets them carry on (restart true)
+void restartAfterSIGCHLD(bool restart)
 {
-    char *exit = calloc(strlen("exit"), sizeof(char)); 
-    strcpy(exit, "exit");
-    char *status = calloc(strlen("status"), sizeof(char)); 
-    strcpy(status, "status");
-    char *cd = calloc(strlen("cd"), sizeof(char)); 
-    strcpy(cd, "cd");
-    bool builtIn = false;
+    struct sigaction SIGCHLD_action = {0};
+    SIGCHLD_action.sa_handler = handle_SIGCHLD;
+    SIGCHLD_action.sa_flags = restart ? SA_RESTART : 0;   // stopped children are reported too
+    sigaction(SIGCHLD, &SIGCHLD_action, NULL);
+}
 
-    if (strcmp(userCom->command, exit) == 0) builtIn = true;
-    else if (strcmp(userCom->command, status) == 0) builtIn = true;
-    else if (strcmp(userCom->command, cd) == 0) builtIn = true;
+// Server mode (smallsh --listen PATH): one shell runs the command lines of
+// many clients, which connect to a Unix socket at PATH. A client first sends
+// its stdin, stdout and stderr (SCM_RIGHTS, along with its first bytes),
+// then command lines. Each client's lines run one after another, as they
+// would in a shell of its own, with the client's descriptors as their
+// stdin/stdout/stderr; different clients' commands run side by side, at
+// most SMALLSH_SERVER_JOBS of them at a time (the number of CPUs by
+// default). The server answers every line with a line on the socket:
+//   status N        the line has finished with status N ($?)
+//   background PID  the line started background job PID
+//   done PID N      background job PID has finished with status N
+// and closes the connection once the client has hung up and its jobs have
+// finished. Builtins that would change the shell for every client (cd,
+// export, ulimit, ...) are refused; exit ends the client's session.
 
-    return builtIn;
+// What an epoll event is about: the listening socket, a client's
+// connection, or a job's process (the value is the client's slot, or the pid)
+enum serverEvent
+{
+    EVENT_LISTEN,
+    EVENT_CLIENT,
+    EVENT_PROCESS
+};
+
+#define SERVER_EVENT(kind, value) ((uint64_t) (kind) << 32 | (uint32_t) (value))
+
+// One client of the server
+struct serverClient
+{
+    int fd;             // the connection (-1 once it is closed)
+    int slot;           // its index in server.clients
+    int io[3];          // its stdin, stdout and stderr (/dev/null until it sends them)
+    char* buf;          // what it has sent that has not been run yet
+    size_t used;
+    size_t capacity;
+    struct job* job;    // the line that is running, or null
+    int jobs;           // how many of its jobs (foreground or background) are running
+    int status;         // its $?
+    bool hungUp;        // it has sent everything it is going to
+    bool queued;        // it is in the queue for a free job slot
+    struct serverClient* nextQueued;
+    char* out;          // replies the connection has not taken yet
+    size_t outUsed;
+    size_t outCapacity;
+    uint32_t events;    // what it is registered for with epoll (0 if it is not)
+};
+
+struct server
+{
+    int listenFD;
+    int epollFD;
+    int maxJobs;        // most commands that run at once
+    int running;        // commands that are running
+    struct serverClient** clients;  // indexed by slot (null for a free slot)
+    int numSlots;
+    struct serverClient* queueHead; // clients with a line to run, waiting for a free job slot
+    struct serverClient* queueTail;
+    struct serverClient* turn;      // the client just taken from the queue
+};
+
+struct server server = {-1, -1};
+volatile sig_atomic_t serverStop = 0;
+
+// Handler for SIGTERM and SIGINT in server mode: stop taking commands and
+// shut down (see runExit())
+void handle_serverStop(int signo)
+{
+    serverStop = 1;
 }
 
-// Adds a given pid to the list of pids that are still running
-void addToBackgroundPids(pid_t pid, pid_t* array)
+// Handler for SIGPIPE in server mode, so that writing to a client that has
+// gone away fails with EPIPE instead of killing the server. (Ignoring it
+// would be passed on to the commands; a handler is reset by exec.)
+void handle_SIGPIPE(int signo)
 {
-    // Find the first junk place to store the process id and save it there
-    for (int i = 0; i < MAXCHILDREN; i++) {
-        if (array[i] == UNINITIALIZED_CONST) 
-        {
-            array[i] = pid;
-            break;
-        }
-    }
+}
 
+// Registers a client's connection with epoll for what it needs now: input
+// until it hangs up, and room for output while replies are queued
+void watchClient(struct serverClient* c)
+{
+    uint32_t events = (c->hungUp ? 0 : EPOLLIN) | (c->outUsed > 0 ? EPOLLOUT : 0);
+    if (events == c->events)
+        return;
+    struct epoll_event event = {.events = events, .data.u64 = SERVER_EVENT(EVENT_CLIENT, c->slot)};
+    int op = c->events == 0 ? EPOLL_CTL_ADD : events == 0 ? EPOLL_CTL_DEL : EPOLL_CTL_MOD;
+    epoll_ctl(server.epollFD, op, c->fd, &event);
+    c->events = events;
 }
 
-// Searches for a given pid in the list of pids still running and removes it
-void removeFromBackgroundPids(pid_t pid, pid_t* array)
+// Sends as many of a client's queued replies as its connection will take
+// without blocking. A client that has gone away loses them.
+void flushClient(struct serverClient* c)
 {
-    // Find the pid in the array and replace with junk value
-    for (int i = 0; i < MAXCHILDREN; i++) {
-        if (array[i] == pid)
+    size_t sent = 0;
+    while (sent < c->outUsed)
+    {
+        ssize_t n = send(c->fd, c->out + sent, c->outUsed - sent, MSG_NOSIGNAL | MSG_DONTWAIT);
+        if (n == -1 && errno == EINTR)
+            continue;
+        if (n == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+            break;
+        if (n == -1)
         {
-            array[i] = UNINITIALIZED_CONST;
+            sent = c->outUsed;
             break;
         }
+        sent += n;
     }
+    memmove(c->out, c->out + sent, c->outUsed - sent);
+    c->outUsed -= sent;
+    watchClient(c);
 }
 
-// Prints the given array of child processes that are currently running
-// (For debugging purposes)
-void printRunningChildren(pid_t* backgroundPids)
+// Queues a reply line for a client and sends what its connection will take.
+// A client that does not read its replies only holds up itself: the rest
+// wait in its queue until the connection has room (EPOLLOUT).
+void serverReply(struct serverClient* c, const char* format, ...)
 {
-    for (int i = 0; i < MAXCHILDREN; i++)
+    char line[64];
+    va_list ap;
+    va_start(ap, format);
+    int len = vsnprintf(line, sizeof(line), format, ap);
+    va_end(ap);
+    if (c->fd == -1)
+        return;
+    if (c->outUsed + len > c->outCapacity)
     {
-        if (backgroundPids[i] != UNINITIALIZED_CONST)
-            printf("%d\n", backgroundPids[i]);
+        c->outCapacity = c->outCapacity ? c->outCapacity * 2 : 256;
+        while (c->outUsed + len > c->outCapacity)
+            c->outCapacity *= 2;
+        c->out = realloc(c->out, c->outCapacity);
     }
+    memcpy(c->out + c->outUsed, line, len);
+    c->outUsed += len;
+    flushClient(c);
 }
 
-// Runs the exit command for the shell.
-// This function kills all processes the shell has started before terminating 
-// the shell itself.
-void runExit(pid_t * bgPids)
+// Returns true once a client is done with: it has hung up, its jobs have
+// finished and it has been sent all of its replies
+bool clientFinished(struct serverClient* c)
+{
+    return c->hungUp && c->job == NULL && c->jobs == 0 && !c->queued && c->outUsed == 0;
+}
+
+// Closes a client's connection and descriptors. Its jobs that are still
+// running carry on, reported to no one.
+void closeClient(struct serverClient* c, struct jobTable* jobs)
 {
-    // Loop through pid array and kill those processes
-    for (int i = 0; i < MAXCHILDREN; i++)
+    if (c->jobs > 0)
     {
-        if (bgPids[i] != UNINITIALIZED_CONST)
+        for (struct job* j = jobs->first; j != NULL; j = j->next)
         {
-            kill(bgPids[i], SIGTERM);
+            if (j->client == c->slot)
+                j->client = -1;
         }
     }
-    exit(0); 
+    close(c->fd);
+    for (int i = 0; i < 3; i++)
+        close(c->io[i]);
+    server.clients[c->slot] = NULL;
+    c->fd = -1;
+    free(c->buf);
+    free(c->out);
+    if (!c->queued)     // (otherwise it is freed when it leaves the queue)
+        free(c);
 }
 
-// Handler for SIGTSTP.
-// When the shell receives SIGTSTP, it will toggle the globla variable
-// that tracks the foreground only state.
-void handle_SIGTSTP(int signo)
+// Accepts a client. Its stdin, stdout and stderr are /dev/null until it sends its own.
+void acceptClient()
 {
-    if (foregroundOnlyMode == 0)  
+    int fd = accept4(server.listenFD, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd == -1)
     {
-        foregroundOnlyMode = 1;
-        char* message = "Entering foreground-only mode (& is now ignored)\n: ";
-	    write(STDOUT_FILENO, message, 52);
-    }    
-    else if (foregroundOnlyMode == 1)  
+        if (errno != EAGAIN && errno != EINTR)
+            perror("accept4()");
+        return;
+    }
+
+    int slot = 0;
+    while (slot < server.numSlots && server.clients[slot] != NULL)
+        slot++;
+    if (slot == server.numSlots)
     {
-        foregroundOnlyMode = 0;
-        char* message = "Exiting foreground-only mode\n: ";
-        write(STDOUT_FILENO, message, 32);
+        server.numSlots = server.numSlots ? server.numSlots * 2 : 16;
+        server.clients = realloc(server.clients, server.numSlots * sizeof(struct serverClient*));
+        for (int i = slot; i < server.numSlots; i++)
+            server.clients[i] = NULL;
     }
+
+    struct serverClient* c = calloc(1, sizeof(struct serverClient));
+    c->fd = fd;
+    c->slot = slot;
+    for (int i = 0; i < 3; i++)
+        c->io[i] = open("/dev/null", i == 0 ? O_RDONLY | O_CLOEXEC : O_WRONLY | O_CLOEXEC);
+    server.clients[slot] = c;
+    watchClient(c);
 }
 
-/* 
-Execute a non-built in command.
-This function registers signal handlers for child processes' 
-SIGINT behavior. It then forks a new child process and
-calls an exec() family function to execute the user's desired program.
-Meanwhile, the parent process will block if the process was
-specified to run in the foreground (or if 
-foreground only mode is enabled). If the process was specified to run in the background,
-and foreground only mode is disabled, the program will perform a non-blocking wait. 
- */
-int execute(struct userCommand* com, pid_t* backgroundPids)
+// Runs one of a client's command lines: a command or pipeline is launched
+// (see launchJob()) with the client's descriptors where it has no
+// redirections of its own, and its processes' pidfds are added to the epoll
+// set. A foreground line is answered when its job finishes (see
+// serverJobDone()); anything else is answered at once.
+void runLine(struct serverClient* c, char* line, struct jobTable* jobs, struct arena* a)
 {
-	pid_t spawnpid = UNINITIALIZED_CONST;
-    int childExitMethod;
-    int exitStatus;
-    int result;
-    bool inForeground = !com->bgCommand;
-    struct sigaction ignoreAction = {0};
+    if (line[0] == '\0' || line[0] == '#')
+    {
+        serverReply(c, "status %d\n", c->status);
+        return;
+    }
 
-    // Define SIGINT behavior for a child running in the foreground
-    struct sigaction SIGINT_action = {0};
-    SIGINT_action.sa_handler = SIG_DFL; // set default behavior
-    SIGINT_action.sa_flags = 0; // No flags set
-    
-    // Fork a new process
-    spawnpid = fork();
-    pid_t pidCopy = spawnpid;
+    traceLineStart = traceStart();
+    const int* shellStatus = exitStatus;
+    exitStatus = &c->status;   // $? is the client's
+    uint64_t traced = traceStart();
+    struct userCommand* com = NULL;
+    if (!hasHereDoc(line, strlen(line)))
+        com = parseCommand(a, line);
+    else
+        dprintf(c->io[2], "smallsh: here-documents need a shell of their own\n");
+    traceEnd(TRACE_PARSE, traced);
 
-    switch (spawnpid)
+    enum builtin builtIn = BUILTIN_NONE;
+    if (com != NULL && com->command != NULL && com->next == NULL)
+        builtIn = builtInCommand(com);
+    if (com == NULL)
     {
-        case -1:
-            perror("fork() failed!");
-            exit(1);
-            break;
-
-        // The child will execute user's desired program
-        case 0: 
-            // Set any children to ignore SIGTSP
-            ignoreAction.sa_handler = SIG_IGN;
-            sigaction(SIGTSTP, &ignoreAction, NULL); 
+        c->status = 1;
+    }
+    else if (com->command == NULL)
+    {
+        // Nothing to run
+    }
+    else if (builtIn == BUILTIN_EXIT)   // nothing after it is run
+    {
+        c->hungUp = true;
+        c->used = 0;
+        watchClient(c);
+    }
+    else if (builtIn == BUILTIN_STATUS)
+    {
+        dprintf(c->io[1], "exit status %d\n", c->status);
+    }
+    else if (builtIn != BUILTIN_NONE && builtIn < BUILTIN_ECHO)
+    {
+        // (The utilities run as programs, so that what they write goes to the
+        // client's descriptors and not the server's)
+        dprintf(c->io[2], "%s: not available in server mode\n", com->command);
+        c->status = 2;
+    }
+    else
+    {
+        for (struct userCommand* stage = com; stage != NULL; stage = stage->next)
+        {
+            if (stage == com && !com->bgCommand && stage->inputFile == NULL && stage->hereText == NULL)
+                stage->inputFD = c->io[0];
+            if (stage->next == NULL && stage->outputFile == NULL)
+                stage->outputFD = c->io[1];
+            if (stage->errorFile == NULL)
+                stage->errorFD = c->io[2];
+        }
 
-            // Foreground children will terminate upon receipt of SIGINT. Background children
-            // have inherited parent's behavior and will ignore it.
-            if (inForeground || foregroundOnlyMode)
+        bool lastStarted;
+        struct job* j = launchJob(com, jobs, false, &lastStarted);
+        if (j == NULL)
+        {
+            c->status = 1;
+        }
+        else
+        {
+            // The server is waiting for it, so it is not reported as a notice
+            j->foreground = true;
+            j->client = c->slot;
+            j->exitMethod = lastStarted ? 0 : 1 << 8;   // exit 1 if the last stage did not start
+            c->jobs++;
+            server.running++;
+            for (int i = 0; i < j->numProcesses; i++)
             {
-                sigaction(SIGINT, &SIGINT_action, NULL);    // Register default behavior
+                struct jobProcess* p = &j->procs[i];
+                if (p->pidfd == -1)
+                    p->pidfd = pidfd_open(p->pid, 0);
+                struct epoll_event event = {.events = EPOLLIN, .data.u64 = SERVER_EVENT(EVENT_PROCESS, p->pid)};
+                if (p->pidfd == -1 || epoll_ctl(server.epollFD, EPOLL_CTL_ADD, p->pidfd, &event) == -1)
+                    perror("pidfd");
             }
-
-            // Handle IO redirecton before executing the program
-            redirectInput(com);
-            redirectOutput(com);  // If there was an error redirecting output
-
-            // Attempt to execute the user's specified program
-            if (execvp(com->command, com->complete) < 0)
+            if (com->bgCommand)
             {
-                perror(com->command);
-                exit(1);
+                j->text = jobText(com);
+                lastBackgroundPid = j->procs[j->numProcesses - 1].pid;
+                serverReply(c, "background %d\n", j->pid);
             }
-            break;
-
-        default:    // Parent branch
-            // If user requested a foreground command, or the command must be run in the foreground
-            // because foreground only mode is enabled, then parent will WAIT for the process to end.
-            if (inForeground || foregroundOnlyMode == 1)   
+            else
             {
-                spawnpid = waitpid(spawnpid, &childExitMethod, 0);
-                if (spawnpid != 0) // If waitpid returned a nonzero value, the process has finished
-                { 
-                    if (WIFEXITED(childExitMethod)) // Process exited normally
-                    {
-                        exitStatus = WEXITSTATUS(childExitMethod); 
-                    } 
-                    else    // Process terminated with a signal
-                    {
-                        exitStatus = WTERMSIG(childExitMethod);
-                        printf("terminated by signal %d\n", exitStatus);
-                    }  
-                }       
+                c->job = j;
             }
-            else if (!inForeground && foregroundOnlyMode == 0)   // Running in the background--track the pid and return control to the user
+        }
+    }
+    exitStatus = shellStatus;
+    if (c->job == NULL)
+        serverReply(c, "status %d\n", c->status);
+}
+
+// Runs a client's lines until one has to be waited for, or it has no whole
+// line left, or there is no free job slot (then it joins the queue)
+void runClientLines(struct serverClient* c, struct jobTable* jobs, struct arena* a)
+{
+    size_t start = 0;
+    char* newline;
+
+    while (c->job == NULL && c->fd != -1 && (newline = memchr(c->buf + start, '\n', c->used - start)) != NULL)
+    {
+        // With clients already waiting for a slot, it waits its turn too
+        if (server.running >= server.maxJobs || (server.queueHead != NULL && server.turn != c))
+        {
+            if (!c->queued)
             {
-                printf("background pid is %d\n", spawnpid);
-                addToBackgroundPids(spawnpid, backgroundPids); // save the pid to the background processes array
+                c->queued = true;
+                c->nextQueued = NULL;
+                if (server.queueTail != NULL)
+                    server.queueTail->nextQueued = c;
+                else
+                    server.queueHead = c;
+                server.queueTail = c;
             }
-            return exitStatus;
             break;
-        }   
+        }
+        *newline = '\0';
+        runLine(c, c->buf + start, jobs, a);
+        arenaReset(a);
+        start = newline + 1 - c->buf;
+        if (c->used == 0)    // (exit threw the rest away)
+            start = 0;
+    }
+    memmove(c->buf, c->buf + start, c->used - start);
+    c->used -= start;
+
+    if (clientFinished(c))
+        closeClient(c, jobs);
 }
-  
 
-// Permits the changing of directory. Supports relative and absolute paths.
-int cd(struct userCommand *com)
+// Reads what a client has sent, taking its descriptors if they came with it
+void readClient(struct serverClient* c, struct jobTable* jobs, struct arena* a)
 {
-    int result;
+    if (c->used + 4096 > c->capacity)
+    {
+        c->capacity = c->capacity ? c->capacity * 2 : 8192;
+        c->buf = realloc(c->buf, c->capacity);
+    }
 
-    // If user entered more than one argument, this is an error.
-    if (com->args[1] != NULL)
+    char control[CMSG_SPACE(3 * sizeof(int))];
+    struct iovec iov = {c->buf + c->used, c->capacity - c->used};
+    struct msghdr msg = {.msg_iov = &iov, .msg_iovlen = 1, .msg_control = control, .msg_controllen = sizeof(control)};
+    ssize_t n = recvmsg(c->fd, &msg, MSG_DONTWAIT | MSG_CMSG_CLOEXEC);
+    if (n == -1 && (errno == EAGAIN || errno == EINTR))
+        return;
+
+    struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+    if (n > 0 && cmsg != NULL && cmsg->cmsg_type == SCM_RIGHTS)
     {
-        printf("too many arguments\n"); fflush(stdout);
-        exit(1);
+        int* fds = (int*) CMSG_DATA(cmsg);
+        int numFDs = (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+        for (int i = 0; i < numFDs; i++)
+        {
+            if (i < 3)
+            {
+                close(c->io[i]);
+                c->io[i] = fds[i];
+            }
+            else
+            {
+                close(fds[i]);
+            }
+        }
     }
-    // If user entered no arguments, change to the directory specified in the HOME environment variable
-    else if (com->args[0] == NULL) 
+
+    if (n <= 0)
     {
-        result = chdir(getenv("HOME"));
+        // Hung up (or broken): what is left is run, then the connection closes
+        c->hungUp = true;
+        watchClient(c);
+        if (c->used > 0 && c->buf[c->used - 1] != '\n')
+            c->buf[c->used++] = '\n';
     }
-    // If user entered one argument, it is either an absolute or relative path
     else
     {
-        char* path = com->args[0];
-        printf("You entered the path %s\n", path); fflush(stdout);
-        
-        // User entered an absolute path.
-        if (path[0] == '/' || path[0] == '.') 
+        c->used += n;
+        if (c->used > ZYGOTE_MSG && memchr(c->buf, '\n', c->used) == NULL)
         {
-            result = chdir(path);
+            dprintf(c->io[2], "smallsh: line too long\n");
+            closeClient(c, jobs);
+            return;
         }
-        // User entered a relative path (look within current working directory)
-        else if (path[0] != '.')   
+    }
+    if (!c->queued)
+        runClientLines(c, jobs, a);
+}
+
+// Reaps a process of a client's job whose pidfd has become readable. Once
+// the whole job has finished, it is reported to its client (status for the
+// line it was waiting for, done for a background job), which carries on
+// with its lines; a free job slot goes to the first client in the queue.
+void serverJobDone(pid_t pid, struct jobTable* jobs, struct arena* a)
+{
+    int childExitMethod;
+    struct rusage ru;
+    struct jobProcess* p = findBackgroundPid(pid, jobs);
+    if (p == NULL || wait4(pid, &childExitMethod, WNOHANG, &ru) != pid)
+        return;
+    epoll_ctl(server.epollFD, EPOLL_CTL_DEL, p->pidfd, NULL);
+    backgroundReaped(pid, childExitMethod, &ru, jobs);
+
+    struct job* j = p->job;
+    if (j->running > 0)
+        return;
+    int status = j->timeoutSignals > 0 ? TIMEOUT_STATUS : exitValue(j->exitMethod);
+    struct serverClient* c = j->client != -1 ? server.clients[j->client] : NULL;
+    server.running--;
+    removeFromBackgroundPids(j, jobs);
+
+    if (c != NULL)
+    {
+        c->jobs--;
+        if (c->job == j)
         {
-            // get the current working directory and build it up into an absolute path
-            // by appending '/' and the user's desired directory
-            char absPath[BUFFERSIZE - 3]; // max line length - 3 (for "cd ")
-            getcwd(absPath,sizeof(absPath));
-            strcat(absPath, "/");
-            strcat(absPath, path);
-            result = chdir(absPath);
+            c->job = NULL;
+            c->status = status;
+            serverReply(c, "status %d\n", status);
         }
-        else // User entered something invalid. Try to change directory and print the error.
+        else
         {
-            result = chdir(path);
-        }        
+            serverReply(c, "done %d %d\n", j->pid, status);
+        }
+        if (!c->queued)
+            runClientLines(c, jobs, a);
     }
 
-    if (result != 0) 
+    while (server.queueHead != NULL && server.running < server.maxJobs)
     {
-        perror("Failed to change directory");
-        exit(1);
+        c = server.queueHead;
+        server.queueHead = c->nextQueued;
+        if (server.queueHead == NULL)
+            server.queueTail = NULL;
+        c->queued = false;
+        if (c->fd == -1)
+        {
+            free(c);
+            continue;
+        }
+        server.turn = c;
+        runClientLines(c, jobs, a);
+        server.turn = NULL;
     }
-
-    return result;
 }
 
-// Loops through the given array of process IDs, checking
-// to see if they are still running.
-void backgroundChecker(pid_t *pid_array)
+// Runs the shell as a server on a Unix socket at path (see above) until it
+// is sent SIGTERM or SIGINT, then shuts down like exit
+int runServer(const char* path, struct jobTable* jobs)
 {
-    int childExitMethod;
-    int childStatus;
-    pid_t pid;
-    pid_t pidCopy;
-    int statusVar;  // holds the value that will indicate how the process finished
+    struct sockaddr_un addr = {.sun_family = AF_UNIX};
+    if (strlen(path) >= sizeof(addr.sun_path))
+    {
+        fprintf(stderr, "%s: socket path too long\n", path);
+        return 1;
+    }
+    strcpy(addr.sun_path, path);
+    unlink(path);
+    server.listenFD = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (server.listenFD == -1 || bind(server.listenFD, (struct sockaddr*) &addr, sizeof(addr)) == -1
+        || listen(server.listenFD, SOMAXCONN) == -1)
+    {
+        perror(path);
+        return 1;
+    }
+
+    const char* value = getVariable("SMALLSH_SERVER_JOBS");
+    server.maxJobs = value != NULL ? atoi(value) : sysconf(_SC_NPROCESSORS_ONLN);
+    if (server.maxJobs < 1)
+        server.maxJobs = 1;
+
+    server.epollFD = epoll_create1(EPOLL_CLOEXEC);
+    struct epoll_event event = {.events = EPOLLIN, .data.u64 = SERVER_EVENT(EVENT_LISTEN, 0)};
+    epoll_ctl(server.epollFD, EPOLL_CTL_ADD, server.listenFD, &event);
+
+    struct sigaction stopAction = {0};
+    stopAction.sa_handler = handle_serverStop;
+    sigaction(SIGTERM, &stopAction, NULL);
+    sigaction(SIGINT, &stopAction, NULL);
+    struct sigaction pipeAction = {0};
+    pipeAction.sa_handler = handle_SIGPIPE;
+    sigaction(SIGPIPE, &pipeAction, NULL);
 
-    for (int i = 0; i < MAXCHILDREN; i++)
+    struct arena lineArena;
+    arenaInit(&lineArena, ARENA_SIZE);
+    struct epoll_event events[64];
+    while (!serverStop)
     {
-        if (pid_array[i] != UNINITIALIZED_CONST)   // Check on this pid to see if it finished
+        fillZygotes();
+        int n = epoll_wait(server.epollFD, events, 64, checkDeadlines(jobs));
+        if (n == -1 && errno != EINTR)
         {
-            pid = pid_array[i];
-            pidCopy = pid;
-            childStatus = waitpid(pid, &childExitMethod, WNOHANG);
-            if (childStatus != 0) // If waitpid returned a nonzero value, the process has finished
-            { 
-                // Evaluate exit method
-                if (WIFEXITED(childExitMethod)) // If exited normally
-                {
-                    statusVar = WEXITSTATUS(childExitMethod); 
-                    printf("background pid %d is done: exit value: %d\n", pidCopy, statusVar); fflush(stdout);
-                    removeFromBackgroundPids(pidCopy, pid_array);
-                } 
-                else    // If terminated with a signal
+            perror("epoll_wait()");
+            break;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            uint32_t value = (uint32_t) events[i].data.u64;
+            switch (events[i].data.u64 >> 32)
+            {
+                case EVENT_LISTEN:
+                    acceptClient();
+                    break;
+                case EVENT_CLIENT:
                 {
-                    statusVar = WTERMSIG(childExitMethod); 
-                    printf("background pid %d is done: exit value: %d\n", pidCopy, statusVar); fflush(stdout);
-                    removeFromBackgroundPids(pidCopy, pid_array);
-                }  
-            }             
+                    struct serverClient* c = server.clients[value];
+                    if (c != NULL && (events[i].events & EPOLLOUT))
+                    {
+                        flushClient(c);
+                        if (clientFinished(c))
+                        {
+                            closeClient(c, jobs);
+                            c = NULL;
+                        }
+                    }
+                    if (c != NULL && (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && !c->hungUp)
+                        readClient(c, jobs, &lineArena);
+                    break;
+                }
+                case EVENT_PROCESS:
+                    serverJobDone(value, jobs, &lineArena);
+                    break;
+            }
         }
     }
+
+    // Stop taking commands, tell the clients nothing more, and shut the jobs down
+    close(server.listenFD);
+    unlink(path);
+    for (int i = 0; i < server.numSlots; i++)
+    {
+        if (server.clients[i] != NULL)
+            closeClient(server.clients[i], jobs);
+    }
+    runExit(jobs);
+    return 0;
 }
 
 /* 
 Runs the small shell. Displays a command prompt to the user
-and gets their input. Then executes the command as either a built in function
+and gets their input (or reads a script / -c string without prompting). Then executes the command as either a built in function
 or a non built in function by forking a new process and calling exec. 
 The shell will run until the user chooses to quit by entering exit.
 */
 int main(int argc, char *argv[])
 {
+    cacheShellPid();
+
     // Set the shell to ignore CTRL-C
     struct sigaction ignoreAction = {0};
 	ignoreAction.sa_handler = SIG_IGN;
@@ -553,81 +6247,321 @@ int main(int argc, char *argv[])
 	SIGTSTP_action.sa_flags = SA_RESTART;
 	sigaction(SIGTSTP, &SIGTSTP_action, NULL);  
 
-    pid_t backgroundPids[MAXCHILDREN]; // track the pids still running in the background
-    for (int i = 0; i < MAXCHILDREN; i++) {
-        backgroundPids[i] = UNINITIALIZED_CONST; // initialize background pids to junk values
-    }
+    // Find out when children finish so they can be reaped
+    restartAfterSIGCHLD(true);
+
+    // Job deadlines interrupt the wait for a command line (see armDeadlineTimer())
+    struct sigaction SIGALRM_action = {0};
+    SIGALRM_action.sa_handler = handle_SIGALRM;
+    sigaction(SIGALRM, &SIGALRM_action, NULL);
+
+    struct jobTable backgroundPids; // track the pids still running in the background
+    initJobTable(&backgroundPids);
     int statusVar = 0;  // track the status of most recent call for use in status command
+    exitStatus = &statusVar;
+    initVariables();
+    initDirectories();
 
-    // Display first command prompt
-    printf(": ");   
-    fflush(stdout);
+    // SMALLSH_TRACE=file records how long each phase of every command takes
+    // (summarize the file with smallsh-trace)
+    if (getenv("SMALLSH_TRACE") != NULL)
+        startTrace(getenv("SMALLSH_TRACE"));
+
+    // Pipelines can be given bigger pipe buffers than the kernel default
+    if (getenv("SMALLSH_PIPE_SIZE") != NULL)
+        pipeSize = atoi(getenv("SMALLSH_PIPE_SIZE"));
+
+    // SMALLSH_ZYGOTE=N keeps N pre-forked helpers ready to exec commands
+    if (getenv("SMALLSH_ZYGOTE") != NULL)
+    {
+        zygotes.size = atoi(getenv("SMALLSH_ZYGOTE"));
+        if (zygotes.size < 0)
+            zygotes.size = 0;
+        if (zygotes.size > ZYGOTE_MAX)
+            zygotes.size = ZYGOTE_MAX;
+    }
+
+    // SMALLSH_CGROUP=dir runs every job in a cgroup v2 leaf of its own made
+    // under dir, which must be writable (and have the memory and cpu
+    // controllers enabled for ulimit -m and -C)
+    const char* cgroupBase = getenv("SMALLSH_CGROUP");
+    if (cgroupBase != NULL && cgroupBase[0] != '\0')
+    {
+        char procs[PATH_MAX];
+        snprintf(procs, sizeof(procs), "%s/cgroup.procs", cgroupBase);
+        if (access(procs, W_OK) == 0)
+        {
+            limits.cgroupBase = strdup(cgroupBase);
+            atexit(removeCgroupsAtExit);
+        }
+        else
+        {
+            perror(procs);
+        }
+    }
+
+    // Decide where commands come from:
+    //   smallsh              read from stdin (prompting if it is a terminal)
+    //   smallsh script.sh    read the lines of a script
+    //   smallsh -c commands  run the given command line(s)
+    //   smallsh --listen path  serve clients on a Unix socket (see runServer())
+    struct lineReader reader;
+    if (argc == 1)
+    {
+        interactive = isatty(STDIN_FILENO);
+        readerInitFd(&reader, STDIN_FILENO);
+    }
+    else if (argc == 3 && strcmp(argv[1], "-c") == 0)
+    {
+        readerInitString(&reader, argv[2]);
+    }
+    else if (argc == 3 && strcmp(argv[1], "--listen") == 0)
+    {
+        exit(runServer(argv[2], &backgroundPids));
+    }
+    else if (argc == 2 && argv[1][0] != '-')
+    {
+        int scriptFD = open(argv[1], O_RDONLY | O_CLOEXEC);
+        if (scriptFD == -1)
+        {
+            perror(argv[1]);
+            exit(1);
+        }
+        readerInitFd(&reader, scriptFD);
+    }
+    else
+    {
+        fprintf(stderr, "usage: smallsh [script | -c command | --listen socket]\n");
+        exit(2);
+    }
+    reader.onInterrupt = reportFinishedJobs;
+    reader.interruptArg = &backgroundPids;
+
+    // Interactive shells keep a history in $SMALLSH_HISTORY (~/.smallsh_history
+    // by default; empty to turn it off). Setting SMALLSH_HISTORY turns it on for scripts too.
+    const char* historyPath = getenv("SMALLSH_HISTORY");
+    char defaultHistory[4096];
+    if (historyPath == NULL && interactive && getenv("HOME") != NULL)
+    {
+        snprintf(defaultHistory, sizeof(defaultHistory), "%s/.smallsh_history", getenv("HOME"));
+        historyPath = defaultHistory;
+    }
+    if (historyPath != NULL && historyPath[0] != '\0')
+        initHistory(historyPath);
+
+    // An interactive shell does job control: it waits until it is in the
+    // foreground, then takes a process group of its own and the terminal.
+    // It ignores the signals sent for touching the terminal from the background.
+    if (interactive)
+    {
+        while (tcgetpgrp(STDIN_FILENO) != (shellPgid = getpgrp()))
+            kill(-shellPgid, SIGTTIN);
+        sigaction(SIGTTIN, &ignoreAction, NULL);
+        sigaction(SIGTTOU, &ignoreAction, NULL);
+        if (setpgid(0, 0) == 0)
+            shellPgid = getpid();
+        jobControl = tcsetpgrp(STDIN_FILENO, shellPgid) == 0;
+    }
+
+    // Everything parsed from one line lives in this arena until the command is done
+    struct arena commandArena;
+    arenaInit(&commandArena, ARENA_SIZE);
 
     while (true) 
     {
+        // Clean up any background processes that have finished and report them
+        backgroundChecker(&backgroundPids);
+        flushNotices();
+
+        // Replace the helpers the last command used while nothing is waiting
+        fillZygotes();
+
+        // Display command prompt
+        if (interactive)
+        {
+            printf(": ");
+            fflush(stdout);
+        }
+
         // Get the input from the user
-        ssize_t bytesRead = 0;
-        char *input = NULL;
-        size_t n = 0;
-        bytesRead = getline(&input, &n, stdin); 
+        size_t lineLength;
+        // In notify now mode, jobs finishing while the user types are reported at once
+        bool interruptible = interactive && notices.mode == NOTIFY_NOW;
+        if (interruptible)
+            restartAfterSIGCHLD(false);
+        uint64_t traced = traceStart();
+        armDeadlineTimer(&backgroundPids);
+        char *input = readLine(&reader, &lineLength);
+        if (deadlineTimerArmed)
+        {
+            struct itimerval off = {0};
+            setitimer(ITIMER_REAL, &off, NULL);
+            deadlineTimerArmed = false;
+        }
+        traceEnd(TRACE_READ, traced);
+        if (interruptible)
+            restartAfterSIGCHLD(true);
+        traceLineStart = traceStart();
 
         //Check if shell should act on the input
-        if (bytesRead == -1)        // if getline() failed
+        if (input == NULL)        // if there is no more input
         {
-            perror("Getting input failed");  fflush(stdout);
+            if (interactive)
+            {
+                perror("Getting input failed");  fflush(stdout);
+            }
+            backgroundChecker(&backgroundPids);
+            flushNotices();
             break;
         }
-        else if (bytesRead == 1)    // if user entered nothing (just newline char), ignore and reprompt
+        else if (lineLength == 0)    // if user entered nothing (just newline char), ignore and reprompt
         {
-            printf(": ");   // Display command prompt
-            fflush(stdout);
             continue;
         }
         else if (input[0] == '#')  // If it's a comment line, ignore and reprompt
         {
-            printf(": ");   // Display command prompt
-            fflush(stdout);
             continue;
         } 
-        else if (bytesRead > 2048)
+        else if (lineLength + 1 > 2048)
         {
             printf("Your input was too long\n"); fflush(stdout);
         }
 
-        // Parse the input
-        struct userCommand *com = parseCommand(input);
-        free(input);
+        // Expand history references and remember the line
+        if (history.enabled)
+        {
+            char* expanded = expandHistory(&commandArena, input, &lineLength);
+            if (expanded == NULL)
+            {
+                statusVar = 1;
+                arenaReset(&commandArena);
+                continue;
+            }
+            if (expanded != input && interactive)
+            {
+                printf("%s\n", expanded); fflush(stdout);
+            }
+            input = expanded;
+            addHistory(input, lineLength);
+        }
+
+        // Parse the input (a line with a here-document is parsed from a copy)
+        traced = traceStart();
+        if (hasHereDoc(input, lineLength))
+            input = arenaStrndup(&commandArena, input, lineLength);
+        struct userCommand *com = parseCommand(&commandArena, input);
+        traceEnd(TRACE_PARSE, traced);
+        if (com != NULL && !readHereDocs(com, &reader, &commandArena))
+            com = NULL;
+        if (com == NULL || com->command == NULL)   // a syntax error (or only blanks)
+        {
+            if (com == NULL)
+                statusVar = 1;
+            arenaReset(&commandArena);
+            continue;
+        }
 
         // Act on the input
-        // If command is not built-in, it will be run using a child process and an exec() function
-        if (!builtInCommand(com))
+        // If command is not built-in (or is a pipeline), it will be run using child processes
+        traced = traceStart();
+        enum builtin builtIn = com->next == NULL ? builtInCommand(com) : BUILTIN_NONE;
+        traceEnd(TRACE_BUILTIN, traced);
+        if (builtIn != BUILTIN_NONE && com->cached)     // what it does is not output
         {
-            statusVar = execute(com, backgroundPids); // execute sets the statusVar to the result of its exec() call
+            fprintf(stderr, "cache: %s: a shell builtin cannot be cached\n", com->command);
+            statusVar = 2;
+            arenaReset(&commandArena);
+            continue;
         }
 
-        // Command is built in (exit, status, or cd)
-        // All of these will run in the foreground.
-        else
+        // Built in commands run in the shell, in the foreground. Anything
+        // else (or a pipeline) is run using child processes.
+        int utilityStatus;
+        switch (builtIn)
         {
-            if (strcmp(com->command, "exit") == 0) // Exit command
-            {
-                runExit(backgroundPids);
-            }
-            else if (strcmp(com->command, "cd") == 0) // cd command
-            {
-                cd(com);
-            }
-            else // only remaining built in command is status
-            {
-                printf("exit status %d\n", statusVar); fflush(stdout);
-            }
+            case BUILTIN_NONE:
+                if (com->cached)    // its result may be known already
+                    runCached(com, &backgroundPids, &statusVar, &commandArena);
+                else
+                    execute(com, &backgroundPids, &statusVar); // execute sets the statusVar to the result of a foreground command
+                break;
+            case BUILTIN_EXIT:
+                runExit(&backgroundPids);
+                break;
+            case BUILTIN_CD:
+                statusVar = cd(com);
+                break;
+            case BUILTIN_PUSHD:     // the directory stack
+                statusVar = runPushd(com);
+                break;
+            case BUILTIN_POPD:
+                statusVar = runPopd(com);
+                break;
+            case BUILTIN_DIRS:
+                statusVar = runDirs(com);
+                break;
+            case BUILTIN_PARALLEL:  // parallel job runner
+                runParallel(com, &backgroundPids, &statusVar);
+                break;
+            case BUILTIN_HASH:      // command location cache
+                statusVar = runHash(com);
+                break;
+            case BUILTIN_TIMES:     // CPU time of the shell and its children
+                runTimes();
+                break;
+            case BUILTIN_NOTIFY:    // when finished background jobs are reported
+                statusVar = runNotify(com);
+                break;
+            case BUILTIN_JOBS:      // list the background jobs
+                runJobs(com, &backgroundPids);
+                break;
+            case BUILTIN_FG:        // bring a job to the foreground
+                statusVar = runFg(com, &backgroundPids, statusVar);
+                break;
+            case BUILTIN_BG:        // continue a stopped job in the background
+                statusVar = runBg(com, &backgroundPids);
+                break;
+            case BUILTIN_WAIT:      // wait for background jobs to finish
+                statusVar = runWait(com, &backgroundPids);
+                break;
+            case BUILTIN_HISTORY:   // list or search past commands
+                statusVar = runHistory(com);
+                break;
+            case BUILTIN_EXPORT:    // set variables
+                statusVar = runExport(com);
+                break;
+            case BUILTIN_UNSET:     // remove variables
+                statusVar = runUnset(com);
+                break;
+            case BUILTIN_ULIMIT:    // limit the commands started from now on
+                statusVar = runUlimit(com);
+                break;
+            case BUILTIN_CACHE:     // list or empty the result cache
+                statusVar = runCache(com);
+                break;
+            case BUILTIN_STATUS:    // -v adds resource usage
+                if (statusVar == TIMEOUT_STATUS && lastForeground.timedOut > 0)
+                    printf("exit status %d (timed out after %gs)\n", statusVar, lastForeground.timedOut);
+                else
+                    printf("exit status %d\n", statusVar);
+                fflush(stdout);
+                if (com->args[0] != NULL && strcmp(com->args[0], "-v") == 0)
+                {
+                    printUsage("last foreground command", &lastForeground);
+                    printUsage("last background job", &lastBackground);
+                }
+                break;
+            default:                // echo, true, false, test, [ and pwd
+                utilityStatus = runUtility(com, builtIn);
+                if (utilityStatus == -1)    // arguments only the program handles
+                    execute(com, &backgroundPids, &statusVar);
+                else
+                    statusVar = utilityStatus;
+                break;
         }
 
-        // Check status of background processes, cleaning up any that need to be cleaned
-        backgroundChecker(backgroundPids);
-         
-        printf(": ");   // Display command prompt
-        fflush(stdout);
+        // Release everything that was allocated for this command
+        arenaReset(&commandArena);
     }
-    return 0;
+    return interactive ? 0 : statusVar;
 }
\ No newline at end of file
@@ -0,0 +1,437 @@
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <sys/types.h>
+#include <sys/wait.h>
+#include <sys/time.h>
+#include <sys/stat.h>
+#include <sys/resource.h>
+
+// Functional tests for smallsh.
+// Runs the shell on small scripts and checks what it writes to stdout and
+// the status it exits with. The foreground-only mode is tested by sending
+// SIGTSTP to a running shell, and the shell's peak RSS is checked to stay
+// flat as the number of commands grows.
+// Prints a line for each failed check and a summary, and exits with status 1
+// if anything failed.
+//
+// Usage: tests/test [path/to/smallsh]
+
+#define OUTPUT_MAX 65536    // most stdout kept from one run
+#define RSS_SMALL 1000      // commands in the shorter RSS run
+#define RSS_LARGE 50000     // commands in the longer one
+#define RSS_SLACK 512       // KB the longer run may use on top of the shorter
+
+const char* shell;
+char dir[4096];     // scratch directory the scripts run in
+int checks = 0, failures = 0;
+
+// What a run of the shell did
+struct run
+{
+    pid_t pid;
+    int status;         // as from waitpid()
+    long maxRSS;        // KB
+    char out[OUTPUT_MAX];
+};
+
+// Records the result of one check, printing what went wrong if it failed
+void check(const char* name, bool passed, const char* expected, const char* got)
+{
+    checks++;
+    if (passed)
+        return;
+    failures++;
+    printf("FAIL %s\n  expected: \"%s\"\n  got:      \"%s\"\n", name, expected, got);
+}
+
+// Runs the shell on the script at scriptPath (with stdin /dev/null and
+// stderr discarded) and stores what it did in *r
+void runScriptFile(const char* scriptPath, struct run* r)
+{
+    int out[2];
+    pipe(out);
+    r->pid = fork();
+    if (r->pid == 0)
+    {
+        int devNull = open("/dev/null", O_RDWR);
+        dup2(devNull, STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        dup2(devNull, STDERR_FILENO);
+        close(out[0]);
+        if (chdir(dir) == -1)
+            _exit(127);
+        execl(shell, shell, scriptPath, (char*) NULL);
+        _exit(127);
+    }
+    close(out[1]);
+
+    size_t used = 0;
+    char discard[4096];
+    ssize_t n;
+    while ((n = read(out[0], used < OUTPUT_MAX - 1 ? r->out + used : discard,
+                     used < OUTPUT_MAX - 1 ? OUTPUT_MAX - 1 - used : sizeof(discard))) > 0)
+    {
+        if (used < OUTPUT_MAX - 1)
+            used += n;
+    }
+    r->out[used] = '\0';
+    close(out[0]);
+
+    struct rusage ru;
+    wait4(r->pid, &r->status, 0, &ru);
+    r->maxRSS = ru.ru_maxrss;
+}
+
+// Runs the shell on script (from a file in dir) and stores what it did in *r
+void runScript(const char* script, struct run* r)
+{
+    char scriptPath[4200];
+    snprintf(scriptPath, sizeof(scriptPath), "%s/script.sh", dir);
+    FILE* file = fopen(scriptPath, "w");
+    fputs(script, file);
+    fclose(file);
+    runScriptFile(scriptPath, r);
+    unlink(scriptPath);
+}
+
+// Runs script and checks that it wrote expected to stdout and exited with
+// exitStatus
+void expect(const char* name, const char* script, const char* expected, int exitStatus)
+{
+    static struct run r;
+    runScript(script, &r);
+    check(name, strcmp(r.out, expected) == 0, expected, r.out);
+
+    char want[32], got[32];
+    snprintf(want, sizeof(want), "exit %d", exitStatus);
+    snprintf(got, sizeof(got), WIFEXITED(r.status) ? "exit %d" : "signal %d",
+             WIFEXITED(r.status) ? WEXITSTATUS(r.status) : WTERMSIG(r.status));
+    check(name, strcmp(want, got) == 0, want, got);
+}
+
+// Splitting lines into words, quoting, comments and $$
+void testParsing()
+{
+    static struct run r;
+    char expected[64];
+
+    expect("words", "echo a   b\t c\n", "a b c\n", 0);
+    expect("quotes", "echo 'a  b' \"c  d\" e'f g'h\n", "a  b c  d ef gh\n", 0);
+    expect("comments and blank lines", "# echo no\n\n   \necho yes\n", "yes\n", 0);
+    expect("single quotes keep $$", "echo '$$'\n", "$$\n", 0);
+
+    runScript("echo $$ x$$x\n", &r);
+    snprintf(expected, sizeof(expected), "%d x%dx\n", r.pid, r.pid);
+    check("$$ expansion", strcmp(r.out, expected) == 0, expected, r.out);
+}
+
+// < and > on programs and builtins, and a missing input file
+void testRedirection()
+{
+    expect("redirection",
+           "echo hi > out.txt\n"
+           "cat < out.txt\n"
+           "wc -c < out.txt > count.txt\n"
+           "cat count.txt\n",
+           "hi\n3\n", 0);
+    expect("missing input file", "cat < missing.txt\nstatus\n", "exit status 1\n", 1);
+    expect("unwritable output file", "echo no > /nonexistent/out.txt\nstatus\n", "exit status 1\n", 1);
+}
+
+// & at the end of a line runs the command in the background; anywhere else
+// it is an error
+void testBackground()
+{
+    static struct run r;
+    const char* expected = "background pid is ";
+
+    runScript("sleep 0 &\n", &r);
+    check("background", strncmp(r.out, expected, strlen(expected)) == 0, expected, r.out);
+    expect("& in the middle", "echo a & b\nstatus\n", "exit status 1\n", 1);
+}
+
+// cd, pwd and $PWD
+void testCd()
+{
+    char expected[5 * sizeof(dir) + 64];
+
+    snprintf(expected, sizeof(expected), "%s/sub\n%s/sub\n%s\n%s/home\n%s/home\n", dir, dir, dir, dir, dir);
+    expect("cd", "mkdir sub\ncd sub\npwd\necho $PWD\ncd ..\npwd\ncd\npwd\necho $PWD\n", expected, 0);
+    expect("cd to a missing directory", "cd missing\nstatus\n", "exit status 1\n", 1);
+}
+
+// status after success, failure and a signal
+void testStatus()
+{
+    expect("status at start", "status\n", "exit status 0\n", 0);
+    expect("status after failure", "sh -c 'exit 3'\nstatus\n", "exit status 3\n", 3);
+    expect("status after a signal", "sh -c 'kill -TERM $$'\nstatus\n",
+           "terminated by signal 15\nexit status 15\n", 15);
+    expect("status of a missing program", "no-such-program\nstatus\n", "exit status 1\n", 1);
+}
+
+// The shell's own echo and test behave as /bin/echo and /usr/bin/test do,
+// running the program for anything they do not handle themselves
+void testUtilities()
+{
+    expect("echo options", "echo -n a\necho -e 'b\\tc'\necho -E 'd\\te'\necho -ne 'f\\n'\necho - -x\n",
+           "ab\tc\nd\\te\nf\n- -x\n", 0);
+    expect("test with -a and -o", "test a = a -a b = b\nstatus\n[ a = b -o 1 -lt 2 ]\nstatus\n",
+           "exit status 0\nexit status 0\n", 0);
+    expect("test errors", "test abc -eq 1\nstatus\n[ a = a\nstatus\n", "exit status 2\nexit status 2\n", 2);
+}
+
+// An executable file without a #! line is run with /bin/sh, as execvp()
+// runs it, by every launcher: posix_spawn(), a helper and fork()
+void testScripts()
+{
+    const char* make = "echo 'echo from-script $1' > noshebang.sh\nchmod +x noshebang.sh\n";
+    char script[512];
+
+    snprintf(script, sizeof(script), "%s./noshebang.sh spawn\nstatus\n", make);
+    expect("script without #!", script, "from-script spawn\nexit status 0\n", 0);
+    snprintf(script, sizeof(script), "%sulimit -n 100\n./noshebang.sh helper\ntrue | ./noshebang.sh fork\n", make);
+    expect("script without #! when limited", script, "from-script helper\nfrom-script fork\n", 0);
+}
+
+// parallel gives its commands the same timeout as any other command, and
+// background jobs still time out while it runs
+void testParallelTimeouts()
+{
+    static struct run r;
+
+    expect("parallel with SMALLSH_TIMEOUT", "export SMALLSH_TIMEOUT=0.5\nparallel sleep ::: 10 0\n",
+           "parallel: 2 commands, 1 succeeded, 1 failed (1 timed out)\n", 1);
+
+    runScript("timeout 0.3 sh -c 'trap \"echo killed > k; exit\" TERM; sleep 5 & wait' &\n"
+              "parallel sh -c 'sleep 1; cat k' ::: x\n", &r);
+    check("background timeout during parallel", strstr(r.out, "killed\nparallel: 1 commands, 1 succeeded") != NULL,
+          "killed\nparallel: 1 commands, 1 succeeded, 0 failed", r.out);
+}
+
+// !! and !?text recall entries, but not inside single quotes; a ' inside
+// double quotes does not start one
+void testHistory()
+{
+    char file[4300];
+    snprintf(file, sizeof(file), "%s/history", dir);
+    setenv("SMALLSH_HISTORY", file, 1);
+
+    expect("history expansion", "echo first\necho \"don't\" !!\necho '!!'\nhistory -s don\n",
+           "first\ndon't echo first\n!!\n    4  history -s don\n    2  echo \"don't\" echo first\n", 0);
+
+    unlink(file);
+    snprintf(file, sizeof(file), "%s/history.idx", dir);
+    unlink(file);
+    setenv("SMALLSH_HISTORY", "", 1);
+}
+
+// exit stops the shell (with status 0), and does not leave background jobs
+// running
+void testExit()
+{
+    static struct run r;
+
+    expect("exit", "echo a\nsh -c 'exit 4'\nexit\necho b\n", "a\n", 0);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    runScript("sleep 30 &\nexit\n", &r);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    bool quick = end.tv_sec - start.tv_sec < 10;
+    check("exit ends background jobs", quick && strstr(r.out, "terminated by signal 15") != NULL,
+          "background pid is N ... terminated by signal 15", r.out);
+}
+
+// Reads from fd, appending to out (of size bytes, used so far), until
+// needle has been read or 5 seconds pass. Returns true if it was read.
+bool readUntil(int fd, char* out, size_t size, size_t* used, const char* needle)
+{
+    struct pollfd p = {fd, POLLIN, 0};
+    while (strstr(out, needle) == NULL)
+    {
+        if (poll(&p, 1, 5000) <= 0)
+            return false;
+        ssize_t n = read(fd, out + *used, size - 1 - *used);
+        if (n <= 0)
+            return false;
+        *used += n;
+        out[*used] = '\0';
+    }
+    return true;
+}
+
+// SIGTSTP turns foreground-only mode on (& is ignored) and the next SIGTSTP
+// turns it off again
+void testForegroundOnly()
+{
+    int in[2], out[2];
+    pipe(in);
+    pipe(out);
+    pid_t pid = fork();
+    if (pid == 0)
+    {
+        dup2(in[0], STDIN_FILENO);
+        dup2(out[1], STDOUT_FILENO);
+        close(in[1]);
+        close(out[0]);
+        if (chdir(dir) == -1)
+            _exit(127);
+        execl(shell, shell, (char*) NULL);
+        _exit(127);
+    }
+    close(in[0]);
+    close(out[1]);
+
+    static char text[OUTPUT_MAX];
+    size_t used = 0;
+    text[0] = '\0';
+    const char* entering = "Entering foreground-only mode (& is now ignored)\n";
+    const char* exiting = "Exiting foreground-only mode\n";
+
+    // Wait until the shell is reading lines before signalling it
+    dprintf(in[1], "echo ready\n");
+    readUntil(out[0], text, sizeof(text), &used, "ready\n");
+    kill(pid, SIGTSTP);
+    check("SIGTSTP enters foreground-only mode", readUntil(out[0], text, sizeof(text), &used, entering), entering, text);
+
+    used = 0;
+    text[0] = '\0';
+    dprintf(in[1], "sleep 0 &\necho one\n");
+    readUntil(out[0], text, sizeof(text), &used, "one\n");
+    check("& is ignored in foreground-only mode", strcmp(text, "one\n") == 0, "one\n", text);
+
+    kill(pid, SIGTSTP);
+    check("SIGTSTP exits foreground-only mode", readUntil(out[0], text, sizeof(text), &used, exiting), exiting, text);
+
+    used = 0;
+    text[0] = '\0';
+    dprintf(in[1], "sleep 0 &\necho two\n");
+    readUntil(out[0], text, sizeof(text), &used, "two\n");
+    check("& works again after foreground-only mode", strncmp(text, "background pid is ", 18) == 0,
+          "background pid is N\\ntwo\\n", text);
+
+    dprintf(in[1], "exit\n");
+    close(in[1]);
+    while (read(out[0], text, sizeof(text) - 1) > 0)
+        ;
+    close(out[0]);
+    int status;
+    waitpid(pid, &status, 0);
+    check("exit after foreground-only mode", WIFEXITED(status) && WEXITSTATUS(status) == 0, "exit 0", "other");
+}
+
+// Feeds the shell n command lines of the kind a long script has (builtins,
+// quoting and expansion, and now and then a program) through a pipe, and
+// stores its peak RSS in *r. (A mapped script file would add up to
+// MAP_RELEASE of its own pages, which is not what is being measured.)
+void runManyCommands(int n, struct run* r)
+{
+    static const char* lines[] = {
+        "echo $$ one two 'three  four' \"five $HOME six\" seven\n",
+        "cd .\n",
+        "test -n word\n",
+        "echo \"a long line of quoted text with $$ in it and then some more words\" > /dev/null\n",
+        "status\n",
+    };
+    int in[2];
+    pipe(in);
+    r->pid = fork();
+    if (r->pid == 0)
+    {
+        int devNull = open("/dev/null", O_RDWR);
+        dup2(in[0], STDIN_FILENO);
+        dup2(devNull, STDOUT_FILENO);
+        dup2(devNull, STDERR_FILENO);
+        close(in[1]);
+        if (chdir(dir) == -1)
+            _exit(127);
+        execl(shell, shell, (char*) NULL);
+        _exit(127);
+    }
+    close(in[0]);
+
+    FILE* script = fdopen(in[1], "w");
+    for (int i = 0; i < n; i++)
+        fputs(i % 50 == 49 ? "/bin/true\n" : lines[i % 5], script);
+    fclose(script);
+
+    struct rusage ru;
+    wait4(r->pid, &r->status, 0, &ru);
+    r->maxRSS = ru.ru_maxrss;
+}
+
+// The shell's peak RSS must not grow with the number of commands it runs:
+// each line's memory comes from an arena that is reset after it
+void testFlatRSS()
+{
+    static struct run small, large;
+    runManyCommands(RSS_SMALL, &small);
+    runManyCommands(RSS_LARGE, &large);
+
+    char expected[64], got[128];
+    snprintf(expected, sizeof(expected), "at most %ld KB", small.maxRSS + RSS_SLACK);
+    snprintf(got, sizeof(got), "%ld KB after %d commands (%ld after %d)", large.maxRSS, RSS_LARGE, small.maxRSS, RSS_SMALL);
+    check("peak RSS stays flat", large.maxRSS <= small.maxRSS + RSS_SLACK, expected, got);
+}
+
+int main(int argc, char* argv[])
+{
+    shell = argc > 1 ? argv[1] : "./smallsh";
+    if (access(shell, X_OK) == -1)
+    {
+        perror(shell);
+        return 2;
+    }
+    char* resolved = realpath(shell, NULL);
+    shell = resolved;
+
+    // Scratch space, a HOME for cd, and none of the shell's optional features
+    snprintf(dir, sizeof(dir), "/tmp/smallsh-test-XXXXXX");
+    if (mkdtemp(dir) == NULL)
+    {
+        perror("mkdtemp()");
+        return 2;
+    }
+    char* realDir = realpath(dir, NULL);
+    snprintf(dir, sizeof(dir), "%s", realDir);
+    free(realDir);
+    char home[4200];
+    snprintf(home, sizeof(home), "%s/home", dir);
+    mkdir(home, 0755);
+    setenv("HOME", home, 1);
+    setenv("SMALLSH_HISTORY", "", 1);
+    unsetenv("SMALLSH_TRACE");
+    unsetenv("SMALLSH_ZYGOTE");
+    unsetenv("SMALLSH_CGROUP");
+    signal(SIGPIPE, SIG_IGN);
+
+    testParsing();
+    testRedirection();
+    testBackground();
+    testCd();
+    testStatus();
+    testUtilities();
+    testScripts();
+    testParallelTimeouts();
+    testHistory();
+    testExit();
+    testForegroundOnly();
+    testFlatRSS();
+
+    char command[4300];
+    snprintf(command, sizeof(command), "rm -rf '%s'", dir);
+    system(command);
+    free(resolved);
+
+    printf("%d checks, %d failed\n", checks, failures);
+    return failures > 0;
+}